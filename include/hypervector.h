@@ -5,11 +5,24 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
+
+// number of samples encoded together by the batch paths
+#define HYPERVECTOR_BATCH_SIZE (16)
+
+// upper bound on the threads hypervector_newSeededBasis fills vectors with
+#define HYPERVECTOR_MAX_BASIS_THREADS (64)
+
+// multipliers of hypervector_hashWord, shared with the SIMD generators
+#define HYPERVECTOR_HASH_M1 (0x7feb352d)
+#define HYPERVECTOR_HASH_M2 (0x846ca68b)
 
 typedef struct Hypervector_Basis Hypervector_Basis;
 typedef struct Hypervector_Hypervector Hypervector_Hypervector;
 typedef struct Hypervector_TrainSet Hypervector_TrainSet;
 typedef struct Hypervector_ClassifySet Hypervector_ClassifySet;
+typedef struct Hypervector_Scratch Hypervector_Scratch;
+typedef struct Hypervector_Stream Hypervector_Stream;
 
 struct Hypervector_Hypervector {
     size_t length;
@@ -19,22 +32,139 @@ struct Hypervector_Hypervector {
 struct Hypervector_Basis {
     size_t nInputs;
     size_t nLevels;
+    // NULL for a procedural basis, whose vectors are generated from seed
     Hypervector_Hypervector * basisVectors;
     Hypervector_Hypervector * levelVectors;
+    bool procedural;
+    uint64_t seed;
+    uint32_t basisKey;
+    // optional basisVectors[i] ^ levelVectors[l] table, boundStride qwords
+    // per vector and feature-major; NULL when not built
+    uint64_t * boundVectors;
+    size_t boundStride;
+    // optional per-bit counts of basisVectors[i] ^ levelVectors[0] over all
+    // features, as nBackgroundPlanes bit planes of backgroundStride qwords;
+    // NULL when not built
+    uint64_t * backgroundPlanes;
+    size_t backgroundStride;
+    size_t nBackgroundPlanes;
 };
 
 struct Hypervector_TrainSet {
     size_t nLabels;
     size_t length;
+    // A label's accumulators are int32 in vectors[label] or, in a compact
+    // set, int16 in narrowVectors[label] until they might saturate; the other
+    // pointer is NULL. narrowBounds[label] bounds the magnitudes of the
+    // narrow row.
     int32_t ** vectors;
+    int16_t ** narrowVectors;
+    int32_t * narrowBounds;
+    bool compact;
+    // labels trained or untrained since a classify set was last built or
+    // refreshed from this set
+    bool * dirty;
     size_t nTrainSamples;
 };
 
+// a narrow train row is widened to int32 once its largest magnitude comes
+// within this much of INT16_MAX
+#define HYPERVECTOR_NARROW_HEADROOM (1024)
+
+// most magnitude bit planes the bit-plane classify engine decomposes
+// class vectors into
+#define HYPERVECTOR_MAX_CLASS_PLANES (8)
+
+// labels whose similarities hypervector_classify keeps on the stack
+#define HYPERVECTOR_CLASSIFY_STACK_LABELS (64)
+
+// bytes of class vectors hypervector_scoreBatch applies to a whole tile of
+// queries before moving on; about one L2, since the matrix kernels stream
+// from it at full speed while smaller blocks pay for more partial sums
+#define HYPERVECTOR_SCORE_BLOCK_BYTES (262144)
+
+// longest class index sketch, in qwords
+#define HYPERVECTOR_MAX_INDEX_QWORDS (64)
+
+// labels whose sketch distances hypervector_classifyIndexed keeps on the stack
+#define HYPERVECTOR_INDEX_STACK_LABELS (4096)
+
+// dimensions hypervector_classifyProgressive scores between checks of
+// whether the leading label can still be overtaken; a multiple of 64
+#define HYPERVECTOR_PROGRESSIVE_BLOCK (1024)
+
+// how hypervector_classify scores a query against the class vectors
+enum {
+    HYPERVECTOR_CLASSIFY_INTEGER, // int32 dot product scaled by vector length
+    HYPERVECTOR_CLASSIFY_BINARY,  // Hamming distance to the sign vectors
+    HYPERVECTOR_CLASSIFY_BITPLANE // integer dot product from plane popcounts
+};
+
 struct Hypervector_ClassifySet {
     size_t nLabels;
     size_t length;
     int32_t ** classVectors;
     double * vectorLengths;
+    int engine;
+    // bit j of sign vector l is set if classVectors[l][j] > 0; signStride
+    // qwords per label, contiguous and 64-byte aligned
+    uint64_t * signVectors;
+    size_t signStride;
+    // |classVectors[l][j]| = planeBase[l] + sum over k of 2^k * bit j of
+    // magnitude plane k. Plane k of label l is stored XORed with the sign
+    // vector, at planeVectors + (l * nPlanes + k) * signStride, so every
+    // popcount the dot product needs is a Hamming distance to the query.
+    // planeL1 is the sum of magnitudes and planeCounts the bits set in each
+    // plane. planeVectors is NULL when the magnitudes need more than
+    // HYPERVECTOR_MAX_CLASS_PLANES planes.
+    uint64_t * planeVectors;
+    size_t nPlanes;
+    int64_t * planeBase;
+    int64_t * planeL1;
+    int64_t * planeCounts;
+    // the class vectors again, as one 64-byte aligned matrix of the narrowest
+    // of int8 and int16 that holds every element: element j of label l is at
+    // (j / 64 * nLabels + l) * 64 + j % 64, zero padded to whole chunks of 64,
+    // so one chunk of the query is applied to every label in turn. NULL, with
+    // classMatrixBits 0, when some element needs 32 bits.
+    void * classMatrix;
+    size_t classMatrixBits;
+    // L1 norm and sum of squares of each label's class vector from
+    // progressive block b to the end, at [l * (nNormBlocks + 1) + b]; the
+    // last entry of every label is 0
+    int64_t * remainingNorms;
+    double * remainingEnergy;
+    size_t nNormBlocks;
+    // optional approximate search index: the first indexQwords qwords of
+    // every sign vector, back to back. The indexCandidates labels whose
+    // sketches are nearest the query are rescored exactly. NULL when off.
+    uint64_t * indexSketches;
+    size_t indexQwords;
+    size_t indexCandidates;
+};
+
+// per-thread working memory for the allocation-free encode/classify path;
+// grows on demand but never shrinks
+struct Hypervector_Scratch {
+    size_t capacity;
+    Hypervector_Hypervector vector;
+    Hypervector_Hypervector batch[HYPERVECTOR_BATCH_SIZE];
+    // the encoder's counters, see KERNELS_ENCODE_BUFFER_BYTES
+    uint64_t * encodeBuffer;
+};
+
+// Encoder state kept between consecutive inputs from one source: the per-bit
+// counters of the last input, as nPlanes bit planes of stride qwords, and the
+// level every feature was counted at. A new input only has to move the
+// features whose level changed.
+struct Hypervector_Stream {
+    size_t nPlanes;
+    size_t stride;
+    uint64_t * planes;
+    uint64_t * carry;
+    uint16_t * levels;
+    uint16_t levelOf[256];
+    Hypervector_Hypervector vector;
 };
 
 void hypervector_newVector(Hypervector_Hypervector * vector, size_t length);
@@ -44,14 +174,125 @@ void hypervector_xorVector(Hypervector_Hypervector * dest,
 
 void hypervector_deleteVector(Hypervector_Hypervector * vector);
 
+// random basis seeded from rand(); see hypervector_newSeededBasis
 void hypervector_newBasis(Hypervector_Basis * basis, size_t length,
     size_t nInputs, size_t nLevels);
 
+// Builds a stored basis that depends only on seed: the vectors are those of
+// the procedural basis with the same seed, filled on nThreads threads. The
+// result does not depend on nThreads or the C library. Returns false if the
+// basis is too large, as hypervector_newProceduralBasis.
+bool hypervector_newSeededBasis(Hypervector_Basis * basis, size_t length,
+    size_t nInputs, size_t nLevels, uint64_t seed, size_t nThreads);
+
+// Builds a basis whose basis vectors are never stored: 32-bit word k of
+// basis vector i is hypervector_hashWord(i * nWords + k, basisKey), with
+// nWords = 2 * (length / 64 + 1), and is generated inside the encode loops.
+// The level vectors are derived from the seed too, so the seed alone
+// reproduces the basis. Returns false if the basis is too large to index
+// its words with 32 bits.
+bool hypervector_newProceduralBasis(Hypervector_Basis * basis, size_t length,
+    size_t nInputs, size_t nLevels, uint64_t seed);
+
 void hypervector_deleteBasis(Hypervector_Basis * basis);
 
+// Cuts a stored basis down to its first length dimensions. Encoding is
+// bitwise, so the truncated basis encodes exactly the first length bits of
+// what the full one encodes. Drops the bound table and background planes.
+// Returns false for a procedural basis, whose words depend on the length.
+bool hypervector_truncateBasis(Hypervector_Basis * basis, size_t length);
+
+// copies basis vector i, generating it for a procedural basis, into elems,
+// which must hold length / 64 + 1 qwords
+void hypervector_getBasisVector(Hypervector_Basis * basis, size_t i, uint64_t * elems);
+
+// lowbias32 integer hash; bijective, so distinct counters never collide
+static inline uint32_t hypervector_hashWord(uint32_t counter, uint32_t key) {
+    uint32_t x = counter ^ key;
+    x ^= x >> 16;
+    x *= HYPERVECTOR_HASH_M1;
+    x ^= x >> 15;
+    x *= HYPERVECTOR_HASH_M2;
+    x ^= x >> 16;
+    return x;
+}
+
+// Precomputes the bound vector of every (feature, level) pair so encode reads
+// one vector per feature instead of XORing two. Returns false, leaving the
+// basis on the regular path, if the table would take more than budgetBytes.
+bool hypervector_newBoundTable(Hypervector_Basis * basis, size_t budgetBytes);
+
+void hypervector_deleteBoundTable(Hypervector_Basis * basis);
+
+// Precomputes the encoder counters for an all-background input (every feature
+// at level 0) so sparse inputs are encoded by applying only the features that
+// differ from it. Returns false if the basis has too many inputs for it.
+bool hypervector_newBackground(Hypervector_Basis * basis);
+
+void hypervector_deleteBackground(Hypervector_Basis * basis);
+
 Hypervector_Hypervector hypervector_encode(uint8_t * input, Hypervector_Basis * basis);
 
-void hypervector_newTrainSet(Hypervector_TrainSet * trainSet, size_t length, size_t nLabels);
+// encodes into a vector the caller already allocated with the basis length,
+// using the encoder memory of scratch
+void hypervector_encodeInto(Hypervector_Scratch * scratch, Hypervector_Hypervector * dest,
+    uint8_t * input, Hypervector_Basis * basis);
+
+// encodes nSamples inputs into preallocated vectors, streaming each block of
+// the basis once per tile of samples rather than once per sample
+void hypervector_encodeBatch(Hypervector_Scratch * scratch, Hypervector_Hypervector * dests,
+    uint8_t ** inputs, size_t nSamples, Hypervector_Basis * basis);
+
+void hypervector_newScratch(Hypervector_Scratch * scratch, size_t length);
+
+// makes sure the scratch can hold a vector of the given length
+void hypervector_reserveScratch(Hypervector_Scratch * scratch, size_t length);
+
+void hypervector_deleteScratch(Hypervector_Scratch * scratch);
+
+void hypervector_newStream(Hypervector_Stream * stream, Hypervector_Basis * basis);
+
+// forgets the previous input so the next one is counted in full
+void hypervector_resetStream(Hypervector_Stream * stream, Hypervector_Basis * basis);
+
+// Encodes input into the stream vector by adding and removing the bound
+// vectors of the features whose level changed since the previous input.
+// Returns the number of features that changed.
+size_t hypervector_encodeStream(Hypervector_Stream * stream, uint8_t * input,
+    Hypervector_Basis * basis);
+
+void hypervector_deleteStream(Hypervector_Stream * stream);
+
+// A compact train set starts every label as int16 accumulators, half the
+// memory traffic of int32 ones, and widens a label to int32 before it could
+// saturate, so it trains to exactly the same values.
+void hypervector_newTrainSet(Hypervector_TrainSet * trainSet, size_t length, size_t nLabels,
+    bool compact);
+
+// Private accumulators for one training thread: a train set whose label
+// vectors stay NULL until that label is first trained or untrained, so a
+// thread only pays for the labels it sees.
+void hypervector_newLocalTrainSet(Hypervector_TrainSet * trainSet, size_t length,
+    size_t nLabels, bool compact);
+
+// switches a train set between compact and int32 accumulators; narrowing
+// keeps labels whose magnitudes are already too large for int16 as int32
+void hypervector_setCompact(Hypervector_TrainSet * trainSet, bool compact);
+
+// Allocates the label rows of dest that source has, and widens those that
+// adding source could saturate. Must precede hypervector_addTrainSetRange,
+// which can then be split across threads.
+void hypervector_reserveTrainSet(Hypervector_TrainSet * dest, Hypervector_TrainSet * source);
+
+// adds every allocated label vector of source into dest, widening the rows
+// of dest it could saturate; sample counts are left alone
+void hypervector_addTrainSet(Hypervector_TrainSet * dest, Hypervector_TrainSet * source);
+
+// Adds elements [begin, end) of every allocated label vector of source into
+// dest, like hypervector_addTrainSet but without reserving: the narrow rows
+// of dest wrap unless hypervector_reserveTrainSet(dest, source) came first.
+void hypervector_addTrainSetRange(Hypervector_TrainSet * dest, Hypervector_TrainSet * source,
+    size_t begin, size_t end);
 
 void hypervector_deleteTrainSet(Hypervector_TrainSet * trainSet);
 
@@ -61,15 +302,102 @@ void hypervector_train(Hypervector_TrainSet * trainSet, Hypervector_Hypervector
 void hypervector_untrain(Hypervector_TrainSet * trainSet, Hypervector_Hypervector * vector, 
     size_t label);
 
+// trains vector into label and untrains it from wrongLabel in one pass over
+// both rows; the labels must differ
+void hypervector_retrain(Hypervector_TrainSet * trainSet, Hypervector_Hypervector * vector,
+    size_t label, size_t wrongLabel);
+
 void hypervector_newClassifySet(Hypervector_ClassifySet * classifySet,
     Hypervector_TrainSet * trainSet, int quantize);
 
+// builds a classify set of the first length dimensions of trainSet,
+// quantized and normed over those alone; trainSet is left as it is
+void hypervector_newPrefixClassifySet(Hypervector_ClassifySet * classifySet,
+    Hypervector_TrainSet * trainSet, int quantize, size_t length);
+
 void hypervector_blankClassifySet(Hypervector_ClassifySet * classifySet,
     size_t nLabels, size_t length);
 
 void hypervector_deleteClassifySet(Hypervector_ClassifySet * classifySet);
 
+// (re)derives the sign vectors, magnitude planes, narrow class matrix,
+// progressive block norms and class index sketches from the class vectors
+void hypervector_newSignVectors(Hypervector_ClassifySet * classifySet);
+
+// Requantizes one label of a classify set built from trainSet with the same
+// quantize, and rewrites its rows of the derived layouts in place. Returns
+// false when the label no longer fits the shared plane count or matrix
+// width, leaving those rows for hypervector_finishRefresh to rebuild.
+// Different labels can be refreshed from different threads; the way to find
+// the labels that need it is trainSet -> dirty.
+bool hypervector_refreshLabel(Hypervector_ClassifySet * classifySet,
+    Hypervector_TrainSet * trainSet, int quantize, size_t label);
+
+// ends a refresh: clears the dirty labels of trainSet, and if relayout is
+// set because some hypervector_refreshLabel failed, rebuilds every derived
+// layout, moving a bit-plane set whose planes no longer fit to the integer
+// engine
+void hypervector_finishRefresh(Hypervector_ClassifySet * classifySet,
+    Hypervector_TrainSet * trainSet, bool relayout);
+
+// scores labels with the engine selected in the classify set
 size_t hypervector_classify(Hypervector_ClassifySet * classifySet,
     Hypervector_Hypervector * vector);
 
+// Turns on approximate class search for hypervector_classify: labels are
+// shortlisted by the Hamming distance between the first sketchBits (rounded
+// up to whole qwords) of the query and of their sign vectors, and the
+// nCandidates nearest are rescored with the exact integer similarity. More
+// bits or candidates raise recall and latency. nCandidates of 0, or at least
+// nLabels, turns the index off.
+void hypervector_newClassIndex(Hypervector_ClassifySet * classifySet,
+    size_t sketchBits, size_t nCandidates);
+
+// the label hypervector_classify returns with the index on; requires it
+size_t hypervector_classifyIndexed(Hypervector_ClassifySet * classifySet,
+    Hypervector_Hypervector * vector);
+
+// the label of a full scan with the selected engine, ignoring any index
+size_t hypervector_classifyScan(Hypervector_ClassifySet * classifySet,
+    Hypervector_Hypervector * vector);
+
+// nearest sign vector by Hamming distance, whatever the selected engine
+size_t hypervector_classifyBinary(Hypervector_ClassifySet * classifySet,
+    Hypervector_Hypervector * vector);
+
+// same labels as the integer engine, computing each dot product from
+// popcounts against the magnitude planes; requires planeVectors
+size_t hypervector_classifyPlanes(Hypervector_ClassifySet * classifySet,
+    Hypervector_Hypervector * vector);
+
+// Integer similarities accumulated over blocks of HYPERVECTOR_PROGRESSIVE_BLOCK
+// dimensions. After each block every label's final similarity lies within
+// its remaining L1 norm of its partial one, and scoring stops once the
+// leader's lower bound beats every other label's upper bound, which keeps
+// the label of the integer engine. A positive margin also stops once the
+// leader is ahead of every other label by margin standard deviations of the
+// remaining contribution, taken as a walk of random query signs; that label
+// is approximate. Writes the number of dimensions scored to dimensionsUsed
+// if it is not NULL.
+size_t hypervector_classifyProgressive(Hypervector_ClassifySet * classifySet,
+    Hypervector_Hypervector * vector, double margin, size_t * dimensionsUsed);
+
+// Scores nVectors (at most HYPERVECTOR_BATCH_SIZE) vectors against every label
+// as hypervector_classify's integer engine does, similarity over vector
+// length, into scores[v * nLabels + l]. The class vectors are walked in
+// blocks of HYPERVECTOR_SCORE_BLOCK_BYTES, each applied to every vector
+// while it is in cache.
+void hypervector_scoreBatch(Hypervector_ClassifySet * classifySet,
+    Hypervector_Hypervector * vectors, size_t nVectors, float * scores);
+
+// encodes into the scratch vector and classifies it without touching the heap
+size_t hypervector_classifyWith(Hypervector_Scratch * scratch,
+    Hypervector_ClassifySet * classifySet, Hypervector_Basis * basis,
+    uint8_t * input);
+
+// batch form of hypervector_classifyWith; writes one label per input
+void hypervector_classifyBatch(Hypervector_Scratch * scratch,
+    Hypervector_ClassifySet * classifySet, Hypervector_Basis * basis,
+    uint8_t ** inputs, size_t nSamples, size_t * labels);
+
 #endif // HDC_HYPERVECTOR_H
\ No newline at end of file
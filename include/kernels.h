@@ -0,0 +1,85 @@
+#ifndef HDC_KERNELS_H
+#define HDC_KERNELS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "hypervector.h"
+
+// working memory of one encode call: a tile of bit-plane counters and of
+// active feature lists (see kernels.c)
+#define KERNELS_ENCODE_BUFFER_BYTES (64 * 1024)
+
+// name of the environment variable that forces a kernel variant: one of
+// "scalar", "sse4.2", "avx2", "avx512bw", "avx512vpopcnt" (AVX-512 BW with
+// the VPOPCNTDQ hamming kernel), "avx512" (the better of the two the CPU
+// has) or "auto" (the default)
+#define KERNELS_ENV_VAR "HDC_KERNELS"
+
+typedef struct Kernels_Dispatch Kernels_Dispatch;
+
+// One set of hot-loop kernels compiled for a particular instruction set. The
+// encoders are bit-sliced: per-bit counters are kept as a stack of bit planes,
+// filled by a Harley-Seal carry-save adder tree and thresholded with a
+// bit-plane "count > nInputs / 2" comparison. Encoded bits below the vector
+// length match the original byte-table encoder; padding bits are cleared.
+struct Kernels_Dispatch {
+    const char * name;
+
+    // the encoders keep their counters in buffer, KERNELS_ENCODE_BUFFER_BYTES
+    // of 64-byte aligned memory, rather than on the stack of a pool worker
+    void (*encode)(uint8_t * input, Hypervector_Basis * basis,
+        Hypervector_Hypervector * result, uint64_t * buffer);
+
+    // encodes nSamples inputs, applying each block of basis vectors to a
+    // tile of samples while it is in L1; results must be preallocated
+    void (*encodeBatch)(uint8_t ** inputs, size_t nSamples,
+        Hypervector_Basis * basis, Hypervector_Hypervector * results,
+        uint64_t * buffer);
+
+    // adds sign * (bit ? +1 : -1) to every element of trainVector
+    void (*train)(int32_t * trainVector, const uint8_t * bitArray,
+        size_t length, int32_t sign);
+
+    // adds the bipolar form of bitArray to trainVector and subtracts it from
+    // untrainVector in one pass
+    void (*trainPair)(int32_t * trainVector, int32_t * untrainVector,
+        const uint8_t * bitArray, size_t length);
+
+    // int16 forms of train and trainPair for compact train sets; elements
+    // must stay within int16
+    void (*train16)(int16_t * trainVector, const uint8_t * bitArray,
+        size_t length, int32_t sign);
+    void (*trainPair16)(int16_t * trainVector, int16_t * untrainVector,
+        const uint8_t * bitArray, size_t length);
+
+    // dot product of classVector with the bipolar form of bitArray
+    int64_t (*similarity)(const int32_t * classVector, const uint8_t * bitArray,
+        size_t length);
+
+    uint64_t (*hamming)(const uint64_t * a, const uint64_t * b, size_t nQwords);
+
+    // dot products of every label of a label-interleaved, 64-byte aligned
+    // int8 / int16 class matrix (see Hypervector_ClassifySet) with the bipolar
+    // form of query, which holds nChunks qwords
+    void (*similarityMatrix8)(const int8_t * matrix, size_t nLabels,
+        const uint64_t * query, size_t nChunks, int64_t * similarities);
+    void (*similarityMatrix16)(const int16_t * matrix, size_t nLabels,
+        const uint64_t * query, size_t nChunks, int64_t * similarities);
+};
+
+// returns the named variant, or NULL if it is unknown or the CPU lacks it;
+// "avx512" names the best AVX-512 variant
+const Kernels_Dispatch * kernels_find(const char * name);
+
+// returns the variant forced through KERNELS_ENV_VAR, or else the widest one
+// the CPU supports
+const Kernels_Dispatch * kernels_select(void);
+
+void kernels_use(const Kernels_Dispatch * kernels);
+
+// kernels used by the hypervector_* functions; selected lazily if nothing
+// has called kernels_use yet
+const Kernels_Dispatch * kernels_current(void);
+
+#endif // HDC_KERNELS_H
@@ -9,9 +9,44 @@
 
 #include "hypervector.h"
 
-#define N_THREADS (8)
+// default memory budget for the precomputed bound vector table built by
+// Model_new and Model_load; about one L2, since a table that spills out of
+// it is slower than XORing the basis with the (always hot) level vectors
+#define MODEL_BOUND_TABLE_BUDGET (1 << 20)
+
+// most memory the training threads may spend on private accumulators, which
+// are summed into the train set after each pass; beyond it they train the
+// shared set under per-label locks instead
+#define MODEL_TRAIN_DELTA_BUDGET ((size_t)1 << 28)
+
+// default heap budget for the encoded training samples reused by retrain
+// passes; a larger cache is kept in a memory-mapped temporary file instead
+#define MODEL_ENCODE_CACHE_BUDGET ((size_t)1 << 30)
+
+// classify engine request: one of the HYPERVECTOR_CLASSIFY_* engines, or
+// automatic, which is binary exactly when classVecQuant is 1 and bit-plane
+// for other quantized models whose magnitudes fit in the planes
+#define MODEL_CLASSIFY_AUTO (-1)
 
 typedef struct Model Model;
+typedef struct Model_EncodeCache Model_EncodeCache;
+
+// Training samples encoded by the first pass over them, stride bytes per
+// vector, so that retrain passes only classify and train. The vectors are on
+// the heap, or in an unlinked temporary file mapped into memory when they
+// exceed the budget.
+struct Model_EncodeCache {
+    size_t nItems;
+    size_t stride;
+    uint8_t * vectors;
+    size_t mappedBytes; // 0 for a heap cache
+    size_t nEncoded;    // vectors [0, nEncoded) are filled in
+    // the dataset a cache kept by the model was built from, and the size and
+    // modification time (ns) its features file had then
+    char * featuresFn;
+    int64_t featuresSize;
+    int64_t featuresTime;
+};
 
 struct Model {
     Hypervector_Basis basis;
@@ -19,8 +54,40 @@ struct Model {
     size_t downsize;
     size_t featureSize;
     size_t classVecQuant;
+    int classifyEngine;
+    // approximate class search settings, see Model_setClassIndex
+    size_t indexBits;
+    size_t indexCandidates;
     Hypervector_TrainSet tmpTrainSet;
     bool tmpTrainSetValid;
+    // classifySet was last built from tmpTrainSet, so training it further
+    // only has to refresh the labels that changed
+    bool tmpTrainSetApplied;
+    // the accumulators Model_train last built classifySet from, kept for
+    // Model_testPrefixes and Model_truncate
+    Hypervector_TrainSet trainedSet;
+    bool trainedSetValid;
+    // kept across Model_trainOneIteration calls on the same features file
+    Model_EncodeCache * encodeCache;
+    size_t encodeCacheBudget;
+    // samples per mini-batch of a retrain pass, 0 for the whole pass
+    size_t retrainBatch;
+    // train sets are started compact, see Model_setCompactTrainSet
+    bool compactTrain;
+    // last budget given to Model_setBoundTableBudget, for tables rebuilt later
+    size_t boundTableBudget;
+    // online learning, see Model_partialFit: the set the next publish swaps
+    // in for classifySet, and its labels that are older than classifySet's
+    Hypervector_ClassifySet stagingSet;
+    bool stagingSetValid;
+    bool * stagingStale;
+    size_t publishSamples;
+    size_t publishMilliseconds;
+    size_t samplesSincePublish;
+    double lastPublish;
+    // held for reading while classifySet is in use and for writing while it
+    // changes
+    pthread_rwlock_t servingLock;
 };
 
 struct BenchmarkThroughputJob {
@@ -34,30 +101,217 @@ struct BenchmarkThroughputJob {
 
 void Model_save(Model * model, const char * modelFn);
 
+// Returns NULL if the file holds a procedural basis too large to generate.
 Model * Model_load(const char * modelFn);
 
+// Returns NULL if the basis is too large to index with the 32-bit word
+// counter of the seeded generator.
 Model * Model_new(int hypervectorSize, int inputQuant, int classVectorQuant,
     int featureSize, int nLabels);
 
+// Like Model_new, but the basis is built from seed alone, so the same seed
+// gives the same model on any machine and C library. Returns NULL in the
+// same case.
+Model * Model_newSeeded(int hypervectorSize, int inputQuant, int classVectorQuant,
+    int featureSize, int nLabels, uint64_t seed);
+
+// Like Model_new, but the basis vectors are generated from seed inside the
+// encoder instead of being stored, and Model_save writes only the seed for
+// them. Returns NULL if the basis is too large to generate.
+Model * Model_newProcedural(int hypervectorSize, int inputQuant, int classVectorQuant,
+    int featureSize, int nLabels, uint64_t seed);
+
 int Model_getFeatureSize(Model * model);
 
+int Model_getNLabels(Model * model);
+
+// rebuilds the bound vector table under a new budget (0 drops it); returns 1
+// if the table fits and will be used by encode
+int Model_setBoundTableBudget(Model * model, size_t budgetBytes);
+
+// turns delta encoding of sparse inputs against the all-background input on
+// (the default) or off; returns 1 if it is in use
+int Model_setSparseEncode(Model * model, int enable);
+
+// Selects how Model_classify scores labels: MODEL_CLASSIFY_AUTO (the
+// default), HYPERVECTOR_CLASSIFY_INTEGER, HYPERVECTOR_CLASSIFY_BINARY or
+// HYPERVECTOR_CLASSIFY_BITPLANE. Binary uses a popcount Hamming search over
+// bit-packed class vector signs; it is exact when classVecQuant is 1 and an
+// approximation otherwise. Bit-plane computes the exact integer dot product
+// from popcounts against sign and magnitude planes, and falls back to integer
+// when the magnitudes need more than HYPERVECTOR_MAX_CLASS_PLANES planes. The
+// choice is saved with the model. Returns the engine now in use.
+int Model_setClassifyEngine(Model * model, int engine);
+
+// Shortlists the nCandidates labels whose sign vectors are nearest the query
+// over the first sketchBits dimensions, then rescores only those exactly;
+// see hypervector_newClassIndex. Meant for models with thousands of labels.
+// nCandidates of 0 turns it off. The index is kept across retraining but not
+// saved with the model. Returns 1 if the index is in use.
+int Model_setClassIndex(Model * model, int sketchBits, int nCandidates);
+
+// name of the kernel variant (scalar, sse4.2, avx2, avx512bw, avx512vpopcnt)
+// in use
+const char * Model_getKernelName(Model * model);
+
+// Trains the model from scratch. Classify callers on other threads keep
+// using the previous classify set until the new one is swapped in at the
+// end. The training calls (these two, Model_partialFit and Model_truncate)
+// are made from one thread at a time.
 void Model_train(Model * model, const char * labelsFn, const char * featuresFn,
     int trainSamples, int retrainIterations);
 
+// Runs one training or retraining pass, served like Model_train's. The
+// encoded samples are kept between calls until the features file (by name,
+// size and modification time) or a larger numTrain asks for others.
 void Model_trainOneIteration(Model * model, const char * labelsFn, const char * featuresFn,
     int numTrain);
 
+// Learns from nSamples feature vectors stored back to back in features,
+// accumulating into the same train set as Model_trainOneIteration. With
+// retrain set, only samples the served classify set gets wrong update it, as
+// in a retrain pass; that starts once a set built from these accumulators has
+// been published. Publishes on the cadence of Model_setPublishCadence.
+// Returns the number of samples that updated the model. One learner thread
+// at a time; classify callers on other threads keep using the previous set
+// until the publish swaps it, which only waits for classifies in progress.
+int Model_partialFit(Model * model, uint8_t * features, uint8_t * labels, int nSamples,
+    int retrain);
+
+// Publishes the learned classify set from Model_partialFit once nSamples
+// samples have come in since the last publish, or milliseconds have passed
+// (checked when samples come in); a 0 leaves that trigger out, and with both
+// 0, the default, every call publishes.
+void Model_setPublishCadence(Model * model, int nSamples, int milliseconds);
+
+// publishes what Model_partialFit has learned right away
+void Model_publish(Model * model);
+
+// Splits retrain passes of Model_train and Model_trainOneIteration into
+// mini-batches of batchSize samples: each batch is classified against the
+// classify set left by the previous one, and its corrections are applied
+// before the next. 0, the default, makes the whole pass one batch. Results
+// are the same for any number of threads either way.
+void Model_setRetrainBatch(Model * model, int batchSize);
+
+// Keeps training accumulators as int16 while they fit, halving the memory
+// that training streams through and that per-thread accumulators take, and
+// moves a label to int32 before it could saturate, so trained models are
+// identical either way. Applies to the accumulators Model_trainOneIteration
+// and Model_partialFit keep as well. Off by default.
+void Model_setCompactTrainSet(Model * model, int enable);
+
+// Sets the heap budget of the encoded-sample cache used while retraining,
+// MODEL_ENCODE_CACHE_BUDGET by default, and drops the cache the model keeps
+// for Model_trainOneIteration.
+void Model_setEncodeCacheBudget(Model * model, size_t budgetBytes);
+
 int Model_classify(Model * model, uint8_t * feature);
 
+// Scratch contexts hold the working memory for classification so that
+// Model_classifyWith never allocates; use one per thread. Model_classify
+// keeps a scratch per calling thread internally.
+Hypervector_Scratch * Model_newScratch(Model * model);
+
+void Model_deleteScratch(Hypervector_Scratch * scratch);
+
+int Model_classifyWith(Model * model, Hypervector_Scratch * scratch, uint8_t * feature);
+
+// Scores the integer similarities a block of dimensions at a time and stops
+// once the leading label cannot be overtaken, or, for a positive margin, once
+// it leads every other label by margin standard deviations of what is left;
+// see hypervector_classifyProgressive. A margin of 0 gives the same labels as
+// the integer engine. Writes the number of dimensions scored to
+// dimensionsUsed if it is not NULL.
+int Model_classifyProgressive(Model * model, uint8_t * feature, double margin,
+    int * dimensionsUsed);
+
+// Scores nSamples feature vectors stored back to back in features against
+// every label, filling the nSamples x nLabels row-major matrix scores with the
+// integer engine's similarity over class vector length. If k > 0 and
+// topLabels is not NULL, also writes the k best labels of each sample, best
+// first, to the nSamples x k matrix topLabels (-1 past nLabels). Runs on the
+// thread pool. Returns -1, writing nothing, if nSamples is negative, else 0.
+int Model_scoreBatch(Model * model, uint8_t * features, int nSamples, float * scores,
+    int k, int * topLabels);
+
+// classifies nSamples feature vectors stored back to back in features
+void Model_classifyBatch(Model * model, uint8_t * features, int nSamples, int * labels);
+
+// Streams classify consecutive, slowly changing inputs from one source,
+// re-encoding only the features that changed since the previous call. A
+// stream belongs to one model and one thread at a time.
+Hypervector_Stream * Model_newStream(Model * model);
+
+void Model_resetStream(Model * model, Hypervector_Stream * stream);
+
+void Model_deleteStream(Hypervector_Stream * stream);
+
+int Model_classifyStream(Model * model, Hypervector_Stream * stream, uint8_t * feature);
+
 int Model_test(Model * model, const char * labelsFn, const char * featuresFn,
     int testSamples);
 
+// Classifies up to nTests samples of a dataset with the class index and with
+// the exact scan, reporting the fraction of samples where both agree and
+// the average time of each.
+void Model_benchmarkIndex(Model * model, const char * labelsFn, const char * featuresFn,
+    int nTests, double * recall, double * avgIndexedTime, double * avgExactTime);
+
 void Model_benchmark(Model * model, int nTests, double * avgEncodeLatency,
     double * avgClassifyTime, int fast);
 
 void Model_benchThroughput(Model * model, int nTests, int nThreads,
     double * encodeThroughput, double * classifyThroughput, int fast);
 
+// Tests the model cut down to each of its first lengths[k] dimensions into
+// nCorrect[k]. With a shared random basis the first d bits of an encoding
+// are a valid d-dimensional encoding, so one model trained at the full
+// size gives a size-vs-accuracy curve. Test samples are encoded once; class
+// vectors, quantization and norms are recomputed per prefix from the
+// accumulators of the last Model_train, Model_trainOneIteration or
+// Model_partialFit, or from the class vectors of a loaded model. Returns -1
+// if a length is not in [1, hypervector size] or the samples do not fit in
+// memory, else 0. Not while the model is training.
+int Model_testPrefixes(Model * model, const char * labelsFn, const char * featuresFn,
+    int testSamples, const int * lengths, int nLengths, int * nCorrect);
+
+// Cuts the model down to its first hypervectorSize dimensions, as
+// Model_testPrefixes evaluates them, for a smaller and faster model to
+// serve or save. Scratch contexts stay usable; a stream made before starts
+// over at the new size with its next input.
+// Returns 0 for a procedural basis, which cannot be cut, or a size larger
+// than the current one, else 1.
+int Model_truncate(Model * model, int hypervectorSize);
+
+// Runs a hyperparameter sweep on one dataset: a model for every combination
+// of hypervectorSizes, inputQuants and classVectorQuants, seeded with seed
+// as Model_newSeeded, trained for nIterations Model_trainOneIteration
+// passes over the first trainSamples samples, and tested on the first
+// testSamples test samples after each. Each dataset is loaded once, and
+// configurations that share a basis (all but classVectorQuant equal) share
+// its encoded samples. Configurations are spread across the thread pool,
+// and each one's rows are appended to csvFn as soon as it finishes, in the
+// simResults schema: the ISOLET one, or the MNIST one with its imageSize
+// column when imageSize is positive. Every configuration trains in the
+// default mode of a new model, with int32 accumulators and each retrain pass
+// as one batch; Model_setCompactTrainSet and Model_setRetrainBatch do not
+// apply. Returns the number of configurations run, or -1 if a file
+// cannot be read or written or a basis is too large.
+int Model_sweep(const char * csvFn, const char * trainLabelsFn, const char * trainFeaturesFn,
+    const char * testLabelsFn, const char * testFeaturesFn, int nLabels, int imageSize,
+    const int * hypervectorSizes, int nSizes, const int * inputQuants, int nInputQuants,
+    const int * classVectorQuants, int nClassQuants, int trainSamples, int testSamples,
+    int nIterations, uint64_t seed);
+
+// Sets the number of threads training, testing and batch scoring run on,
+// counting the caller; 0 restores the default (HDC_THREADS or the online
+// CPUs). Returns the resulting width. Not safe while a model is in use.
+int Model_setThreads(int nThreads);
+
+// pins the pool threads to CPUs when enable is nonzero
+void Model_setThreadPinning(int enable);
+
 void Model_delete(Model * model);
 
 #endif // HDC_MODEL_H
\ No newline at end of file
@@ -0,0 +1,38 @@
+#ifndef HDC_POOL_H
+#define HDC_POOL_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// environment variables read when the pool is first sized: the number of
+// threads (default: the online CPUs), and "1" to pin pool thread i to CPU i
+#define POOL_ENV_VAR "HDC_THREADS"
+#define POOL_PIN_ENV_VAR "HDC_PIN_THREADS"
+
+#define POOL_MAX_THREADS (256)
+
+// Processes items [begin, end) on one worker. worker is below pool_nThreads()
+// and only one task call of a run uses it at a time, so it can index
+// per-worker state.
+typedef void (*Pool_Task)(void * arg, size_t worker, size_t begin, size_t end);
+
+// Runs task over items [0, nItems) in chunks of at most chunkSize items on
+// the library-wide pool, the calling thread being worker 0, and returns when
+// every chunk is done. Each worker starts on its own contiguous share of the
+// chunks; a worker that runs out steals the back half of another worker's
+// remaining share, so a slow worker does not stall the run. Runs started from
+// inside a task execute inline on that worker; runs from different threads
+// take turns.
+void pool_run(size_t nItems, size_t chunkSize, Pool_Task task, void * arg);
+
+// number of workers pool_run uses, counting the caller; callable from a task
+size_t pool_nThreads(void);
+
+// Resizes the pool, stopping its threads; they restart on the next run. 0
+// goes back to POOL_ENV_VAR or the online CPUs. Not callable from a task.
+void pool_setThreads(size_t nThreads);
+
+// pins pool threads to CPUs from their next start
+void pool_setPinning(bool pin);
+
+#endif // HDC_POOL_H
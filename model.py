@@ -9,6 +9,12 @@ import os
 class Model:
     lib = ctypes.CDLL(pathlib.Path().absolute() / "bin" / "libmodel.so")
 
+    # classify engines, see setClassifyEngine
+    CLASSIFY_AUTO = -1
+    CLASSIFY_INTEGER = 0
+    CLASSIFY_BINARY = 1
+    CLASSIFY_BITPLANE = 2
+
     def __init__(self, hypervectorSize, inputQuant, classVectorQuant, featureSize, nClasses):
         if (
             hypervectorSize is None and
@@ -21,13 +27,15 @@ class Model:
 
         self.featureSize = featureSize
         self.lib.Model_new.restype = ctypes.c_void_p
-        self.model = self.lib.Model_new(
+        self.model = ctypes.c_void_p(self.lib.Model_new(
             ctypes.c_int(hypervectorSize),
             ctypes.c_int(inputQuant),
             ctypes.c_int(classVectorQuant),
             ctypes.c_int(featureSize),
             ctypes.c_int(nClasses)
-        )
+        ))
+        if not self.model:
+            raise ValueError("basis too large to build")
     
     def train(self, trainSamples, retrainIterations, labelsFn, featuresFn):
         self.lib.Model_train(
@@ -68,6 +76,217 @@ class Model:
 
         return int(result)
     
+    def kernelName(self):
+        '''Returns the name of the SIMD kernel variant in use; set the
+        HDC_KERNELS environment variable before creating or loading a model
+        to force one of scalar, sse4.2, avx2, avx512bw or avx512vpopcnt
+        (avx512 picks the better of the last two)'''
+
+        self.lib.Model_getKernelName.restype = ctypes.c_char_p
+        return self.lib.Model_getKernelName(self.model).decode('utf-8')
+
+    def classifyProgressive(self, features, margin=0.0):
+        '''Classifies with early exit once the leading label can no longer be
+        overtaken (margin=0, exact) or leads by margin standard deviations of
+        the remaining contribution. Returns (label, dimensions scored)'''
+
+        featureArray = (ctypes.c_uint8 * self.featureSize)()
+        for i in range(self.featureSize):
+            featureArray[i] = features[i]
+
+        dimensionsUsed = ctypes.c_int()
+        self.lib.Model_classifyProgressive.restype = ctypes.c_int
+        result = self.lib.Model_classifyProgressive(self.model, featureArray,
+            ctypes.c_double(margin), ctypes.byref(dimensionsUsed))
+
+        return int(result), dimensionsUsed.value
+
+    def classifyBatch(self, featuresList):
+        '''Classifies a list of feature sequences in one library call'''
+
+        nSamples = len(featuresList)
+        featureArray = (ctypes.c_uint8 * (nSamples * self.featureSize))()
+        for i, features in enumerate(featuresList):
+            for j in range(self.featureSize):
+                featureArray[i * self.featureSize + j] = features[j]
+
+        labelArray = (ctypes.c_int * nSamples)()
+        self.lib.Model_classifyBatch(
+            self.model,
+            featureArray,
+            ctypes.c_int(nSamples),
+            labelArray
+        )
+
+        return [int(label) for label in labelArray]
+
+    def scoreBatch(self, featuresList, k=0):
+        '''Scores a list of feature sequences against every label in one
+        library call. Returns a list of per-label score lists and, if k > 0,
+        a list of the k best labels of each sample'''
+
+        nSamples = len(featuresList)
+        self.lib.Model_getNLabels.restype = ctypes.c_int
+        nLabels = int(self.lib.Model_getNLabels(self.model))
+        featureArray = (ctypes.c_uint8 * (nSamples * self.featureSize))()
+        for i, features in enumerate(featuresList):
+            for j in range(self.featureSize):
+                featureArray[i * self.featureSize + j] = features[j]
+
+        scoreArray = (ctypes.c_float * (nSamples * nLabels))()
+        topArray = (ctypes.c_int * (nSamples * k))() if k > 0 else None
+        self.lib.Model_scoreBatch(
+            self.model,
+            featureArray,
+            ctypes.c_int(nSamples),
+            scoreArray,
+            ctypes.c_int(k),
+            topArray
+        )
+
+        scores = [list(scoreArray[i * nLabels:(i + 1) * nLabels]) for i in range(nSamples)]
+        if k <= 0:
+            return scores
+
+        return scores, [list(topArray[i * k:(i + 1) * k]) for i in range(nSamples)]
+
+    def partialFit(self, featuresList, labels, retrain=False):
+        '''Learns from a list of feature sequences and their labels without
+        reloading a dataset; with retrain=True only misclassified samples
+        update the model. Returns the number of samples that did'''
+
+        nSamples = len(featuresList)
+        featureArray = (ctypes.c_uint8 * (nSamples * self.featureSize))()
+        for i, features in enumerate(featuresList):
+            for j in range(self.featureSize):
+                featureArray[i * self.featureSize + j] = features[j]
+        labelArray = (ctypes.c_uint8 * nSamples)(*labels)
+
+        return int(self.lib.Model_partialFit(
+            self.model,
+            featureArray,
+            labelArray,
+            ctypes.c_int(nSamples),
+            ctypes.c_int(int(retrain))
+        ))
+
+    def setPublishCadence(self, nSamples=0, milliseconds=0):
+        '''Makes partialFit publish the classify set every nSamples samples
+        or milliseconds, whichever comes first; 0 leaves a trigger out and
+        both 0 publishes on every call'''
+
+        self.lib.Model_setPublishCadence(
+            self.model,
+            ctypes.c_int(nSamples),
+            ctypes.c_int(milliseconds)
+        )
+
+    def publish(self):
+        self.lib.Model_publish(self.model)
+
+    def newStream(self):
+        '''Returns a handle for classifyStream; consecutive inputs classified
+        through one handle are re-encoded only where they changed'''
+
+        self.lib.Model_newStream.restype = ctypes.c_void_p
+        return ctypes.c_void_p(self.lib.Model_newStream(self.model))
+
+    def classifyStream(self, stream, features):
+        featureArray = (ctypes.c_uint8 * self.featureSize)()
+        for i in range(self.featureSize):
+            featureArray[i] = features[i]
+
+        self.lib.Model_classifyStream.restype = ctypes.c_int
+        result = self.lib.Model_classifyStream(self.model, stream, featureArray)
+
+        return int(result)
+
+    def resetStream(self, stream):
+        self.lib.Model_resetStream(self.model, stream)
+
+    def deleteStream(self, stream):
+        self.lib.Model_deleteStream(stream)
+
+    def setClassifyEngine(self, engine):
+        '''Selects CLASSIFY_INTEGER, CLASSIFY_BINARY (Hamming search over
+        class vector signs; exact for classVectorQuant=2), CLASSIFY_BITPLANE
+        (exact dot product from sign and magnitude bit planes) or
+        CLASSIFY_AUTO. Returns the engine in use'''
+
+        return int(self.lib.Model_setClassifyEngine(self.model, ctypes.c_int(engine)))
+
+    def setClassIndex(self, sketchBits, nCandidates):
+        '''Shortlists the nCandidates labels nearest the query over the first
+        sketchBits dimensions of the class vector signs and rescores only
+        those; nCandidates=0 turns it off. Returns whether it is in use'''
+
+        return bool(self.lib.Model_setClassIndex(
+            self.model,
+            ctypes.c_int(sketchBits),
+            ctypes.c_int(nCandidates)
+        ))
+
+    def benchmarkIndex(self, nTests, labelsFn, featuresFn):
+        '''Returns the fraction of samples the class index labels as the
+        exact scan does, and the average indexed and exact classify times'''
+
+        recall = ctypes.c_double()
+        indexedTime = ctypes.c_double()
+        exactTime = ctypes.c_double()
+
+        self.lib.Model_benchmarkIndex(
+            self.model,
+            ctypes.c_char_p(labelsFn.encode('utf-8')),
+            ctypes.c_char_p(featuresFn.encode('utf-8')),
+            ctypes.c_int(nTests),
+            ctypes.byref(recall),
+            ctypes.byref(indexedTime),
+            ctypes.byref(exactTime)
+        )
+
+        return float(recall.value), float(indexedTime.value), float(exactTime.value)
+
+    def setBoundTableBudget(self, budgetBytes):
+        '''Rebuilds the precomputed (basis XOR level) vector table under a
+        new memory budget; 0 disables it. Returns whether the table fits'''
+
+        return bool(self.lib.Model_setBoundTableBudget(
+            self.model,
+            ctypes.c_size_t(budgetBytes)
+        ))
+
+    def setRetrainBatch(self, batchSize):
+        '''Splits retrain passes into mini-batches of batchSize samples, each
+        corrected against the class vectors left by the one before; 0 makes
+        the whole pass one batch. Results do not depend on the thread count'''
+
+        self.lib.Model_setRetrainBatch(self.model, ctypes.c_int(batchSize))
+
+    def setCompactTrainSet(self, enable=True):
+        '''Keeps training accumulators as int16 until a label could overflow
+        them, then as int32; trained models are unchanged'''
+
+        self.lib.Model_setCompactTrainSet(self.model, ctypes.c_int(1 if enable else 0))
+
+    def setEncodeCacheBudget(self, budgetBytes):
+        '''Sets how much memory the training samples, encoded once and
+        reused by every retrain pass, may take before they are moved to a
+        memory-mapped temporary file'''
+
+        self.lib.Model_setEncodeCacheBudget(
+            self.model,
+            ctypes.c_size_t(budgetBytes)
+        )
+
+    def setSparseEncode(self, enable):
+        '''Turns delta encoding of mostly-background (level 0) inputs on or
+        off. Returns whether it is in use'''
+
+        return bool(self.lib.Model_setSparseEncode(
+            self.model,
+            ctypes.c_int(1 if enable else 0)
+        ))
+
     def benchmark(self, nTests=1000, simulateFastClassify=True):
         '''Returns a tuple of the average encode latency and the average
         classify latench in seconds'''
@@ -103,6 +322,127 @@ class Model:
 
         return float(encodeThroughput.value), float(classifyThroughput.value)
     
+    def testPrefixes(self, hypervectorSizes, testSamples, labelsFn, featuresFn):
+        '''Returns the number of test samples classified correctly by the model
+        cut down to each of its first hypervectorSizes dimensions, without
+        training again'''
+
+        nCorrect = (ctypes.c_int * len(hypervectorSizes))()
+        result = self.lib.Model_testPrefixes(
+            self.model,
+            ctypes.c_char_p(labelsFn.encode('utf-8')),
+            ctypes.c_char_p(featuresFn.encode('utf-8')),
+            ctypes.c_int(testSamples),
+            (ctypes.c_int * len(hypervectorSizes))(*hypervectorSizes),
+            ctypes.c_int(len(hypervectorSizes)),
+            nCorrect
+        )
+        if result != 0:
+            raise ValueError("prefix sizes must be between 1 and the model's size")
+
+        return list(nCorrect)
+
+    def truncate(self, hypervectorSize):
+        '''Cuts the model down to its first hypervectorSize dimensions, as
+        testPrefixes evaluates them. Returns False for a procedural model'''
+
+        return bool(self.lib.Model_truncate(self.model, ctypes.c_int(hypervectorSize)))
+
+    @staticmethod
+    def sweep(csvFn, trainLabelsFn, trainFeaturesFn, testLabelsFn, testFeaturesFn,
+        nClasses, hypervectorSizes, inputQuants, classVectorQuants, iterations,
+        trainSamples, testSamples, seed, imageSize=0):
+        '''Trains a seeded model for every combination of the given sizes and
+        quantizations for iterations trainOneIteration passes, testing after
+        each, and appends the results to csvFn in the simResults format. The
+        dataset is loaded once and encoded once per basis. Returns the number
+        of configurations run'''
+
+        def intArray(values):
+            return (ctypes.c_int * len(values))(*values)
+
+        Model.lib.Model_sweep.restype = ctypes.c_int
+        nConfigs = Model.lib.Model_sweep(
+            ctypes.c_char_p(csvFn.encode('utf-8')),
+            ctypes.c_char_p(trainLabelsFn.encode('utf-8')),
+            ctypes.c_char_p(trainFeaturesFn.encode('utf-8')),
+            ctypes.c_char_p(testLabelsFn.encode('utf-8')),
+            ctypes.c_char_p(testFeaturesFn.encode('utf-8')),
+            ctypes.c_int(nClasses),
+            ctypes.c_int(imageSize),
+            intArray(hypervectorSizes), ctypes.c_int(len(hypervectorSizes)),
+            intArray(inputQuants), ctypes.c_int(len(inputQuants)),
+            intArray(classVectorQuants), ctypes.c_int(len(classVectorQuants)),
+            ctypes.c_int(trainSamples),
+            ctypes.c_int(testSamples),
+            ctypes.c_int(iterations),
+            ctypes.c_uint64(seed)
+        )
+        if nConfigs < 0:
+            raise IOError(f"sweep into {csvFn} failed")
+
+        return nConfigs
+
+    @staticmethod
+    def setThreads(nThreads=0, pin=None):
+        '''Sets the number of threads training, testing and scoreBatch use;
+        0 restores the default, the HDC_THREADS environment variable or the
+        CPU count. pin=True pins them to CPUs. Returns the thread count'''
+
+        if pin is not None:
+            Model.lib.Model_setThreadPinning(ctypes.c_int(int(pin)))
+        return int(Model.lib.Model_setThreads(ctypes.c_int(nThreads)))
+
+    @staticmethod
+    def newSeeded(hypervectorSize, inputQuant, classVectorQuant, featureSize,
+        nClasses, seed, model=None):
+        '''Creates a model whose basis depends only on seed, reproducibly
+        across machines'''
+
+        Model.lib.Model_newSeeded.restype = ctypes.c_void_p
+
+        if model is None:
+            model = Model(None, None, None, None, None)
+
+        model.featureSize = featureSize
+        model.model = ctypes.c_void_p(Model.lib.Model_newSeeded(
+            ctypes.c_int(hypervectorSize),
+            ctypes.c_int(inputQuant),
+            ctypes.c_int(classVectorQuant),
+            ctypes.c_int(featureSize),
+            ctypes.c_int(nClasses),
+            ctypes.c_uint64(seed)
+        ))
+        if not model.model:
+            raise ValueError("basis too large to build")
+
+        return model
+
+    @staticmethod
+    def newProcedural(hypervectorSize, inputQuant, classVectorQuant, featureSize,
+        nClasses, seed, model=None):
+        '''Creates a model whose basis vectors are regenerated from seed
+        instead of being stored in memory and in the model file'''
+
+        Model.lib.Model_newProcedural.restype = ctypes.c_void_p
+
+        if model is None:
+            model = Model(None, None, None, None, None)
+
+        model.featureSize = featureSize
+        model.model = ctypes.c_void_p(Model.lib.Model_newProcedural(
+            ctypes.c_int(hypervectorSize),
+            ctypes.c_int(inputQuant),
+            ctypes.c_int(classVectorQuant),
+            ctypes.c_int(featureSize),
+            ctypes.c_int(nClasses),
+            ctypes.c_uint64(seed)
+        ))
+        if not model.model:
+            raise ValueError("basis too large to generate")
+
+        return model
+
     @staticmethod
     def load(modelFn, model=None):        
         Model.lib.Model_load.restype = ctypes.c_void_p
@@ -110,9 +450,11 @@ class Model:
         if model is None:
             model = Model(None, None, None, None, None)
 
-        model.model = Model.lib.Model_load(
+        model.model = ctypes.c_void_p(Model.lib.Model_load(
             ctypes.c_char_p(modelFn.encode('utf-8')),
-        )
+        ))
+        if not model.model:
+            raise ValueError(f"{modelFn} holds a basis too large to generate")
 
         Model.lib.Model_getFeatureSize.restype = ctypes.c_int
         model.featureSize = int(Model.lib.Model_getFeatureSize(model.model))
@@ -126,7 +468,8 @@ class Model:
         )
 
     def __del__(self):
-        self.lib.Model_delete(self.model)
+        if getattr(self, 'model', None):
+            self.lib.Model_delete(self.model)
 
 class MNIST_Model(Model):
 
@@ -171,6 +514,38 @@ class MNIST_Model(Model):
         imagesFn = f"mnist/test-images-{imageSize}x{imageSize}-10000.idx3-ubyte"
         return Model.test(self, testSamples, labelsFn, imagesFn)
 
+    def benchmarkIndex(self, testSamples=10000):
+        imageSize = int(math.sqrt(self.featureSize))
+
+        labelsFn = f"mnist/test-labels-{imageSize}x{imageSize}-10000.idx1-ubyte"
+        imagesFn = f"mnist/test-images-{imageSize}x{imageSize}-10000.idx3-ubyte"
+        return Model.benchmarkIndex(self, testSamples, labelsFn, imagesFn)
+
+    def testPrefixes(self, hypervectorSizes, testSamples=10000):
+        imageSize = int(math.sqrt(self.featureSize))
+
+        labelsFn = f"mnist/test-labels-{imageSize}x{imageSize}-10000.idx1-ubyte"
+        imagesFn = f"mnist/test-images-{imageSize}x{imageSize}-10000.idx3-ubyte"
+        return Model.testPrefixes(self, hypervectorSizes, testSamples, labelsFn, imagesFn)
+
+    @staticmethod
+    def sweep(csvFn, hypervectorSizes, inputQuants, classVectorQuants, imageSizes,
+        iterations=10, trainSamples=60000, testSamples=10000, seed=1):
+        '''Model.sweep over each of imageSizes, into one CSV'''
+
+        nConfigs = 0
+        for imageSize in imageSizes:
+            size = f"{imageSize}x{imageSize}"
+            nConfigs += Model.sweep(csvFn,
+                f"mnist/train-labels-{size}-60000.idx1-ubyte",
+                f"mnist/train-images-{size}-60000.idx3-ubyte",
+                f"mnist/test-labels-{size}-10000.idx1-ubyte",
+                f"mnist/test-images-{size}-10000.idx3-ubyte",
+                10, hypervectorSizes, inputQuants, classVectorQuants, iterations,
+                trainSamples, testSamples, seed, imageSize)
+
+        return nConfigs
+
     @staticmethod
     def load(modelFn):
         return Model.load(modelFn, MNIST_Model(None, None, None, None))
@@ -209,6 +584,27 @@ class ISOLET_Model(Model):
         featuresFn = "isolet/test-features.idx3-ubyte"
         return Model.test(self, testSamples, labelsFn, featuresFn)
 
+    def benchmarkIndex(self, testSamples=1559):
+        labelsFn = "isolet/test-labels.idx1-ubyte"
+        featuresFn = "isolet/test-features.idx3-ubyte"
+        return Model.benchmarkIndex(self, testSamples, labelsFn, featuresFn)
+
+    def testPrefixes(self, hypervectorSizes, testSamples=1559):
+        labelsFn = "isolet/test-labels.idx1-ubyte"
+        featuresFn = "isolet/test-features.idx3-ubyte"
+        return Model.testPrefixes(self, hypervectorSizes, testSamples, labelsFn, featuresFn)
+
+    @staticmethod
+    def sweep(csvFn, hypervectorSizes, inputQuants, classVectorQuants,
+        iterations=20, trainSamples=6238, testSamples=1559, seed=1):
+        '''Model.sweep on ISOLET'''
+
+        return Model.sweep(csvFn,
+            "isolet/train-labels.idx1-ubyte", "isolet/train-features.idx3-ubyte",
+            "isolet/test-labels.idx1-ubyte", "isolet/test-features.idx3-ubyte",
+            26, hypervectorSizes, inputQuants, classVectorQuants, iterations,
+            trainSamples, testSamples, seed)
+
     @staticmethod
     def load(modelFn):
         return Model.load(modelFn, ISOLET_Model(None, None, None))
@@ -9,41 +9,15 @@
 #include <string.h>
 #include <math.h>
 #include <float.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "hypervector.h"
+#include "kernels.h"
 
 //#define N_LEVELS (2)
 //#define LEVEL_DOWNSCALE (256 / N_LEVELS)
 
-typedef struct Hypervector_Basis Hypervector_Basis;
-typedef struct Hypervector_Hypervector Hypervector_Hypervector;
-typedef struct Hypervector_TrainSet Hypervector_TrainSet;
-typedef struct Hypervector_ClassifySet Hypervector_ClassifySet;
-
-struct Hypervector_Hypervector {
-    size_t length;
-    uint8_t * elems; // bit array
-};
-
-struct Hypervector_Basis {
-    size_t nInputs;
-    size_t nLevels;
-    Hypervector_Hypervector * basisVectors;
-    Hypervector_Hypervector * levelVectors;
-};
-
-struct Hypervector_TrainSet {
-    size_t nLabels;
-    size_t length;
-    int32_t ** vectors;
-    size_t nTrainSamples;
-};
-
-struct Hypervector_ClassifySet {
-    size_t nLabels;
-    size_t length;
-    int32_t ** classVectors;
-    double * vectorLengths;
-};
-
 void hypervector_newVector(Hypervector_Hypervector * vector, size_t length) {
     vector -> length = length;
     vector -> elems = (uint8_t*)malloc(length / 8 + 8);
@@ -67,303 +41,1721 @@ void hypervector_deleteVector(Hypervector_Hypervector * vector) {
     free(vector -> elems);
 }
 
-void hypervector_newBasis(Hypervector_Basis * basis, size_t length,
-    size_t nInputs, size_t nLevels) {
+// counter-based generator: the splitmix64 output for position counter of
+// the sequence selected by seed, so any word can be drawn independently
+static uint64_t hypervector_random(uint64_t seed, uint64_t counter) {
+    uint64_t z = seed + (counter + 1) * 0x9e3779b97f4a7c15;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+}
 
-    size_t lengthBytes = length / 8 + 1;
+// uniform in [0, n) from 64 random bits, without division
+static size_t hypervector_randomBelow(uint64_t random, size_t n) {
+    return (size_t)(((unsigned __int128)random * n) >> 64);
+}
 
-    basis -> nInputs = nInputs;
-    basis -> nLevels = nLevels;
-    basis -> basisVectors = (Hypervector_Hypervector*)
-        malloc(sizeof(Hypervector_Hypervector) * nInputs);
+// Builds the level vectors from seed alone: a random first level, then each
+// level flips the next flipsPerLevel positions of one random permutation of
+// the bit indices, so no bit is flipped twice along the chain.
+static void hypervector_newSeededLevels(Hypervector_Basis * basis, size_t length,
+    size_t nLevels, uint64_t seed) {
 
-    Hypervector_Hypervector * vector = basis -> basisVectors;
-    size_t i; for (i = 0; i < nInputs; i++) {
+    size_t lengthQwords = length / 64 + 1;
+    uint64_t levelSeed = hypervector_random(seed, 1);
+    uint64_t permutationSeed = hypervector_random(seed, 2);
+
+    basis -> levelVectors = (Hypervector_Hypervector*)
+        malloc(sizeof(Hypervector_Hypervector) * nLevels);
+
+    hypervector_newVector(&basis -> levelVectors[0], length);
+    uint64_t * first = (uint64_t *)basis -> levelVectors[0].elems;
+    size_t j; for (j = 0; j < lengthQwords; j++) {
+        first[j] = hypervector_random(levelSeed, j);
+    }
+
+    size_t flipsPerLevel = nLevels > 1 ? length / (nLevels - 1) : 0;
+    size_t nFlips = flipsPerLevel * (nLevels - 1);
+
+    // only the first nFlips positions of the permutation are ever used
+    uint32_t * permutation = (uint32_t*)malloc(sizeof(uint32_t) * length);
+    for (j = 0; j < length; j++) {
+        permutation[j] = (uint32_t)j;
+    }
+    for (j = 0; j < nFlips; j++) {
+        size_t k = j + hypervector_randomBelow(
+            hypervector_random(permutationSeed, j), length - j);
+        uint32_t tmp = permutation[j];
+        permutation[j] = permutation[k];
+        permutation[k] = tmp;
+    }
+
+    size_t l; for (l = 1; l < nLevels; l++) {
+        Hypervector_Hypervector * vector = &basis -> levelVectors[l];
         hypervector_newVector(vector, length);
+        memcpy(vector -> elems, basis -> levelVectors[l - 1].elems,
+            sizeof(uint64_t) * lengthQwords);
 
-        size_t j; for (j = 0; j < lengthBytes; j++) {
-            vector -> elems[j] = rand() & 0xFF;
+        uint64_t * elems = (uint64_t *)vector -> elems;
+        for (j = (l - 1) * flipsPerLevel; j < l * flipsPerLevel; j++) {
+            size_t index = permutation[j];
+            elems[index >> 6] ^= (uint64_t)1 << (index & 63);
         }
+    }
+
+    free(permutation);
+}
 
-        vector++;
+bool hypervector_newProceduralBasis(Hypervector_Basis * basis, size_t length,
+    size_t nInputs, size_t nLevels, uint64_t seed) {
+
+    size_t nWords = 2 * (length / 64 + 1);
+    if (nInputs == 0 || nInputs > UINT32_MAX / nWords || length > UINT32_MAX) {
+        return false;
     }
 
-    // set the first level vector
-    basis -> levelVectors = (Hypervector_Hypervector*)
-        malloc(sizeof(Hypervector_Hypervector) * nLevels);
+    basis -> nInputs = nInputs;
+    basis -> nLevels = nLevels;
+    basis -> boundVectors = NULL;
+    basis -> boundStride = 0;
+    basis -> backgroundPlanes = NULL;
+    basis -> backgroundStride = 0;
+    basis -> nBackgroundPlanes = 0;
+    basis -> procedural = true;
+    basis -> seed = seed;
+    basis -> basisKey = (uint32_t)hypervector_random(seed, 0);
+    basis -> basisVectors = NULL;
+
+    hypervector_newSeededLevels(basis, length, nLevels, seed);
+
+    return true;
+}
 
-    {
-        hypervector_newVector(&basis -> levelVectors[0], length);
-        size_t lengthBytes = length / 8 + 1;
-        size_t j; for (j = 0; j < lengthBytes; j++) {
-            basis -> levelVectors[0].elems[j] = rand() & 0xFF;
-        }
+// word generator behind both procedural and seeded stored bases
+static void hypervector_generateBasisVector(uint32_t basisKey, size_t i,
+    size_t lengthQwords, uint64_t * elems) {
+
+    uint32_t counter = (uint32_t)(i * 2 * lengthQwords);
+    size_t j; for (j = 0; j < lengthQwords; j++, counter += 2) {
+        elems[j] = (uint64_t)hypervector_hashWord(counter, basisKey)
+            | (uint64_t)hypervector_hashWord(counter + 1, basisKey) << 32;
     }
+}
 
-    // construct the other level vectors through bit flips
-    size_t flipsPerLevel = length / (1 * (nLevels - 1));
-    bool * flippedBits = malloc(sizeof(bool) * length);
-    memset(flippedBits, 0, sizeof(bool) * length);
-    Hypervector_Hypervector * prevVector = basis -> levelVectors;
-    vector = prevVector + 1;
-    for (i = 1; i < nLevels; i++) {
-        hypervector_newVector(vector, length);
+void hypervector_getBasisVector(Hypervector_Basis * basis, size_t i, uint64_t * elems) {
+    size_t lengthQwords = basis -> levelVectors[0].length / 64 + 1;
 
-        memcpy(vector -> elems, prevVector -> elems, lengthBytes);
+    if (!basis -> procedural) {
+        memcpy(elems, basis -> basisVectors[i].elems, sizeof(uint64_t) * lengthQwords);
+        return;
+    }
 
-        size_t j; for (j = 0; j < flipsPerLevel; j++) {
-            size_t index = rand() % length;
+    hypervector_generateBasisVector(basis -> basisKey, i, lengthQwords, elems);
+}
 
-            while (flippedBits[index]) {
-                index = (index + 1) % length;
-            }
+struct Hypervector_BasisJob {
+    Hypervector_Basis * basis;
+    size_t begin;
+    size_t end;
+};
 
-            flippedBits[index] = 1;
-            
-            bool prevBit = (vector -> elems[index >> 3] >> (index & 7)) & 1;
-            if (prevBit) {
-                vector -> elems[index >> 3] &= ~(1 << (index & 0x7));
-            }
-            else {
-                vector -> elems[index >> 3] |= (1 << (index & 0x7));
-            }
-        }
+static void * hypervector_basisJob(void * arg) {
+    struct Hypervector_BasisJob * job = (struct Hypervector_BasisJob *)arg;
+    Hypervector_Basis * basis = job -> basis;
+    size_t lengthQwords = basis -> levelVectors[0].length / 64 + 1;
+
+    size_t i; for (i = job -> begin; i < job -> end; i++) {
+        hypervector_generateBasisVector(basis -> basisKey, i, lengthQwords,
+            (uint64_t *)basis -> basisVectors[i].elems);
+    }
+
+    return NULL;
+}
+
+bool hypervector_newSeededBasis(Hypervector_Basis * basis, size_t length,
+    size_t nInputs, size_t nLevels, uint64_t seed, size_t nThreads) {
+
+    // same vectors as the procedural basis of this seed, just stored
+    if (!hypervector_newProceduralBasis(basis, length, nInputs, nLevels, seed)) {
+        return false;
+    }
+
+    basis -> procedural = false;
+    basis -> basisVectors = (Hypervector_Hypervector*)
+        malloc(sizeof(Hypervector_Hypervector) * nInputs);
+
+    size_t i; for (i = 0; i < nInputs; i++) {
+        hypervector_newVector(&basis -> basisVectors[i], length);
+    }
+
+    if (nThreads > HYPERVECTOR_MAX_BASIS_THREADS) {
+        nThreads = HYPERVECTOR_MAX_BASIS_THREADS;
+    }
+    if (nThreads > nInputs) {
+        nThreads = nInputs;
+    }
+    if (nThreads == 0) {
+        nThreads = 1;
+    }
+
+    // every vector depends only on its index, so the split cannot change
+    // the result
+    struct Hypervector_BasisJob jobs[HYPERVECTOR_MAX_BASIS_THREADS];
+    pthread_t threads[HYPERVECTOR_MAX_BASIS_THREADS];
+    bool started[HYPERVECTOR_MAX_BASIS_THREADS];
+    size_t t; for (t = 0; t < nThreads; t++) {
+        jobs[t].basis = basis;
+        jobs[t].begin = nInputs * t / nThreads;
+        jobs[t].end = nInputs * (t + 1) / nThreads;
+    }
 
-        prevVector = vector;
-        vector++;
+    // the calling thread takes the first share, and any share whose thread
+    // could not be started
+    for (t = 1; t < nThreads; t++) {
+        started[t] = pthread_create(&threads[t], NULL,
+            hypervector_basisJob, &jobs[t]) == 0;
+    }
+    hypervector_basisJob(&jobs[0]);
+    for (t = 1; t < nThreads; t++) {
+        if (started[t]) {
+            pthread_join(threads[t], NULL);
+        }
+        else {
+            hypervector_basisJob(&jobs[t]);
+        }
     }
+
+    return true;
+}
+
+void hypervector_newBasis(Hypervector_Basis * basis, size_t length,
+    size_t nInputs, size_t nLevels) {
+
+    // seeded from rand() so srand still makes runs repeatable
+    uint64_t seed = ((uint64_t)rand() << 32) ^ (uint64_t)rand();
+    long nCpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    hypervector_newSeededBasis(basis, length, nInputs, nLevels, seed,
+        nCpus > 0 ? (size_t)nCpus : 1);
 }
 
 void hypervector_deleteBasis(Hypervector_Basis * basis) {
-    size_t i; for (i = 0; i < basis -> nInputs; i++) {
-        hypervector_deleteVector(&basis -> basisVectors[i]);
+    hypervector_deleteBoundTable(basis);
+    hypervector_deleteBackground(basis);
+
+    size_t i;
+    if (!basis -> procedural) {
+        for (i = 0; i < basis -> nInputs; i++) {
+            hypervector_deleteVector(&basis -> basisVectors[i]);
+        }
+        free(basis -> basisVectors);
     }
-    free(basis -> basisVectors);
     for (i = 0; i < basis -> nLevels; i++) {
         hypervector_deleteVector(&basis -> levelVectors[i]);
     }
     free(basis -> levelVectors);
 }
 
-uint64_t encodeBitConversionTable[16] = {
-    0x0, 0x1, 0x10000, 0x10001,
-    0x100000000, 0x100000001, 0x100010000, 0x100010001,
-    0x1000000000000, 0x1000000000001, 0x1000000010000, 0x1000000010001,
-    0x1000100000000, 0x1000100000001, 0x1000100010000, 0x1000100010001
-};
+// clears the bits of vector from length on
+static void hypervector_truncateVector(Hypervector_Hypervector * vector, size_t length) {
+    uint64_t * elems = (uint64_t *)vector -> elems;
 
-Hypervector_Hypervector hypervector_encode(uint8_t * input, Hypervector_Basis * basis) {
-    
+    elems[length / 64] &= ((uint64_t)1 << (length & 63)) - 1;
+    size_t j; for (j = length / 64 + 1; j < vector -> length / 64 + 1; j++) {
+        elems[j] = 0;
+    }
+    vector -> length = length;
+}
+
+bool hypervector_truncateBasis(Hypervector_Basis * basis, size_t length) {
+    if (basis -> procedural || length == 0 || length > basis -> levelVectors[0].length) {
+        return false;
+    }
+
+    hypervector_deleteBoundTable(basis);
+    hypervector_deleteBackground(basis);
+
+    size_t i;
+    for (i = 0; i < basis -> nInputs; i++) {
+        hypervector_truncateVector(&basis -> basisVectors[i], length);
+    }
+    for (i = 0; i < basis -> nLevels; i++) {
+        hypervector_truncateVector(&basis -> levelVectors[i], length);
+    }
+
+    return true;
+}
+
+bool hypervector_newBoundTable(Hypervector_Basis * basis, size_t budgetBytes) {
     size_t nInputs = basis -> nInputs;
-    size_t halfN = nInputs / 2;
-    size_t length = basis -> basisVectors[0].length;
-    size_t lengthBytes = (length / 8) + 1;
+    size_t nLevels = basis -> nLevels;
+    size_t lengthQwords = basis -> levelVectors[0].length / 64 + 1;
 
-    uint16_t * accBuf = (uint16_t*)malloc(sizeof(uint16_t) * (length + 8));
-    memset(accBuf, 0, sizeof(uint16_t) * (length + 8));
-    uint64_t * accBuf_as_u64 = (uint64_t *)accBuf;
+    // whole cache lines per vector so every bound vector starts on one
+    size_t stride = (lengthQwords + 7) & ~(size_t)7;
+    size_t tableBytes = sizeof(uint64_t) * stride * nLevels * nInputs;
 
-    Hypervector_Hypervector dotResult; hypervector_newVector(&dotResult, length);
+    hypervector_deleteBoundTable(basis);
 
-    uint8_t levelDownscale = (256 / basis -> nLevels);
-    size_t i; for (i = 0; i < nInputs; i++) {
-        Hypervector_Hypervector * levelVector = &basis -> levelVectors[input[i] / levelDownscale];
-        Hypervector_Hypervector * basisVector = &basis -> basisVectors[i];
-        
-        hypervector_xorVector(&dotResult, levelVector, basisVector);
+    if (tableBytes > budgetBytes) {
+        return false;
+    }
+
+    uint64_t * table = (uint64_t*)aligned_alloc(64, tableBytes);
+    uint64_t * basisElems = (uint64_t*)malloc(sizeof(uint64_t) * lengthQwords);
+    if (table == NULL || basisElems == NULL) {
+        free(table);
+        free(basisElems);
+        return false;
+    }
 
-        uint8_t * bitArray = dotResult.elems;
-        size_t j; for (j = 0; j < lengthBytes; j++) {
-            uint8_t val = bitArray[j];
+    size_t i; for (i = 0; i < nInputs; i++) {
+        hypervector_getBasisVector(basis, i, basisElems);
 
-            uint64_t low = encodeBitConversionTable[val & 0xF];
-            uint64_t hi = encodeBitConversionTable[val >> 4];
+        size_t l; for (l = 0; l < nLevels; l++) {
+            uint64_t * levelElems = (uint64_t *)basis -> levelVectors[l].elems;
+            uint64_t * bound = table + (i * nLevels + l) * stride;
 
-            accBuf_as_u64[2 * j] += low;
-            accBuf_as_u64[2 * j + 1] += hi;
+            size_t j; for (j = 0; j < stride; j++) {
+                bound[j] = j < lengthQwords ? basisElems[j] ^ levelElems[j] : 0;
+            }
         }
     }
 
-    Hypervector_Hypervector vector = dotResult; // move operation (don't delete dotResult)
+    free(basisElems);
 
-    size_t j; for (j = 0; j < length; j++) {
-        if (accBuf[j] > halfN) {
-            vector.elems[j >> 3] |= (1 << (j & 0x7));
+    basis -> boundVectors = table;
+    basis -> boundStride = stride;
+
+    return true;
+}
+
+void hypervector_deleteBoundTable(Hypervector_Basis * basis) {
+    free(basis -> boundVectors);
+    basis -> boundVectors = NULL;
+    basis -> boundStride = 0;
+}
+
+// number of bit planes needed to hold a count of up to nInputs
+static size_t hypervector_countPlanes(size_t nInputs) {
+    size_t nPlanes = 1;
+    while ((nInputs >> nPlanes) != 0) {
+        nPlanes++;
+    }
+
+    return nPlanes;
+}
+
+bool hypervector_newBackground(Hypervector_Basis * basis) {
+    size_t nInputs = basis -> nInputs;
+    size_t length = basis -> levelVectors[0].length;
+    size_t lengthQwords = length / 64 + 1;
+
+    hypervector_deleteBackground(basis);
+
+    // the encoders index active features with 16 bits
+    if (nInputs == 0 || nInputs > UINT16_MAX) {
+        return false;
+    }
+
+    size_t nPlanes = hypervector_countPlanes(nInputs);
+
+    uint32_t * counts = (uint32_t*)calloc(lengthQwords * 64, sizeof(uint32_t));
+    uint64_t * planes = (uint64_t*)calloc(nPlanes * lengthQwords, sizeof(uint64_t));
+    uint64_t * basisElems = (uint64_t*)malloc(sizeof(uint64_t) * lengthQwords);
+    if (counts == NULL || planes == NULL || basisElems == NULL) {
+        free(counts);
+        free(planes);
+        free(basisElems);
+        return false;
+    }
+
+    uint64_t * levelElems = (uint64_t *)basis -> levelVectors[0].elems;
+    size_t i; for (i = 0; i < nInputs; i++) {
+        hypervector_getBasisVector(basis, i, basisElems);
+
+        size_t j; for (j = 0; j < lengthQwords; j++) {
+            uint64_t bound = basisElems[j] ^ levelElems[j];
+
+            size_t b; for (b = 0; b < 64; b++) {
+                counts[j * 64 + b] += (bound >> b) & 1;
+            }
         }
-        else {
-            vector.elems[j >> 3] &= ~(1 << (j & 0x7));
+    }
+
+    size_t p; for (p = 0; p < nPlanes; p++) {
+        size_t j; for (j = 0; j < lengthQwords; j++) {
+            uint64_t plane = 0;
+
+            size_t b; for (b = 0; b < 64; b++) {
+                plane |= (uint64_t)((counts[j * 64 + b] >> p) & 1) << b;
+            }
+
+            planes[p * lengthQwords + j] = plane;
         }
     }
 
-    free(accBuf);
+    free(counts);
+    free(basisElems);
+
+    basis -> backgroundPlanes = planes;
+    basis -> backgroundStride = lengthQwords;
+    basis -> nBackgroundPlanes = nPlanes;
+
+    return true;
+}
+
+void hypervector_deleteBackground(Hypervector_Basis * basis) {
+    free(basis -> backgroundPlanes);
+    basis -> backgroundPlanes = NULL;
+    basis -> backgroundStride = 0;
+    basis -> nBackgroundPlanes = 0;
+}
+
+Hypervector_Hypervector hypervector_encode(uint8_t * input, Hypervector_Basis * basis) {
+
+    size_t length = basis -> levelVectors[0].length;
+
+    Hypervector_Hypervector vector; hypervector_newVector(&vector, length);
+    uint64_t * buffer = (uint64_t*)aligned_alloc(64, KERNELS_ENCODE_BUFFER_BYTES);
+    kernels_current() -> encode(input, basis, &vector, buffer);
+    free(buffer);
 
     return vector;
 }
 
-void hypervector_newTrainSet(Hypervector_TrainSet * trainSet, size_t length, size_t nLabels) {
-    trainSet -> nLabels = nLabels;
-    trainSet -> length = length;
-    trainSet -> vectors = (int32_t**)malloc(sizeof(int32_t*) * nLabels);
-    trainSet -> nTrainSamples = 0;
+void hypervector_encodeInto(Hypervector_Scratch * scratch, Hypervector_Hypervector * dest,
+    uint8_t * input, Hypervector_Basis * basis) {
 
-    size_t i; for (i = 0; i < nLabels; i++) {
-        trainSet -> vectors[i] = (int32_t*)malloc(sizeof(int32_t) * length);
-        memset(trainSet -> vectors[i], 0, sizeof(int32_t) * length);
+    kernels_current() -> encode(input, basis, dest, scratch -> encodeBuffer);
+}
+
+void hypervector_encodeBatch(Hypervector_Scratch * scratch, Hypervector_Hypervector * dests,
+    uint8_t ** inputs, size_t nSamples, Hypervector_Basis * basis) {
+
+    if (nSamples > 0) {
+        kernels_current() -> encodeBatch(inputs, nSamples, basis, dests,
+            scratch -> encodeBuffer);
     }
 }
 
-void hypervector_deleteTrainSet(Hypervector_TrainSet * trainSet) {
-    size_t i; for (i = 0; i < trainSet -> nLabels; i++) {
-        free(trainSet -> vectors[i]);
+void hypervector_newScratch(Hypervector_Scratch * scratch, size_t length) {
+    scratch -> capacity = length;
+    scratch -> encodeBuffer = (uint64_t*)aligned_alloc(64, KERNELS_ENCODE_BUFFER_BYTES);
+    hypervector_newVector(&scratch -> vector, length);
+
+    size_t i; for (i = 0; i < HYPERVECTOR_BATCH_SIZE; i++) {
+        hypervector_newVector(&scratch -> batch[i], length);
     }
-    free(trainSet -> vectors);
 }
 
-void hypervector_train(Hypervector_TrainSet * trainSet, Hypervector_Hypervector * vector, 
-    size_t label) {
-    
-    size_t length = vector -> length;
+void hypervector_reserveScratch(Hypervector_Scratch * scratch, size_t length) {
+    if (length > scratch -> capacity) {
+        hypervector_deleteScratch(scratch);
+        hypervector_newScratch(scratch, length);
+    }
 
-    uint8_t * bitArray = vector -> elems;
-    int32_t * trainVector = trainSet -> vectors[label];
+    scratch -> vector.length = length;
 
-    size_t i; for (i = 0; i < length; i++) {
-        bool elem = (bitArray[i >> 3] >> (i & 0x7)) & 1;
-        trainVector[i] += elem ? 1 : -1;
+    size_t i; for (i = 0; i < HYPERVECTOR_BATCH_SIZE; i++) {
+        scratch -> batch[i].length = length;
     }
+}
 
-    trainSet -> nTrainSamples++;
+void hypervector_deleteScratch(Hypervector_Scratch * scratch) {
+    free(scratch -> encodeBuffer);
+    hypervector_deleteVector(&scratch -> vector);
+
+    size_t i; for (i = 0; i < HYPERVECTOR_BATCH_SIZE; i++) {
+        hypervector_deleteVector(&scratch -> batch[i]);
+    }
 }
 
-void hypervector_untrain(Hypervector_TrainSet * trainSet, Hypervector_Hypervector * vector, 
-    size_t label) {
-    
-    size_t length = vector -> length;
+// level marking a feature that is not in the stream counters yet
+#define HYPERVECTOR_NO_LEVEL (UINT16_MAX)
 
-    uint8_t * bitArray = vector -> elems;
-    int32_t * trainVector = trainSet -> vectors[label];
+void hypervector_newStream(Hypervector_Stream * stream, Hypervector_Basis * basis) {
+    size_t length = basis -> levelVectors[0].length;
 
-    size_t i; for (i = 0; i < length; i++) {
-        bool elem = (bitArray[i >> 3] >> (i & 0x7)) & 1;
-        trainVector[i] += elem ? -1 : +1;
+    stream -> nPlanes = hypervector_countPlanes(basis -> nInputs);
+    stream -> stride = length / 64 + 1;
+    stream -> planes = (uint64_t*)malloc(
+        sizeof(uint64_t) * stream -> nPlanes * stream -> stride);
+    stream -> carry = (uint64_t*)malloc(sizeof(uint64_t) * 3 * stream -> stride);
+    stream -> levels = (uint16_t*)malloc(sizeof(uint16_t) * basis -> nInputs);
+    hypervector_newVector(&stream -> vector, length);
+
+    size_t nLevels = basis -> nLevels;
+    size_t levelDownscale = 256 / nLevels;
+    if (levelDownscale == 0) {
+        levelDownscale = 1;
     }
 
-    trainSet -> nTrainSamples++;
-}
+    size_t v; for (v = 0; v < 256; v++) {
+        size_t level = v / levelDownscale;
+        stream -> levelOf[v] = level < nLevels ? level : nLevels - 1;
+    }
 
-void hypervector_newClassifySet(Hypervector_ClassifySet * classifySet,
-    Hypervector_TrainSet * trainSet, int quantize) {
-    
-    size_t nLabels = trainSet -> nLabels;
-    size_t length = trainSet -> length;
+    hypervector_resetStream(stream, basis);
+}
 
-    classifySet -> nLabels = nLabels;
-    classifySet -> length = length;
-    classifySet -> classVectors = (int32_t**)malloc(sizeof(int32_t*) * nLabels);
-    classifySet -> vectorLengths = (double*)malloc(sizeof(double) * nLabels);
+void hypervector_resetStream(Hypervector_Stream * stream, Hypervector_Basis * basis) {
+    size_t planesBytes = sizeof(uint64_t) * stream -> nPlanes * stream -> stride;
 
-    size_t i; for (i = 0; i < nLabels; i++) {
-        double vectorLength = 0.0;
+    // the background counters are the state after an all-level-0 input
+    if (basis -> backgroundPlanes != NULL) {
+        memcpy(stream -> planes, basis -> backgroundPlanes, planesBytes);
+        memset(stream -> levels, 0, sizeof(uint16_t) * basis -> nInputs);
+    }
+    else {
+        memset(stream -> planes, 0, planesBytes);
 
-        int32_t maxVal = 0;
-        size_t j;
-        for (j = 0; j < length; j++) {
-            int32_t val = trainSet -> vectors[i][j];
-            
-            if (abs(val) > maxVal) {
-                maxVal = abs(val);
-            }
+        size_t i; for (i = 0; i < basis -> nInputs; i++) {
+            stream -> levels[i] = HYPERVECTOR_NO_LEVEL;
         }
+    }
+}
 
-        double divisor;
-        if (quantize != 0) {
-            divisor = (double)(maxVal + 1)/(double)quantize;
-        }
+// Moves feature i of the counters from level prevLevel to level: bits set
+// only in the new bound vector count up, bits set only in the old one count
+// down. The two sets are disjoint, so the carry and the borrow ripple through
+// the planes together, a whole plane at a time so the inner loop has no
+// data-dependent branches and vectorizes.
+static void hypervector_streamMove(Hypervector_Stream * stream,
+    Hypervector_Basis * basis, size_t i, uint16_t prevLevel, uint16_t level) {
+
+    size_t nPlanes = stream -> nPlanes;
+    size_t stride = stream -> stride;
+    uint64_t * carry = stream -> carry;
+    uint64_t * borrow = stream -> carry + stride;
+    uint64_t * basisElems = stream -> carry + 2 * stride;
+
+    hypervector_getBasisVector(basis, i, basisElems);
+    const uint64_t * levelElems = (const uint64_t *)basis -> levelVectors[level].elems;
+
+    size_t j; for (j = 0; j < stride; j++) {
+        carry[j] = basisElems[j] ^ levelElems[j];
+        borrow[j] = 0;
+    }
 
-        int32_t * classVector = (int32_t*)malloc(sizeof(int32_t) * length);
+    if (prevLevel != HYPERVECTOR_NO_LEVEL) {
+        const uint64_t * prevElems =
+            (const uint64_t *)basis -> levelVectors[prevLevel].elems;
 
-        for (j = 0; j < length; j++) {
-            int32_t val = trainSet -> vectors[i][j];
+        for (j = 0; j < stride; j++) {
+            uint64_t prev = basisElems[j] ^ prevElems[j];
+            borrow[j] = prev & ~carry[j];
+            carry[j] &= ~prev;
+        }
+    }
 
-            if (quantize != 0) {
-                if (val > 0) {
-                    val = floor((double)val / divisor) + 1;
-                }
-                else {
-                    val = -floor((double)(-val) / divisor) - 1;
-                }
-            }
+    size_t p; for (p = 0; p < nPlanes; p++) {
+        uint64_t * plane = stream -> planes + p * stride;
+        uint64_t any = 0;
 
-            classVector[j] = val;
-            double dblVal = (double)val;
-            vectorLength += dblVal * dblVal;
+        for (j = 0; j < stride; j++) {
+            uint64_t bits = plane[j];
+            plane[j] = bits ^ carry[j] ^ borrow[j];
+            carry[j] &= bits;
+            borrow[j] &= ~bits;
+            any |= carry[j] | borrow[j];
         }
 
-        classifySet -> classVectors[i] = classVector;
-        classifySet -> vectorLengths[i] = sqrtl(vectorLength);
+        if (any == 0) {
+            break;
+        }
     }
 }
 
-void hypervector_blankClassifySet(Hypervector_ClassifySet * classifySet,
-    size_t nLabels, size_t length) {
+size_t hypervector_encodeStream(Hypervector_Stream * stream, uint8_t * input,
+    Hypervector_Basis * basis) {
 
-    classifySet -> nLabels = nLabels;
-    classifySet -> length = length;
-    classifySet -> classVectors = (int32_t**)malloc(sizeof(int32_t*) * nLabels);
-    classifySet -> vectorLengths = (double*)malloc(sizeof(double) * nLabels);
+    size_t nChanged = 0;
 
-    size_t i; for (i = 0; i < nLabels; i++) {
-        int32_t * classVector = (int32_t*)malloc(sizeof(int32_t) * length);
-        memset(classVector, 0, sizeof(int32_t) * length);
+    size_t i; for (i = 0; i < basis -> nInputs; i++) {
+        uint16_t level = stream -> levelOf[input[i]];
+        uint16_t prevLevel = stream -> levels[i];
+        if (level == prevLevel) {
+            continue;
+        }
 
-        classifySet -> classVectors[i] = classVector;
-        classifySet -> vectorLengths[i] = 1.0;
+        hypervector_streamMove(stream, basis, i, prevLevel, level);
+        stream -> levels[i] = level;
+        nChanged++;
     }
-}
 
-void hypervector_deleteClassifySet(Hypervector_ClassifySet * classifySet) {
-    size_t i; for (i = 0; i < classifySet -> nLabels; i++) {
-        free(classifySet -> classVectors[i]);
+    // bit-plane comparison of every counter against nInputs / 2, from the
+    // top plane down, plane-major like the updates
+    size_t threshold = basis -> nInputs / 2;
+    size_t stride = stream -> stride;
+    uint64_t * gt = (uint64_t *)stream -> vector.elems;
+    uint64_t * eq = stream -> carry;
+
+    size_t j; for (j = 0; j < stride; j++) {
+        gt[j] = 0;
+        eq[j] = ~(uint64_t)0;
     }
-    free(classifySet -> classVectors);
-    free(classifySet -> vectorLengths);
+
+    size_t p; for (p = stream -> nPlanes; p-- > 0;) {
+        const uint64_t * plane = stream -> planes + p * stride;
+        uint64_t t = ((threshold >> p) & 1) ? ~(uint64_t)0 : 0;
+
+        for (j = 0; j < stride; j++) {
+            gt[j] |= eq[j] & plane[j] & ~t;
+            eq[j] &= ~(plane[j] ^ t);
+        }
+    }
+
+    size_t length = stream -> vector.length;
+    gt[length / 64] &= ((uint64_t)1 << (length & 63)) - 1;
+
+    return nChanged;
 }
 
-size_t hypervector_classify(Hypervector_ClassifySet * classifySet,
-    Hypervector_Hypervector * vector) {
+void hypervector_deleteStream(Hypervector_Stream * stream) {
+    free(stream -> planes);
+    free(stream -> carry);
+    free(stream -> levels);
+    hypervector_deleteVector(&stream -> vector);
+}
 
-    size_t bestLabel = (size_t)(-1);
-    double maxSimilarity = DBL_MIN;
+void hypervector_newLocalTrainSet(Hypervector_TrainSet * trainSet, size_t length,
+    size_t nLabels, bool compact) {
 
-    size_t length = vector -> length;
+    trainSet -> nLabels = nLabels;
+    trainSet -> length = length;
+    trainSet -> vectors = (int32_t**)calloc(nLabels, sizeof(int32_t*));
+    trainSet -> narrowVectors = (int16_t**)calloc(nLabels, sizeof(int16_t*));
+    trainSet -> narrowBounds = (int32_t*)calloc(nLabels, sizeof(int32_t));
+    trainSet -> compact = compact;
+    trainSet -> dirty = (bool*)calloc(nLabels, sizeof(bool));
+    trainSet -> nTrainSamples = 0;
+}
 
-    size_t label; for (label = 0; label < classifySet -> nLabels; label++) {
-        int64_t similarity = 0;
+static void hypervector_allocateRow(Hypervector_TrainSet * trainSet, size_t label) {
+    if (trainSet -> vectors[label] != NULL || trainSet -> narrowVectors[label] != NULL) {
+        return;
+    }
 
-        uint8_t * bitArray = vector -> elems;
-        int32_t * classVector = classifySet -> classVectors[label];
+    if (trainSet -> compact) {
+        trainSet -> narrowVectors[label] = (int16_t*)calloc(trainSet -> length, sizeof(int16_t));
+        trainSet -> narrowBounds[label] = 0;
+    }
+    else {
+        trainSet -> vectors[label] = (int32_t*)calloc(trainSet -> length, sizeof(int32_t));
+    }
+}
 
-        size_t j; for (j = 0; j < length; j++) {
-            bool polarity = (bitArray[j >> 3] >> (j & 0x7)) & 1;
+void hypervector_newTrainSet(Hypervector_TrainSet * trainSet, size_t length, size_t nLabels,
+    bool compact) {
 
-            if (polarity) {
-                similarity += classVector[j];
-            }
-            else {
-                similarity -= classVector[j];
-            }
-        }
+    hypervector_newLocalTrainSet(trainSet, length, nLabels, compact);
 
-        double scaledSimilarity = (double)similarity / classifySet -> vectorLengths[label];
+    size_t i; for (i = 0; i < nLabels; i++) {
+        hypervector_allocateRow(trainSet, i);
+    }
+}
 
-        if (scaledSimilarity > maxSimilarity) {
-            bestLabel = label;
-            maxSimilarity = scaledSimilarity;
-        }
+static int32_t hypervector_narrowMagnitude(const int16_t * row, size_t length) {
+    int32_t maxVal = 0;
+    size_t i; for (i = 0; i < length; i++) {
+        int32_t val = abs((int32_t)row[i]);
+        maxVal = val > maxVal ? val : maxVal;
     }
 
-    return bestLabel;
+    return maxVal;
 }
 
+static void hypervector_widenRow(Hypervector_TrainSet * trainSet, size_t label) {
+    int16_t * narrow = trainSet -> narrowVectors[label];
+    int32_t * wide = (int32_t*)malloc(sizeof(int32_t) * trainSet -> length);
+
+    size_t i; for (i = 0; i < trainSet -> length; i++) {
+        wide[i] = narrow[i];
+    }
+
+    free(narrow);
+    trainSet -> narrowVectors[label] = NULL;
+    trainSet -> vectors[label] = wide;
+}
+
+// Allocates label's row if needed and makes sure a narrow one can take
+// updates more unit steps per element: when its bound says it might not, the
+// actual magnitudes are rescanned, and if they are within the headroom the
+// row is widened. Returns the narrow row, or NULL for an int32 one.
+static int16_t * hypervector_reserveRow(Hypervector_TrainSet * trainSet, size_t label,
+    int64_t updates) {
+
+    hypervector_allocateRow(trainSet, label);
+
+    int16_t * narrow = trainSet -> narrowVectors[label];
+    if (narrow == NULL) {
+        return NULL;
+    }
+
+    if (trainSet -> narrowBounds[label] + updates > INT16_MAX) {
+        int32_t maxVal = hypervector_narrowMagnitude(narrow, trainSet -> length);
+        if (maxVal + updates + HYPERVECTOR_NARROW_HEADROOM > INT16_MAX) {
+            hypervector_widenRow(trainSet, label);
+            return NULL;
+        }
+        trainSet -> narrowBounds[label] = maxVal;
+    }
+
+    trainSet -> narrowBounds[label] += (int32_t)updates;
+    return narrow;
+}
+
+void hypervector_setCompact(Hypervector_TrainSet * trainSet, bool compact) {
+    trainSet -> compact = compact;
+
+    size_t length = trainSet -> length;
+    size_t label; for (label = 0; label < trainSet -> nLabels; label++) {
+        if (!compact && trainSet -> narrowVectors[label] != NULL) {
+            hypervector_widenRow(trainSet, label);
+        }
+        else if (compact && trainSet -> vectors[label] != NULL) {
+            int32_t * wide = trainSet -> vectors[label];
+
+            int32_t maxVal = 0;
+            size_t i; for (i = 0; i < length; i++) {
+                maxVal = abs(wide[i]) > maxVal ? abs(wide[i]) : maxVal;
+            }
+            if (maxVal + HYPERVECTOR_NARROW_HEADROOM > INT16_MAX) {
+                continue;
+            }
+
+            int16_t * narrow = (int16_t*)malloc(sizeof(int16_t) * length);
+            for (i = 0; i < length; i++) {
+                narrow[i] = (int16_t)wide[i];
+            }
+
+            free(wide);
+            trainSet -> vectors[label] = NULL;
+            trainSet -> narrowVectors[label] = narrow;
+            trainSet -> narrowBounds[label] = maxVal;
+        }
+    }
+}
+
+void hypervector_reserveTrainSet(Hypervector_TrainSet * dest, Hypervector_TrainSet * source) {
+    size_t label; for (label = 0; label < source -> nLabels; label++) {
+        const int32_t * sourceVector = source -> vectors[label];
+
+        if (source -> narrowVectors[label] != NULL) {
+            hypervector_reserveRow(dest, label, source -> narrowBounds[label]);
+        }
+        else if (sourceVector != NULL) {
+            int64_t maxVal = 0;
+            size_t i; for (i = 0; i < source -> length; i++) {
+                maxVal = llabs(sourceVector[i]) > maxVal ? llabs(sourceVector[i]) : maxVal;
+            }
+            hypervector_reserveRow(dest, label, maxVal);
+        }
+    }
+}
+
+void hypervector_addTrainSetRange(Hypervector_TrainSet * dest, Hypervector_TrainSet * source,
+    size_t begin, size_t end) {
+
+    size_t label; for (label = 0; label < source -> nLabels; label++) {
+        const int16_t * sourceNarrow = source -> narrowVectors[label];
+        const int32_t * sourceVector = source -> vectors[label];
+        int16_t * destNarrow = dest -> narrowVectors[label];
+        int32_t * destVector = dest -> vectors[label];
+
+        size_t i;
+        if (sourceNarrow != NULL && destNarrow != NULL) {
+            for (i = begin; i < end; i++) {
+                destNarrow[i] += sourceNarrow[i];
+            }
+        }
+        else if (sourceNarrow != NULL) {
+            for (i = begin; i < end; i++) {
+                destVector[i] += sourceNarrow[i];
+            }
+        }
+        else if (sourceVector != NULL && destNarrow != NULL) {
+            for (i = begin; i < end; i++) {
+                destNarrow[i] += (int16_t)sourceVector[i];
+            }
+        }
+        else if (sourceVector != NULL) {
+            for (i = begin; i < end; i++) {
+                destVector[i] += sourceVector[i];
+            }
+        }
+    }
+}
+
+void hypervector_addTrainSet(Hypervector_TrainSet * dest, Hypervector_TrainSet * source) {
+    hypervector_reserveTrainSet(dest, source);
+    hypervector_addTrainSetRange(dest, source, 0, source -> length);
+}
+
+void hypervector_deleteTrainSet(Hypervector_TrainSet * trainSet) {
+    size_t i; for (i = 0; i < trainSet -> nLabels; i++) {
+        free(trainSet -> vectors[i]);
+        free(trainSet -> narrowVectors[i]);
+    }
+    free(trainSet -> vectors);
+    free(trainSet -> narrowVectors);
+    free(trainSet -> narrowBounds);
+    free(trainSet -> dirty);
+}
+
+// adds sign times vector to label's row, reserved as narrow or not
+static void hypervector_trainRow(Hypervector_TrainSet * trainSet, int16_t * narrow,
+    Hypervector_Hypervector * vector, size_t label, int32_t sign) {
+
+    if (narrow != NULL) {
+        kernels_current() -> train16(narrow, vector -> elems, vector -> length, sign);
+    }
+    else {
+        kernels_current() -> train(trainSet -> vectors[label], vector -> elems,
+            vector -> length, sign);
+    }
+}
+
+static void hypervector_trainSign(Hypervector_TrainSet * trainSet,
+    Hypervector_Hypervector * vector, size_t label, int32_t sign) {
+
+    hypervector_trainRow(trainSet, hypervector_reserveRow(trainSet, label, 1), vector,
+        label, sign);
+
+    trainSet -> dirty[label] = true;
+    trainSet -> nTrainSamples++;
+}
+
+void hypervector_train(Hypervector_TrainSet * trainSet, Hypervector_Hypervector * vector, 
+    size_t label) {
+    
+    hypervector_trainSign(trainSet, vector, label, 1);
+}
+
+void hypervector_untrain(Hypervector_TrainSet * trainSet, Hypervector_Hypervector * vector, 
+    size_t label) {
+    
+    hypervector_trainSign(trainSet, vector, label, -1);
+}
+
+// scales the label's accumulated values to quantize levels of either sign
+// (or copies them when quantize is 0) into its class vector
+static void hypervector_quantizeLabel(Hypervector_ClassifySet * classifySet,
+    Hypervector_TrainSet * trainSet, int quantize, size_t label) {
+
+    size_t length = trainSet -> length;
+    const int32_t * trainVector = trainSet -> vectors[label];
+    int32_t * classVector = classifySet -> classVectors[label];
+
+    // a narrow row is widened into the class vector, which is then
+    // overwritten element by element
+    size_t j;
+    if (trainSet -> narrowVectors[label] != NULL) {
+        for (j = 0; j < length; j++) {
+            classVector[j] = trainSet -> narrowVectors[label][j];
+        }
+        trainVector = classVector;
+    }
+
+    double vectorLength = 0.0;
+
+    int32_t maxVal = 0;
+    for (j = 0; j < length; j++) {
+        int32_t val = trainVector[j];
+
+        if (abs(val) > maxVal) {
+            maxVal = abs(val);
+        }
+    }
+
+    double divisor;
+    if (quantize != 0) {
+        divisor = (double)(maxVal + 1)/(double)quantize;
+    }
+
+    for (j = 0; j < length; j++) {
+        int32_t val = trainVector[j];
+
+        if (quantize != 0) {
+            if (val > 0) {
+                val = floor((double)val / divisor) + 1;
+            }
+            else {
+                val = -floor((double)(-val) / divisor) - 1;
+            }
+        }
+
+        classVector[j] = val;
+        double dblVal = (double)val;
+        vectorLength += dblVal * dblVal;
+    }
+
+    classifySet -> vectorLengths[label] = sqrtl(vectorLength);
+}
+
+// one quantization level leaves every element at +1 or -1, where the
+// Hamming search ranks labels exactly as the dot product does; a few
+// levels fit in magnitude planes, which give the exact dot product
+static int hypervector_defaultEngine(Hypervector_ClassifySet * classifySet, int quantize) {
+    if (quantize == 1) {
+        return HYPERVECTOR_CLASSIFY_BINARY;
+    }
+    else if (quantize != 0 && classifySet -> planeVectors != NULL) {
+        return HYPERVECTOR_CLASSIFY_BITPLANE;
+    }
+    else {
+        return HYPERVECTOR_CLASSIFY_INTEGER;
+    }
+}
+
+void hypervector_retrain(Hypervector_TrainSet * trainSet, Hypervector_Hypervector * vector,
+    size_t label, size_t wrongLabel) {
+
+    int16_t * narrow = hypervector_reserveRow(trainSet, label, 1);
+    int16_t * wrongNarrow = hypervector_reserveRow(trainSet, wrongLabel, 1);
+
+    if (narrow != NULL && wrongNarrow != NULL) {
+        kernels_current() -> trainPair16(narrow, wrongNarrow, vector -> elems, vector -> length);
+    }
+    else if (narrow == NULL && wrongNarrow == NULL) {
+        kernels_current() -> trainPair(trainSet -> vectors[label], trainSet -> vectors[wrongLabel],
+            vector -> elems, vector -> length);
+    }
+    else {
+        // only one row widened so far: update each at its own width
+        hypervector_trainRow(trainSet, narrow, vector, label, 1);
+        hypervector_trainRow(trainSet, wrongNarrow, vector, wrongLabel, -1);
+    }
+
+    trainSet -> dirty[label] = true;
+    trainSet -> dirty[wrongLabel] = true;
+    trainSet -> nTrainSamples += 2;
+}
+
+void hypervector_newClassifySet(Hypervector_ClassifySet * classifySet,
+    Hypervector_TrainSet * trainSet, int quantize) {
+    
+    size_t nLabels = trainSet -> nLabels;
+    size_t length = trainSet -> length;
+
+    classifySet -> nLabels = nLabels;
+    classifySet -> length = length;
+    classifySet -> classVectors = (int32_t**)malloc(sizeof(int32_t*) * nLabels);
+    classifySet -> vectorLengths = (double*)malloc(sizeof(double) * nLabels);
+
+    size_t i; for (i = 0; i < nLabels; i++) {
+        classifySet -> classVectors[i] = (int32_t*)malloc(sizeof(int32_t) * length);
+        hypervector_quantizeLabel(classifySet, trainSet, quantize, i);
+    }
+    memset(trainSet -> dirty, 0, sizeof(bool) * nLabels);
+
+    classifySet -> signVectors = NULL;
+    classifySet -> planeVectors = NULL;
+    classifySet -> planeBase = NULL;
+    classifySet -> planeL1 = NULL;
+    classifySet -> planeCounts = NULL;
+    classifySet -> classMatrix = NULL;
+    classifySet -> remainingNorms = NULL;
+    classifySet -> remainingEnergy = NULL;
+    classifySet -> indexSketches = NULL;
+    classifySet -> indexQwords = 0;
+    classifySet -> indexCandidates = 0;
+    hypervector_newSignVectors(classifySet);
+
+    classifySet -> engine = hypervector_defaultEngine(classifySet, quantize);
+}
+
+void hypervector_newPrefixClassifySet(Hypervector_ClassifySet * classifySet,
+    Hypervector_TrainSet * trainSet, int quantize, size_t length) {
+
+    // trainSet's rows read up to length, with dirty flags of its own
+    Hypervector_TrainSet prefix = *trainSet;
+    prefix.length = length;
+    prefix.dirty = (bool*)calloc(trainSet -> nLabels, sizeof(bool));
+
+    hypervector_newClassifySet(classifySet, &prefix, quantize);
+
+    free(prefix.dirty);
+}
+
+void hypervector_blankClassifySet(Hypervector_ClassifySet * classifySet,
+    size_t nLabels, size_t length) {
+
+    classifySet -> nLabels = nLabels;
+    classifySet -> length = length;
+    classifySet -> classVectors = (int32_t**)malloc(sizeof(int32_t*) * nLabels);
+    classifySet -> vectorLengths = (double*)malloc(sizeof(double) * nLabels);
+
+    size_t i; for (i = 0; i < nLabels; i++) {
+        int32_t * classVector = (int32_t*)malloc(sizeof(int32_t) * length);
+        memset(classVector, 0, sizeof(int32_t) * length);
+
+        classifySet -> classVectors[i] = classVector;
+        classifySet -> vectorLengths[i] = 1.0;
+    }
+
+    classifySet -> engine = HYPERVECTOR_CLASSIFY_INTEGER;
+    classifySet -> signVectors = NULL;
+    classifySet -> planeVectors = NULL;
+    classifySet -> planeBase = NULL;
+    classifySet -> planeL1 = NULL;
+    classifySet -> planeCounts = NULL;
+    classifySet -> classMatrix = NULL;
+    classifySet -> remainingNorms = NULL;
+    classifySet -> remainingEnergy = NULL;
+    classifySet -> indexSketches = NULL;
+    classifySet -> indexQwords = 0;
+    classifySet -> indexCandidates = 0;
+    hypervector_newSignVectors(classifySet);
+}
+
+void hypervector_deleteClassifySet(Hypervector_ClassifySet * classifySet) {
+    size_t i; for (i = 0; i < classifySet -> nLabels; i++) {
+        free(classifySet -> classVectors[i]);
+    }
+    free(classifySet -> classVectors);
+    free(classifySet -> vectorLengths);
+    free(classifySet -> signVectors);
+    free(classifySet -> planeVectors);
+    free(classifySet -> planeBase);
+    free(classifySet -> planeL1);
+    free(classifySet -> planeCounts);
+    free(classifySet -> classMatrix);
+    free(classifySet -> remainingNorms);
+    free(classifySet -> remainingEnergy);
+    free(classifySet -> indexSketches);
+}
+
+// magnitude range of a class vector: returns the planes its magnitudes need
+// above the smallest one, which goes to base, and their sum to l1
+static size_t hypervector_magnitudeRange(const int32_t * classVector, size_t length,
+    int64_t * base, int64_t * l1) {
+
+    int64_t minMagnitude = INT64_MAX, maxMagnitude = 0, sum = 0;
+
+    size_t j; for (j = 0; j < length; j++) {
+        int64_t magnitude = llabs((int64_t)classVector[j]);
+        minMagnitude = magnitude < minMagnitude ? magnitude : minMagnitude;
+        maxMagnitude = magnitude > maxMagnitude ? magnitude : maxMagnitude;
+        sum += magnitude;
+    }
+    if (length == 0) {
+        minMagnitude = 0;
+    }
+
+    uint64_t range = (uint64_t)(maxMagnitude - minMagnitude);
+    size_t nPlanes = 0;
+    while (nPlanes < 64 && (range >> nPlanes) != 0) {
+        nPlanes++;
+    }
+
+    *base = minMagnitude;
+    *l1 = sum;
+    return nPlanes;
+}
+
+static int64_t hypervector_maxMagnitude(const int32_t * classVector, size_t length) {
+    int64_t maxMagnitude = 0;
+
+    size_t j; for (j = 0; j < length; j++) {
+        int64_t magnitude = llabs((int64_t)classVector[j]);
+        maxMagnitude = magnitude > maxMagnitude ? magnitude : maxMagnitude;
+    }
+
+    return maxMagnitude;
+}
+
+static void hypervector_setSignRow(Hypervector_ClassifySet * classifySet, size_t label) {
+    const int32_t * classVector = classifySet -> classVectors[label];
+    uint64_t * signs = classifySet -> signVectors + label * classifySet -> signStride;
+
+    memset(signs, 0, sizeof(uint64_t) * classifySet -> signStride);
+
+    size_t j; for (j = 0; j < classifySet -> length; j++) {
+        signs[j >> 6] |= (uint64_t)(classVector[j] > 0) << (j & 63);
+    }
+}
+
+// needs planeBase[label] and the label's sign row
+static void hypervector_setPlaneRow(Hypervector_ClassifySet * classifySet, size_t label) {
+    size_t stride = classifySet -> signStride;
+    size_t nPlanes = classifySet -> nPlanes;
+
+    const int32_t * classVector = classifySet -> classVectors[label];
+    const uint64_t * signs = classifySet -> signVectors + label * stride;
+    uint64_t * planes = classifySet -> planeVectors + label * nPlanes * stride;
+    int64_t * counts = classifySet -> planeCounts + label * nPlanes;
+    int64_t base = classifySet -> planeBase[label];
+
+    memset(planes, 0, sizeof(uint64_t) * nPlanes * stride);
+    memset(counts, 0, sizeof(int64_t) * nPlanes);
+
+    size_t j; for (j = 0; j < classifySet -> length; j++) {
+        uint64_t offset = (uint64_t)(llabs((int64_t)classVector[j]) - base);
+
+        size_t k; for (k = 0; k < nPlanes; k++) {
+            uint64_t bit = (offset >> k) & 1;
+            planes[k * stride + (j >> 6)] |= bit << (j & 63);
+            counts[k] += bit;
+        }
+    }
+
+    size_t k; for (k = 0; k < nPlanes; k++) {
+        for (j = 0; j < stride; j++) {
+            planes[k * stride + j] ^= signs[j];
+        }
+    }
+}
+
+static void hypervector_setMatrixRow(Hypervector_ClassifySet * classifySet, size_t label) {
+    const int32_t * classVector = classifySet -> classVectors[label];
+    size_t nLabels = classifySet -> nLabels;
+    void * matrix = classifySet -> classMatrix;
+
+    size_t j; for (j = 0; j < classifySet -> length; j++) {
+        size_t index = ((j >> 6) * nLabels + label) * 64 + (j & 63);
+        if (classifySet -> classMatrixBits == 8) {
+            ((int8_t *)matrix)[index] = (int8_t)classVector[j];
+        }
+        else {
+            ((int16_t *)matrix)[index] = (int16_t)classVector[j];
+        }
+    }
+}
+
+static void hypervector_setNormRow(Hypervector_ClassifySet * classifySet, size_t label) {
+    size_t nBlocks = classifySet -> nNormBlocks;
+    const int32_t * classVector = classifySet -> classVectors[label];
+    int64_t * norms = classifySet -> remainingNorms + label * (nBlocks + 1);
+    double * energy = classifySet -> remainingEnergy + label * (nBlocks + 1);
+
+    norms[nBlocks] = 0;
+    energy[nBlocks] = 0;
+    size_t j = classifySet -> length;
+    size_t block; for (block = nBlocks; block-- > 0;) {
+        int64_t norm = norms[block + 1];
+        double squares = energy[block + 1];
+        for (; j > block * HYPERVECTOR_PROGRESSIVE_BLOCK; j--) {
+            norm += llabs((int64_t)classVector[j - 1]);
+            squares += (double)classVector[j - 1] * classVector[j - 1];
+        }
+        norms[block] = norm;
+        energy[block] = squares;
+    }
+}
+
+static void hypervector_setIndexRow(Hypervector_ClassifySet * classifySet, size_t label) {
+    size_t qwords = classifySet -> indexQwords;
+
+    memcpy(classifySet -> indexSketches + label * qwords,
+        classifySet -> signVectors + label * classifySet -> signStride,
+        sizeof(uint64_t) * qwords);
+}
+
+static void hypervector_newPlaneVectors(Hypervector_ClassifySet * classifySet) {
+    size_t nLabels = classifySet -> nLabels;
+    size_t length = classifySet -> length;
+    size_t stride = classifySet -> signStride;
+
+    free(classifySet -> planeVectors);
+    free(classifySet -> planeBase);
+    free(classifySet -> planeL1);
+    free(classifySet -> planeCounts);
+    classifySet -> planeVectors = NULL;
+    classifySet -> planeBase = NULL;
+    classifySet -> planeL1 = NULL;
+    classifySet -> planeCounts = NULL;
+    classifySet -> nPlanes = 0;
+
+    int64_t * planeBase = (int64_t*)malloc(sizeof(int64_t) * nLabels);
+    int64_t * planeL1 = (int64_t*)malloc(sizeof(int64_t) * nLabels);
+
+    // magnitudes are stored relative to the smallest one of each label
+    size_t nPlanes = 0;
+    size_t label; for (label = 0; label < nLabels; label++) {
+        size_t labelPlanes = hypervector_magnitudeRange(classifySet -> classVectors[label],
+            length, &planeBase[label], &planeL1[label]);
+        nPlanes = labelPlanes > nPlanes ? labelPlanes : nPlanes;
+    }
+
+    if (nPlanes > HYPERVECTOR_MAX_CLASS_PLANES) {
+        free(planeBase);
+        free(planeL1);
+        return;
+    }
+
+    size_t planesBytes = sizeof(uint64_t) * stride * nPlanes * nLabels;
+    classifySet -> planeVectors = (uint64_t*)aligned_alloc(64, planesBytes > 0 ? planesBytes : 64);
+    classifySet -> planeCounts = (int64_t*)calloc(nPlanes * nLabels + 1, sizeof(int64_t));
+    classifySet -> nPlanes = nPlanes;
+    classifySet -> planeBase = planeBase;
+    classifySet -> planeL1 = planeL1;
+
+    for (label = 0; label < nLabels; label++) {
+        hypervector_setPlaneRow(classifySet, label);
+    }
+}
+
+static void hypervector_newClassMatrix(Hypervector_ClassifySet * classifySet) {
+    size_t nLabels = classifySet -> nLabels;
+    size_t length = classifySet -> length;
+    size_t nChunks = length / 64 + 1;
+
+    free(classifySet -> classMatrix);
+    classifySet -> classMatrix = NULL;
+    classifySet -> classMatrixBits = 0;
+
+    // symmetric ranges, so negating an element never overflows
+    int64_t maxMagnitude = 0;
+    size_t label; for (label = 0; label < nLabels; label++) {
+        int64_t magnitude = hypervector_maxMagnitude(classifySet -> classVectors[label], length);
+        maxMagnitude = magnitude > maxMagnitude ? magnitude : maxMagnitude;
+    }
+    if (maxMagnitude > INT16_MAX) {
+        return;
+    }
+
+    size_t bits = maxMagnitude <= INT8_MAX ? 8 : 16;
+    size_t matrixBytes = nChunks * nLabels * 64 * (bits / 8);
+    classifySet -> classMatrix = aligned_alloc(64, matrixBytes);
+    classifySet -> classMatrixBits = bits;
+    memset(classifySet -> classMatrix, 0, matrixBytes);
+
+    for (label = 0; label < nLabels; label++) {
+        hypervector_setMatrixRow(classifySet, label);
+    }
+}
+
+static void hypervector_newBlockNorms(Hypervector_ClassifySet * classifySet) {
+    size_t nLabels = classifySet -> nLabels;
+    size_t length = classifySet -> length;
+    size_t nBlocks = (length + HYPERVECTOR_PROGRESSIVE_BLOCK - 1) / HYPERVECTOR_PROGRESSIVE_BLOCK;
+
+    free(classifySet -> remainingNorms);
+    free(classifySet -> remainingEnergy);
+    classifySet -> remainingNorms = (int64_t*)malloc(
+        sizeof(int64_t) * nLabels * (nBlocks + 1));
+    classifySet -> remainingEnergy = (double*)malloc(
+        sizeof(double) * nLabels * (nBlocks + 1));
+    classifySet -> nNormBlocks = nBlocks;
+
+    size_t label; for (label = 0; label < nLabels; label++) {
+        hypervector_setNormRow(classifySet, label);
+    }
+}
+
+static void hypervector_newIndexSketches(Hypervector_ClassifySet * classifySet) {
+    size_t nLabels = classifySet -> nLabels;
+    size_t qwords = classifySet -> indexQwords;
+
+    free(classifySet -> indexSketches);
+    classifySet -> indexSketches = NULL;
+    if (classifySet -> indexCandidates == 0) {
+        return;
+    }
+
+    classifySet -> indexSketches = (uint64_t*)malloc(sizeof(uint64_t) * nLabels * qwords);
+
+    size_t label; for (label = 0; label < nLabels; label++) {
+        hypervector_setIndexRow(classifySet, label);
+    }
+}
+
+void hypervector_newClassIndex(Hypervector_ClassifySet * classifySet,
+    size_t sketchBits, size_t nCandidates) {
+
+    size_t qwords = (sketchBits + 63) / 64;
+    size_t lengthQwords = classifySet -> length / 64 + 1;
+    qwords = qwords < lengthQwords ? qwords : lengthQwords;
+    qwords = qwords < HYPERVECTOR_MAX_INDEX_QWORDS ? qwords : HYPERVECTOR_MAX_INDEX_QWORDS;
+
+    bool enabled = nCandidates > 0 && nCandidates < classifySet -> nLabels && qwords > 0;
+    classifySet -> indexQwords = enabled ? qwords : 0;
+    classifySet -> indexCandidates = enabled ? nCandidates : 0;
+
+    hypervector_newIndexSketches(classifySet);
+}
+
+void hypervector_newSignVectors(Hypervector_ClassifySet * classifySet) {
+    size_t nLabels = classifySet -> nLabels;
+    size_t lengthQwords = classifySet -> length / 64 + 1;
+
+    // whole cache lines per label, zero beyond length
+    size_t stride = (lengthQwords + 7) & ~(size_t)7;
+
+    free(classifySet -> signVectors);
+    classifySet -> signVectors = (uint64_t*)aligned_alloc(64, sizeof(uint64_t) * stride * nLabels);
+    classifySet -> signStride = stride;
+
+    size_t label; for (label = 0; label < nLabels; label++) {
+        hypervector_setSignRow(classifySet, label);
+    }
+
+    hypervector_newPlaneVectors(classifySet);
+    hypervector_newClassMatrix(classifySet);
+    hypervector_newBlockNorms(classifySet);
+    hypervector_newIndexSketches(classifySet);
+}
+
+bool hypervector_refreshLabel(Hypervector_ClassifySet * classifySet,
+    Hypervector_TrainSet * trainSet, int quantize, size_t label) {
+
+    size_t length = classifySet -> length;
+
+    hypervector_quantizeLabel(classifySet, trainSet, quantize, label);
+    hypervector_setSignRow(classifySet, label);
+    hypervector_setNormRow(classifySet, label);
+    if (classifySet -> indexSketches != NULL) {
+        hypervector_setIndexRow(classifySet, label);
+    }
+
+    const int32_t * classVector = classifySet -> classVectors[label];
+
+    if (classifySet -> planeVectors != NULL) {
+        size_t nPlanes = hypervector_magnitudeRange(classVector, length,
+            &classifySet -> planeBase[label], &classifySet -> planeL1[label]);
+        if (nPlanes > classifySet -> nPlanes) {
+            return false;
+        }
+        hypervector_setPlaneRow(classifySet, label);
+    }
+
+    if (classifySet -> classMatrix != NULL) {
+        int64_t limit = classifySet -> classMatrixBits == 8 ? INT8_MAX : INT16_MAX;
+        if (hypervector_maxMagnitude(classVector, length) > limit) {
+            return false;
+        }
+        hypervector_setMatrixRow(classifySet, label);
+    }
+
+    return true;
+}
+
+void hypervector_finishRefresh(Hypervector_ClassifySet * classifySet,
+    Hypervector_TrainSet * trainSet, bool relayout) {
+
+    memset(trainSet -> dirty, 0, sizeof(bool) * trainSet -> nLabels);
+
+    if (relayout) {
+        hypervector_newSignVectors(classifySet);
+        if (classifySet -> engine == HYPERVECTOR_CLASSIFY_BITPLANE
+            && classifySet -> planeVectors == NULL) {
+
+            classifySet -> engine = HYPERVECTOR_CLASSIFY_INTEGER;
+        }
+    }
+}
+
+size_t hypervector_classifyBinary(Hypervector_ClassifySet * classifySet,
+    Hypervector_Hypervector * vector) {
+
+    const Kernels_Dispatch * kernels = kernels_current();
+    const uint64_t * query = (const uint64_t *)vector -> elems;
+    size_t lengthQwords = vector -> length / 64 + 1;
+
+    size_t bestLabel = (size_t)(-1);
+    uint64_t minDistance = UINT64_MAX;
+
+    size_t label; for (label = 0; label < classifySet -> nLabels; label++) {
+        uint64_t distance = kernels -> hamming(query,
+            classifySet -> signVectors + label * classifySet -> signStride,
+            lengthQwords);
+
+        if (distance < minDistance) {
+            bestLabel = label;
+            minDistance = distance;
+        }
+    }
+
+    return bestLabel;
+}
+
+// With agreement a_j = 1 when the query bit matches the class sign, the dot
+// product is sum_j m_j (2 a_j - 1) = 2 sum_j m_j a_j - L1. Splitting m_j into
+// base + sum_k 2^k p_kj, and using |A & P| = (|A| + |P| - |A ^ P|) / 2, every
+// term reduces to H = hamming(query, sign) or H_k = hamming(query, sign ^ P_k):
+//   dot = 2 base (length - H) + sum_k 2^k (|P_k| - H + H_k) - L1
+size_t hypervector_classifyPlanes(Hypervector_ClassifySet * classifySet,
+    Hypervector_Hypervector * vector) {
+
+    const Kernels_Dispatch * kernels = kernels_current();
+    const uint64_t * query = (const uint64_t *)vector -> elems;
+    size_t lengthQwords = vector -> length / 64 + 1;
+    size_t stride = classifySet -> signStride;
+    size_t nPlanes = classifySet -> nPlanes;
+
+    size_t bestLabel = (size_t)(-1);
+    double maxSimilarity = DBL_MIN;
+
+    size_t label; for (label = 0; label < classifySet -> nLabels; label++) {
+        const uint64_t * planes = classifySet -> planeVectors + label * nPlanes * stride;
+        const int64_t * counts = classifySet -> planeCounts + label * nPlanes;
+
+        int64_t distance = (int64_t)kernels -> hamming(query,
+            classifySet -> signVectors + label * stride, lengthQwords);
+        int64_t similarity = 2 * classifySet -> planeBase[label]
+            * ((int64_t)vector -> length - distance) - classifySet -> planeL1[label];
+
+        size_t k; for (k = 0; k < nPlanes; k++) {
+            int64_t planeDistance = (int64_t)kernels -> hamming(query,
+                planes + k * stride, lengthQwords);
+            similarity += (counts[k] - distance + planeDistance) << k;
+        }
+
+        double scaledSimilarity = (double)similarity / classifySet -> vectorLengths[label];
+
+        if (scaledSimilarity > maxSimilarity) {
+            bestLabel = label;
+            maxSimilarity = scaledSimilarity;
+        }
+    }
+
+    return bestLabel;
+}
+
+// Shortlists by sketch distance with a histogram: the cutoff is the smallest
+// distance with at least indexCandidates labels at or below it, and labels
+// at the cutoff are taken in label order until the shortlist is full.
+size_t hypervector_classifyIndexed(Hypervector_ClassifySet * classifySet,
+    Hypervector_Hypervector * vector) {
+
+    const Kernels_Dispatch * kernels = kernels_current();
+    size_t nLabels = classifySet -> nLabels;
+    size_t qwords = classifySet -> indexQwords;
+    const uint64_t * query = (const uint64_t *)vector -> elems;
+
+    uint16_t localDistances[HYPERVECTOR_INDEX_STACK_LABELS];
+    uint16_t * distances = nLabels <= HYPERVECTOR_INDEX_STACK_LABELS
+        ? localDistances : (uint16_t*)malloc(sizeof(uint16_t) * nLabels);
+    uint32_t histogram[HYPERVECTOR_MAX_INDEX_QWORDS * 64 + 1];
+    memset(histogram, 0, sizeof(uint32_t) * (qwords * 64 + 1));
+
+    size_t label; for (label = 0; label < nLabels; label++) {
+        distances[label] = (uint16_t)kernels -> hamming(query,
+            classifySet -> indexSketches + label * qwords, qwords);
+        histogram[distances[label]]++;
+    }
+
+    size_t cutoff = 0;
+    size_t below = 0;
+    while (below + histogram[cutoff] < classifySet -> indexCandidates) {
+        below += histogram[cutoff];
+        cutoff++;
+    }
+    size_t atCutoff = classifySet -> indexCandidates - below;
+
+    size_t bestLabel = (size_t)(-1);
+    double maxSimilarity = DBL_MIN;
+
+    for (label = 0; label < nLabels; label++) {
+        if (distances[label] > cutoff || (distances[label] == cutoff && atCutoff == 0)) {
+            continue;
+        }
+        if (distances[label] == cutoff) {
+            atCutoff--;
+        }
+
+        int64_t similarity = kernels -> similarity(classifySet -> classVectors[label],
+            vector -> elems, vector -> length);
+        double scaledSimilarity = (double)similarity / classifySet -> vectorLengths[label];
+
+        if (scaledSimilarity > maxSimilarity) {
+            bestLabel = label;
+            maxSimilarity = scaledSimilarity;
+        }
+    }
+
+    if (distances != localDistances) {
+        free(distances);
+    }
+
+    return bestLabel;
+}
+
+size_t hypervector_classify(Hypervector_ClassifySet * classifySet,
+    Hypervector_Hypervector * vector) {
+
+    if (classifySet -> indexSketches != NULL) {
+        return hypervector_classifyIndexed(classifySet, vector);
+    }
+
+    return hypervector_classifyScan(classifySet, vector);
+}
+
+size_t hypervector_classifyScan(Hypervector_ClassifySet * classifySet,
+    Hypervector_Hypervector * vector) {
+
+    size_t bestLabel = (size_t)(-1);
+    double maxSimilarity = DBL_MIN;
+
+    size_t length = vector -> length;
+    const Kernels_Dispatch * kernels = kernels_current();
+
+    if (classifySet -> engine == HYPERVECTOR_CLASSIFY_BINARY) {
+        return hypervector_classifyBinary(classifySet, vector);
+    }
+    if (classifySet -> engine == HYPERVECTOR_CLASSIFY_BITPLANE) {
+        return hypervector_classifyPlanes(classifySet, vector);
+    }
+
+    // narrow matrices are scored for every label in one pass over the query
+    size_t nLabels = classifySet -> nLabels;
+    int64_t localSimilarities[HYPERVECTOR_CLASSIFY_STACK_LABELS];
+    int64_t * similarities = NULL;
+    if (classifySet -> classMatrix != NULL) {
+        similarities = nLabels <= HYPERVECTOR_CLASSIFY_STACK_LABELS
+            ? localSimilarities : (int64_t*)malloc(sizeof(int64_t) * nLabels);
+
+        const uint64_t * query = (const uint64_t *)vector -> elems;
+        if (classifySet -> classMatrixBits == 8) {
+            kernels -> similarityMatrix8((const int8_t *)classifySet -> classMatrix,
+                nLabels, query, length / 64 + 1, similarities);
+        }
+        else {
+            kernels -> similarityMatrix16((const int16_t *)classifySet -> classMatrix,
+                nLabels, query, length / 64 + 1, similarities);
+        }
+    }
+
+    size_t label; for (label = 0; label < nLabels; label++) {
+        int64_t similarity = similarities != NULL ? similarities[label]
+            : kernels -> similarity(classifySet -> classVectors[label],
+                vector -> elems, length);
+
+        double scaledSimilarity = (double)similarity / classifySet -> vectorLengths[label];
+
+        if (scaledSimilarity > maxSimilarity) {
+            bestLabel = label;
+            maxSimilarity = scaledSimilarity;
+        }
+    }
+
+    if (similarities != localSimilarities) {
+        free(similarities);
+    }
+
+    return bestLabel;
+}
+
+// Dividing the integer bound by the vector length rounds monotonically, so
+// the bounds compare exactly as the final scaled similarities would.
+size_t hypervector_classifyProgressive(Hypervector_ClassifySet * classifySet,
+    Hypervector_Hypervector * vector, double margin, size_t * dimensionsUsed) {
+
+    const Kernels_Dispatch * kernels = kernels_current();
+    size_t nLabels = classifySet -> nLabels;
+    size_t length = vector -> length;
+    size_t nChunks = length / 64 + 1;
+    size_t nBlocks = classifySet -> nNormBlocks;
+    size_t blockChunks = HYPERVECTOR_PROGRESSIVE_BLOCK / 64;
+    const uint64_t * query = (const uint64_t *)vector -> elems;
+
+    int64_t localSimilarities[2 * HYPERVECTOR_CLASSIFY_STACK_LABELS];
+    int64_t * partial = nLabels <= HYPERVECTOR_CLASSIFY_STACK_LABELS
+        ? localSimilarities : (int64_t*)malloc(sizeof(int64_t) * 2 * nLabels);
+    int64_t * blockSimilarities = partial + nLabels;
+
+    size_t label; for (label = 0; label < nLabels; label++) {
+        partial[label] = 0;
+    }
+
+    size_t bestLabel = (size_t)(-1);
+    size_t used = length;
+
+    size_t block; for (block = 0; block < nBlocks; block++) {
+        size_t firstChunk = block * blockChunks;
+        size_t nBlockChunks = nChunks - firstChunk < blockChunks
+            ? nChunks - firstChunk : blockChunks;
+        size_t offset = firstChunk * nLabels * 64;
+
+        if (classifySet -> classMatrixBits == 8) {
+            kernels -> similarityMatrix8((const int8_t *)classifySet -> classMatrix + offset,
+                nLabels, query + firstChunk, nBlockChunks, blockSimilarities);
+        }
+        else if (classifySet -> classMatrixBits == 16) {
+            kernels -> similarityMatrix16((const int16_t *)classifySet -> classMatrix + offset,
+                nLabels, query + firstChunk, nBlockChunks, blockSimilarities);
+        }
+        else {
+            size_t begin = firstChunk * 64;
+            size_t end = begin + HYPERVECTOR_PROGRESSIVE_BLOCK < length
+                ? begin + HYPERVECTOR_PROGRESSIVE_BLOCK : length;
+
+            for (label = 0; label < nLabels; label++) {
+                blockSimilarities[label] = kernels -> similarity(
+                    classifySet -> classVectors[label] + begin,
+                    vector -> elems + begin / 8, end - begin);
+            }
+        }
+
+        size_t leader = 0;
+        double leaderSimilarity = 0;
+        for (label = 0; label < nLabels; label++) {
+            partial[label] += blockSimilarities[label];
+
+            double scaledSimilarity = (double)partial[label] / classifySet -> vectorLengths[label];
+            if (label == 0 || scaledSimilarity > leaderSimilarity) {
+                leader = label;
+                leaderSimilarity = scaledSimilarity;
+            }
+        }
+
+        if (block + 1 == nBlocks || nLabels == 0) {
+            break;
+        }
+
+        const int64_t * norms = classifySet -> remainingNorms + block + 1;
+        const double * energy = classifySet -> remainingEnergy + block + 1;
+        size_t normStride = nBlocks + 1;
+        double leaderLength = classifySet -> vectorLengths[leader];
+
+        // worst case: every remaining query sign works against the leader
+        double lowerBound = (double)(partial[leader] - norms[leader * normStride])
+            / leaderLength;
+        bool decided = lowerBound > DBL_MIN;
+
+        for (label = 0; label < nLabels && decided; label++) {
+            double upperBound = (double)(partial[label] + norms[label * normStride])
+                / classifySet -> vectorLengths[label];
+            decided = label == leader || lowerBound > upperBound;
+        }
+
+        // likely case: the gap to every label exceeds margin deviations
+        if (!decided && margin > 0 && leaderSimilarity > DBL_MIN) {
+            double leaderVariance = energy[leader * normStride] / (leaderLength * leaderLength);
+            decided = true;
+
+            for (label = 0; label < nLabels && decided; label++) {
+                double labelLength = classifySet -> vectorLengths[label];
+                double gap = leaderSimilarity - (double)partial[label] / labelLength;
+                double deviation = sqrt(leaderVariance
+                    + energy[label * normStride] / (labelLength * labelLength));
+
+                decided = label == leader || gap > margin * deviation;
+            }
+        }
+
+        if (decided) {
+            bestLabel = leader;
+            used = (block + 1) * HYPERVECTOR_PROGRESSIVE_BLOCK;
+            break;
+        }
+    }
+
+    // otherwise every dimension was scored: pick as hypervector_classify does
+    if (bestLabel == (size_t)(-1)) {
+        double maxSimilarity = DBL_MIN;
+
+        for (label = 0; label < nLabels; label++) {
+            double scaledSimilarity = (double)partial[label] / classifySet -> vectorLengths[label];
+
+            if (scaledSimilarity > maxSimilarity) {
+                bestLabel = label;
+                maxSimilarity = scaledSimilarity;
+            }
+        }
+    }
+
+    if (partial != localSimilarities) {
+        free(partial);
+    }
+    if (dimensionsUsed != NULL) {
+        *dimensionsUsed = used;
+    }
+
+    return bestLabel;
+}
+
+void hypervector_scoreBatch(Hypervector_ClassifySet * classifySet,
+    Hypervector_Hypervector * vectors, size_t nVectors, float * scores) {
+
+    const Kernels_Dispatch * kernels = kernels_current();
+    size_t nLabels = classifySet -> nLabels;
+    size_t length = classifySet -> length;
+    size_t nChunks = length / 64 + 1;
+
+    size_t elementBytes = classifySet -> classMatrixBits != 0
+        ? classifySet -> classMatrixBits / 8 : sizeof(int32_t);
+    size_t blockChunks = HYPERVECTOR_SCORE_BLOCK_BYTES / (nLabels * 64 * elementBytes + 1);
+    blockChunks = blockChunks > 0 ? blockChunks : 1;
+
+    int64_t localSimilarities[2 * HYPERVECTOR_CLASSIFY_STACK_LABELS * HYPERVECTOR_BATCH_SIZE];
+    size_t nSimilarities = nLabels * (nVectors + 1);
+    int64_t * similarities = nSimilarities <= sizeof(localSimilarities) / sizeof(int64_t)
+        ? localSimilarities : (int64_t*)malloc(sizeof(int64_t) * nSimilarities);
+    int64_t * blockSimilarities = similarities + nLabels * nVectors;
+    memset(similarities, 0, sizeof(int64_t) * nLabels * nVectors);
+
+    size_t first; for (first = 0; first < nChunks; first += blockChunks) {
+        size_t n = nChunks - first < blockChunks ? nChunks - first : blockChunks;
+        size_t offset = first * nLabels * 64;
+
+        size_t v; for (v = 0; v < nVectors; v++) {
+            const uint64_t * query = (const uint64_t *)vectors[v].elems + first;
+            int64_t * vectorSimilarities = similarities + v * nLabels;
+
+            if (classifySet -> classMatrixBits == 8) {
+                kernels -> similarityMatrix8((const int8_t *)classifySet -> classMatrix + offset,
+                    nLabels, query, n, blockSimilarities);
+            }
+            else if (classifySet -> classMatrixBits == 16) {
+                kernels -> similarityMatrix16((const int16_t *)classifySet -> classMatrix + offset,
+                    nLabels, query, n, blockSimilarities);
+            }
+            else {
+                size_t begin = first * 64;
+                size_t end = begin + n * 64 < length ? begin + n * 64 : length;
+
+                size_t label; for (label = 0; label < nLabels; label++) {
+                    blockSimilarities[label] = begin < end ? kernels -> similarity(
+                        classifySet -> classVectors[label] + begin,
+                        vectors[v].elems + begin / 8, end - begin) : 0;
+                }
+            }
+
+            size_t label; for (label = 0; label < nLabels; label++) {
+                vectorSimilarities[label] += blockSimilarities[label];
+            }
+        }
+    }
+
+    size_t i; for (i = 0; i < nLabels * nVectors; i++) {
+        scores[i] = (float)((double)similarities[i] / classifySet -> vectorLengths[i % nLabels]);
+    }
+
+    if (similarities != localSimilarities) {
+        free(similarities);
+    }
+}
+
+size_t hypervector_classifyWith(Hypervector_Scratch * scratch,
+    Hypervector_ClassifySet * classifySet, Hypervector_Basis * basis,
+    uint8_t * input) {
+
+    hypervector_reserveScratch(scratch, classifySet -> length);
+    hypervector_encodeInto(scratch, &scratch -> vector, input, basis);
+
+    return hypervector_classify(classifySet, &scratch -> vector);
+}
+void hypervector_classifyBatch(Hypervector_Scratch * scratch,
+    Hypervector_ClassifySet * classifySet, Hypervector_Basis * basis,
+    uint8_t ** inputs, size_t nSamples, size_t * labels) {
+
+    hypervector_reserveScratch(scratch, classifySet -> length);
+
+    size_t i; for (i = 0; i < nSamples; i += HYPERVECTOR_BATCH_SIZE) {
+        size_t n = nSamples - i;
+        if (n > HYPERVECTOR_BATCH_SIZE) {
+            n = HYPERVECTOR_BATCH_SIZE;
+        }
+
+        hypervector_encodeBatch(scratch, scratch -> batch, &inputs[i], n, basis);
+
+        size_t j; for (j = 0; j < n; j++) {
+            labels[i + j] = hypervector_classify(classifySet, &scratch -> batch[j]);
+        }
+    }
+}
 
 #endif // HYPERVECTOR_C
\ No newline at end of file
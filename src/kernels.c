@@ -0,0 +1,1787 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <immintrin.h>
+
+#include "hypervector.h"
+#include "kernels.h"
+
+#define KERNELS_MAX_PLANES (32)
+#define KERNELS_MAX_COLUMN_QWORDS (8)
+
+// Batch encodes work through KERNELS_BATCH_TILE samples at a time and walk
+// the basis in blocks of KERNELS_FEATURE_BLOCK features, so each block of a
+// basis column is pulled into L1 once and applied to the whole tile. The
+// block is a multiple of 16 to keep the adder tree groups whole.
+#define KERNELS_BATCH_TILE (16)
+#define KERNELS_FEATURE_BLOCK (128)
+
+// Samples with at most this many non-background features are encoded as a
+// delta against the precomputed background counters instead of from scratch.
+#define KERNELS_MAX_ACTIVE (1024)
+
+// the encode buffer holds the counters of a tile, then its active lists
+#define KERNELS_STATE_QWORDS (KERNELS_BATCH_TILE * KERNELS_MAX_PLANES \
+    * KERNELS_MAX_COLUMN_QWORDS)
+_Static_assert(sizeof(uint64_t) * KERNELS_STATE_QWORDS
+    + sizeof(uint16_t) * KERNELS_BATCH_TILE * KERNELS_MAX_ACTIVE
+    <= KERNELS_ENCODE_BUFFER_BYTES, "KERNELS_ENCODE_BUFFER_BYTES is too small");
+
+// Matrix classify kernels score KERNELS_MATRIX_GROUP labels per pass over the
+// query and widen their int32 accumulators every KERNELS_MATRIX_FLUSH chunks
+// of 64 elements, which keeps 16-bit elements at most 2^30 per lane.
+#define KERNELS_MATRIX_GROUP (16)
+#define KERNELS_MATRIX_FLUSH (2048)
+
+// Everything the column kernels need to find the bound (basis XOR level)
+// vector of a feature, resolved once per encode call. When the basis has a
+// precomputed bound table the kernels read it directly; otherwise they XOR
+// the basis vector with the level vector selected through levelTable.
+typedef struct Kernels_Encoding Kernels_Encoding;
+
+// where the column kernels get the bound vector of a feature from
+enum {
+    KERNELS_SOURCE_STORED,     // basis vector XOR level vector
+    KERNELS_SOURCE_BOUND,      // precomputed bound table
+    KERNELS_SOURCE_PROCEDURAL  // generated basis words XOR level vector
+};
+
+struct Kernels_Encoding {
+    const uint64_t * levelTable[256];
+    size_t boundOffset[256];
+    uint8_t nonBackground[256]; // 1 if the byte maps to a level other than 0
+    int source;
+    const uint64_t * boundVectors;
+    size_t boundFeatureStride;
+    Hypervector_Hypervector * basisVectors;
+    uint32_t basisKey;
+    uint32_t basisWords;
+};
+
+// Column kernels. Counter state for one column of the output is nPlanes
+// consecutive column-wide vectors, plane p holding bit p of every counter.
+// accumulate adds the bound vectors of features [begin, end) into it and
+// threshold turns it into output bits; nQwords is less than the column width
+// only for the last column of a vector.
+//
+// Given a list of active (non-background) features, accumulate instead walks
+// terms [begin, end) of the delta: term 2j is the bound vector of active[j]
+// at its level and term 2j + 1 the complement of its background bound vector.
+// Added to the background counters this gives the true count plus the number
+// of active features, which the caller folds into the threshold.
+typedef void (*Kernels_AccumulateFunc)(uint64_t * state, size_t nPlanes,
+    const Kernels_Encoding * encoding, uint8_t * input, const uint16_t * active,
+    size_t begin, size_t end, size_t w, size_t nQwords);
+
+typedef void (*Kernels_ThresholdFunc)(uint64_t * state, size_t nPlanes,
+    size_t threshold, uint64_t * out, size_t nQwords);
+
+// number of bit planes needed to hold a count of up to nInputs; the low four
+// planes are always present because the adder tree produces them directly
+static size_t kernels_nPlanes(size_t nInputs) {
+    size_t nPlanes = 4;
+    while (nPlanes < KERNELS_MAX_PLANES && (nInputs >> nPlanes) != 0) {
+        nPlanes++;
+    }
+
+    return nPlanes;
+}
+
+// resolves every possible input byte to its level once per encode so the
+// inner loops neither divide nor branch on the table mode
+static void kernels_newEncoding(Kernels_Encoding * encoding, Hypervector_Basis * basis) {
+    size_t nLevels = basis -> nLevels;
+    size_t levelDownscale = 256 / nLevels;
+    if (levelDownscale == 0) {
+        levelDownscale = 1;
+    }
+
+    encoding -> boundVectors = (const uint64_t *)basis -> boundVectors;
+    encoding -> boundFeatureStride = nLevels * basis -> boundStride;
+    encoding -> basisVectors = basis -> basisVectors;
+    encoding -> basisKey = basis -> basisKey;
+    encoding -> basisWords = 2 * (basis -> levelVectors[0].length / 64 + 1);
+
+    if (basis -> boundVectors != NULL) {
+        encoding -> source = KERNELS_SOURCE_BOUND;
+    }
+    else if (basis -> procedural) {
+        encoding -> source = KERNELS_SOURCE_PROCEDURAL;
+    }
+    else {
+        encoding -> source = KERNELS_SOURCE_STORED;
+    }
+
+    size_t level = 0, count = 0;
+    size_t v; for (v = 0; v < 256; v++) {
+        size_t clamped = level < nLevels ? level : nLevels - 1;
+
+        encoding -> levelTable[v] = (const uint64_t *)basis -> levelVectors[clamped].elems;
+        encoding -> boundOffset[v] = clamped * basis -> boundStride;
+        encoding -> nonBackground[v] = clamped != 0;
+
+        if (++count == levelDownscale) {
+            count = 0;
+            level++;
+        }
+    }
+}
+
+static void kernels_clearPadding(Hypervector_Hypervector * result) {
+    size_t length = result -> length;
+    uint64_t * elems = (uint64_t *)result -> elems;
+
+    elems[length / 64] &= ((uint64_t)1 << (length & 63)) - 1;
+}
+
+// Lists the non-background features of a sample into active and returns how
+// many there are, or SIZE_MAX if the basis has no background counters or the
+// sample is too dense for the delta to be cheaper than a full encode.
+static size_t kernels_findActive(const Kernels_Encoding * encoding,
+    Hypervector_Basis * basis, const uint8_t * input, uint16_t * active) {
+
+    size_t nInputs = basis -> nInputs;
+    if (basis -> backgroundPlanes == NULL || nInputs < 2) {
+        return SIZE_MAX;
+    }
+
+    // the delta costs two terms per active feature
+    size_t limit = (nInputs - 1) / 2;
+    if (limit > KERNELS_MAX_ACTIVE - 1) {
+        limit = KERNELS_MAX_ACTIVE - 1;
+    }
+
+    size_t nActive = 0;
+    size_t i; for (i = 0; i < nInputs; i++) {
+        active[nActive] = (uint16_t)i;
+        nActive += encoding -> nonBackground[input[i]];
+        if (nActive > limit) {
+            return SIZE_MAX;
+        }
+    }
+
+    return nActive;
+}
+
+// seeds one column of counter state with the all-background counts
+static void kernels_loadBackground(uint64_t * state, size_t columnQwords,
+    Hypervector_Basis * basis, size_t w, size_t nQwords) {
+
+    size_t p; for (p = 0; p < basis -> nBackgroundPlanes; p++) {
+        memcpy(state + p * columnQwords,
+            basis -> backgroundPlanes + p * basis -> backgroundStride + w,
+            sizeof(uint64_t) * nQwords);
+    }
+}
+
+static void kernels_encodeTiled(size_t columnQwords,
+    Kernels_AccumulateFunc accumulate, Kernels_ThresholdFunc threshold,
+    uint8_t ** inputs, size_t nSamples, Hypervector_Basis * basis,
+    Hypervector_Hypervector * results, uint64_t * buffer) {
+
+    uint64_t * state = buffer;
+    uint16_t (*active)[KERNELS_MAX_ACTIVE] = (uint16_t (*)[KERNELS_MAX_ACTIVE])(
+        state + KERNELS_STATE_QWORDS);
+    size_t nActive[KERNELS_BATCH_TILE];
+
+    Kernels_Encoding encoding;
+    kernels_newEncoding(&encoding, basis);
+
+    size_t nInputs = basis -> nInputs;
+    size_t nPlanes = kernels_nPlanes(nInputs);
+    // background counts plus the delta stay below 2 * nInputs
+    size_t nDeltaPlanes = kernels_nPlanes(2 * nInputs);
+    size_t planeStride = nDeltaPlanes * columnQwords;
+    size_t lengthQwords = results[0].length / 64 + 1;
+
+    // a lone sample has nobody to share basis blocks with
+    size_t featureBlock = nSamples > 1 ? KERNELS_FEATURE_BLOCK : nInputs;
+
+    size_t tile; for (tile = 0; tile < nSamples; tile += KERNELS_BATCH_TILE) {
+        size_t tileSize = nSamples - tile;
+        if (tileSize > KERNELS_BATCH_TILE) {
+            tileSize = KERNELS_BATCH_TILE;
+        }
+
+        size_t s; for (s = 0; s < tileSize; s++) {
+            nActive[s] = kernels_findActive(&encoding, basis, inputs[tile + s], active[s]);
+        }
+
+        size_t w; for (w = 0; w < lengthQwords; w += columnQwords) {
+            size_t nQwords = lengthQwords - w;
+            if (nQwords > columnQwords) {
+                nQwords = columnQwords;
+            }
+
+            memset(state, 0, sizeof(uint64_t) * tileSize * planeStride);
+
+            for (s = 0; s < tileSize; s++) {
+                if (nActive[s] != SIZE_MAX) {
+                    kernels_loadBackground(state + s * planeStride, columnQwords,
+                        basis, w, nQwords);
+                    accumulate(state + s * planeStride, nDeltaPlanes, &encoding,
+                        inputs[tile + s], active[s], 0, 2 * nActive[s], w, nQwords);
+                }
+            }
+
+            size_t begin; for (begin = 0; begin < nInputs; begin += featureBlock) {
+                size_t end = begin + featureBlock;
+                if (end > nInputs) {
+                    end = nInputs;
+                }
+
+                for (s = 0; s < tileSize; s++) {
+                    if (nActive[s] == SIZE_MAX) {
+                        accumulate(state + s * planeStride, nPlanes, &encoding,
+                            inputs[tile + s], NULL, begin, end, w, nQwords);
+                    }
+                }
+            }
+
+            for (s = 0; s < tileSize; s++) {
+                uint64_t * out = (uint64_t *)results[tile + s].elems + w;
+                if (nActive[s] != SIZE_MAX) {
+                    threshold(state + s * planeStride, nDeltaPlanes,
+                        nInputs / 2 + nActive[s], out, nQwords);
+                }
+                else {
+                    threshold(state + s * planeStride, nPlanes, nInputs / 2,
+                        out, nQwords);
+                }
+            }
+        }
+    }
+
+    size_t s; for (s = 0; s < nSamples; s++) {
+        kernels_clearPadding(&results[s]);
+    }
+}
+
+// Adds inputs i .. i + 15 into ones/twos/fours/eights with a Harley-Seal
+// carry-save adder tree and leaves the weight-16 carry in sixteens.
+// CSA(h, l, a, b, c) is a full adder over whole registers.
+#define KERNELS_HARLEY_SEAL16(T, CSA, BOUND) { \
+    T twosA, twosB, foursA, foursB, eightsA, eightsB; \
+    CSA(twosA, ones, ones, BOUND(i), BOUND(i + 1)); \
+    CSA(twosB, ones, ones, BOUND(i + 2), BOUND(i + 3)); \
+    CSA(foursA, twos, twos, twosA, twosB); \
+    CSA(twosA, ones, ones, BOUND(i + 4), BOUND(i + 5)); \
+    CSA(twosB, ones, ones, BOUND(i + 6), BOUND(i + 7)); \
+    CSA(foursB, twos, twos, twosA, twosB); \
+    CSA(eightsA, fours, fours, foursA, foursB); \
+    CSA(twosA, ones, ones, BOUND(i + 8), BOUND(i + 9)); \
+    CSA(twosB, ones, ones, BOUND(i + 10), BOUND(i + 11)); \
+    CSA(foursA, twos, twos, twosA, twosB); \
+    CSA(twosA, ones, ones, BOUND(i + 12), BOUND(i + 13)); \
+    CSA(twosB, ones, ones, BOUND(i + 14), BOUND(i + 15)); \
+    CSA(foursB, twos, twos, twosA, twosB); \
+    CSA(eightsB, fours, fours, foursA, foursB); \
+    CSA(sixteens, eights, eights, eightsA, eightsB); }
+
+// Calls CALL(source, delta) with both arguments as constants so that each
+// combination gets its own instantiation of the inlined column kernel.
+#define KERNELS_SPECIALIZE(CALL, source, delta) { \
+    if ((source) == KERNELS_SOURCE_BOUND) { \
+        if (delta) CALL(KERNELS_SOURCE_BOUND, true); \
+        else CALL(KERNELS_SOURCE_BOUND, false); \
+    } \
+    else if ((source) == KERNELS_SOURCE_PROCEDURAL) { \
+        if (delta) CALL(KERNELS_SOURCE_PROCEDURAL, true); \
+        else CALL(KERNELS_SOURCE_PROCEDURAL, false); \
+    } \
+    else { \
+        if (delta) CALL(KERNELS_SOURCE_STORED, true); \
+        else CALL(KERNELS_SOURCE_STORED, false); \
+    } }
+
+#define KERNELS_CSASCALAR(h, l, a, b, c) { \
+    uint64_t a_ = (a), b_ = (b), c_ = (c), u_ = a_ ^ b_; \
+    (h) = (a_ & b_) | (u_ & c_); \
+    (l) = u_ ^ c_; }
+
+// two consecutive words of a procedural basis vector, as one qword
+__attribute__((always_inline))
+static inline uint64_t kernels_generateScalar(uint32_t counter, uint32_t key) {
+    return (uint64_t)hypervector_hashWord(counter, key)
+        | (uint64_t)hypervector_hashWord(counter + 1, key) << 32;
+}
+
+__attribute__((always_inline))
+static inline void kernels_accumulateColumnScalar(uint64_t * planes, size_t nPlanes,
+    const Kernels_Encoding * encoding, uint8_t * input, const uint16_t * active,
+    size_t begin, size_t end, size_t w, int source, bool delta) {
+
+    const uint64_t * const * levelTable = encoding -> levelTable;
+    const size_t * boundOffset = encoding -> boundOffset;
+    const uint64_t * boundVectors = encoding -> boundVectors;
+    size_t boundFeatureStride = encoding -> boundFeatureStride;
+    Hypervector_Hypervector * basisVectors = encoding -> basisVectors;
+    uint32_t basisKey = encoding -> basisKey;
+    uint32_t basisWords = encoding -> basisWords;
+    uint64_t ones = planes[0], twos = planes[1], fours = planes[2], eights = planes[3];
+
+    #define KERNELS_LOADSCALAR(ptr) (*(ptr))
+    #define KERNELS_BOUNDSCALAR(f, v) (source == KERNELS_SOURCE_BOUND \
+        ? KERNELS_LOADSCALAR(boundVectors + (f) * boundFeatureStride + boundOffset[v] + w) \
+        : KERNELS_LOADSCALAR(levelTable[v] + w) ^ (source == KERNELS_SOURCE_PROCEDURAL \
+            ? kernels_generateScalar((f) * basisWords + 2 * w, basisKey) \
+            : KERNELS_LOADSCALAR((const uint64_t *)basisVectors[f].elems + w)))
+    #define KERNELS_EVENTERMSCALAR(t) \
+        KERNELS_BOUNDSCALAR(active[(t) >> 1], input[active[(t) >> 1]])
+    #define KERNELS_ODDTERMSCALAR(t) ~KERNELS_BOUNDSCALAR(active[(t) >> 1], 0)
+    #define KERNELS_TERMSCALAR(t) (!delta ? KERNELS_BOUNDSCALAR((t), input[t]) \
+        : (((t) - i) & 1) ? KERNELS_ODDTERMSCALAR(t) : KERNELS_EVENTERMSCALAR(t))
+    #define KERNELS_RIPPLESCALAR(x) { \
+        uint64_t carry = (x); \
+        for (p = 0; p < nPlanes && carry; p++) { \
+            uint64_t nextCarry = planes[p] & carry; \
+            planes[p] ^= carry; \
+            carry = nextCarry; \
+        } }
+
+    size_t p;
+    size_t i; for (i = begin; i + 16 <= end; i += 16) {
+        uint64_t sixteens;
+        KERNELS_HARLEY_SEAL16(uint64_t, KERNELS_CSASCALAR, KERNELS_TERMSCALAR);
+
+        for (p = 4; p < nPlanes && sixteens; p++) {
+            uint64_t carry = planes[p] & sixteens;
+            planes[p] ^= sixteens;
+            sixteens = carry;
+        }
+    }
+
+    planes[0] = ones;
+    planes[1] = twos;
+    planes[2] = fours;
+    planes[3] = eights;
+
+    if (delta) {
+        for (; i < end; i += 2) {
+            KERNELS_RIPPLESCALAR(KERNELS_EVENTERMSCALAR(i));
+            KERNELS_RIPPLESCALAR(KERNELS_ODDTERMSCALAR(i + 1));
+        }
+    }
+    else {
+        for (; i < end; i++) {
+            KERNELS_RIPPLESCALAR(KERNELS_BOUNDSCALAR(i, input[i]));
+        }
+    }
+
+    #undef KERNELS_RIPPLESCALAR
+    #undef KERNELS_TERMSCALAR
+    #undef KERNELS_ODDTERMSCALAR
+    #undef KERNELS_EVENTERMSCALAR
+    #undef KERNELS_BOUNDSCALAR
+    #undef KERNELS_LOADSCALAR
+}
+
+static void kernels_accumulateScalar(uint64_t * state, size_t nPlanes,
+    const Kernels_Encoding * encoding, uint8_t * input, const uint16_t * active,
+    size_t begin, size_t end, size_t w, size_t nQwords) {
+
+    // the scalar tile is always one qword wide
+    (void)nQwords;
+    bool delta = active != NULL;
+
+    #define KERNELS_CALLSCALAR(source, delta) kernels_accumulateColumnScalar(state, \
+        nPlanes, encoding, input, active, begin, end, w, source, delta)
+
+    KERNELS_SPECIALIZE(KERNELS_CALLSCALAR, encoding -> source, delta);
+
+    #undef KERNELS_CALLSCALAR
+}
+
+// count > threshold, evaluated from the most significant plane down
+static void kernels_thresholdScalar(uint64_t * state, size_t nPlanes,
+    size_t threshold, uint64_t * out, size_t nQwords) {
+
+    (void)nQwords;
+    uint64_t * planes = state;
+    uint64_t gt = 0;
+    uint64_t eq = ~(uint64_t)0;
+
+    size_t p; for (p = nPlanes; p-- > 0;) {
+        if ((threshold >> p) & 1) {
+            eq &= planes[p];
+        }
+        else {
+            gt |= eq & planes[p];
+            eq &= ~planes[p];
+        }
+    }
+
+    *out = gt;
+}
+
+static void kernels_encodeScalar(uint8_t * input, Hypervector_Basis * basis,
+    Hypervector_Hypervector * result, uint64_t * buffer) {
+
+    kernels_encodeTiled(1, kernels_accumulateScalar, kernels_thresholdScalar,
+        &input, 1, basis, result, buffer);
+}
+
+static void kernels_encodeBatchScalar(uint8_t ** inputs, size_t nSamples,
+    Hypervector_Basis * basis, Hypervector_Hypervector * results, uint64_t * buffer) {
+
+    kernels_encodeTiled(1, kernels_accumulateScalar, kernels_thresholdScalar,
+        inputs, nSamples, basis, results, buffer);
+}
+
+#define KERNELS_CSASSE42(h, l, a, b, c) { \
+    __m128i a_ = (a), b_ = (b), c_ = (c), u_ = _mm_xor_si128(a_, b_); \
+    (h) = _mm_or_si128(_mm_and_si128(a_, b_), _mm_and_si128(u_, c_)); \
+    (l) = _mm_xor_si128(u_, c_); }
+
+// hypervector_hashWord over the words counter .. counter + 3
+__attribute__((target("sse4.2"), always_inline))
+static inline __m128i kernels_generateSse42(uint32_t counter, uint32_t key) {
+    __m128i x = _mm_add_epi32(_mm_set1_epi32(counter), _mm_set_epi32(3, 2, 1, 0));
+    x = _mm_xor_si128(x, _mm_set1_epi32(key));
+    x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+    x = _mm_mullo_epi32(x, _mm_set1_epi32(HYPERVECTOR_HASH_M1));
+    x = _mm_xor_si128(x, _mm_srli_epi32(x, 15));
+    x = _mm_mullo_epi32(x, _mm_set1_epi32(HYPERVECTOR_HASH_M2));
+    return _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+}
+
+// SSE has no masked loads; a single trailing qword is loaded with movq
+__attribute__((target("sse4.2"), always_inline))
+static inline void kernels_accumulateColumnSse42(__m128i * planes, size_t nPlanes,
+    const Kernels_Encoding * encoding, uint8_t * input, const uint16_t * active,
+    size_t begin, size_t end, size_t w, bool half, int source, bool delta) {
+
+    const uint64_t * const * levelTable = encoding -> levelTable;
+    const size_t * boundOffset = encoding -> boundOffset;
+    const uint64_t * boundVectors = encoding -> boundVectors;
+    size_t boundFeatureStride = encoding -> boundFeatureStride;
+    Hypervector_Hypervector * basisVectors = encoding -> basisVectors;
+    uint32_t basisKey = encoding -> basisKey;
+    uint32_t basisWords = encoding -> basisWords;
+    __m128i ones = planes[0], twos = planes[1], fours = planes[2], eights = planes[3];
+
+    #define KERNELS_LOADSSE42(ptr) (half \
+        ? _mm_loadl_epi64((const __m128i *)(ptr)) \
+        : _mm_loadu_si128((const __m128i *)(ptr)))
+    #define KERNELS_BOUNDSSE42(f, v) (source == KERNELS_SOURCE_BOUND \
+        ? KERNELS_LOADSSE42(boundVectors + (f) * boundFeatureStride + boundOffset[v] + w) \
+        : _mm_xor_si128(KERNELS_LOADSSE42(levelTable[v] + w), \
+            source == KERNELS_SOURCE_PROCEDURAL \
+            ? kernels_generateSse42((f) * basisWords + 2 * w, basisKey) \
+            : KERNELS_LOADSSE42((const uint64_t *)basisVectors[f].elems + w)))
+    #define KERNELS_EVENTERMSSE42(t) \
+        KERNELS_BOUNDSSE42(active[(t) >> 1], input[active[(t) >> 1]])
+    #define KERNELS_ODDTERMSSE42(t) _mm_xor_si128( \
+        KERNELS_BOUNDSSE42(active[(t) >> 1], 0), _mm_set1_epi64x(-1))
+    #define KERNELS_TERMSSE42(t) (!delta ? KERNELS_BOUNDSSE42((t), input[t]) \
+        : (((t) - i) & 1) ? KERNELS_ODDTERMSSE42(t) : KERNELS_EVENTERMSSE42(t))
+    #define KERNELS_RIPPLESSE42(x) { \
+        __m128i carry = (x); \
+        for (p = 0; p < nPlanes && !_mm_testz_si128(carry, carry); p++) { \
+            __m128i nextCarry = _mm_and_si128(planes[p], carry); \
+            planes[p] = _mm_xor_si128(planes[p], carry); \
+            carry = nextCarry; \
+        } }
+
+    size_t p;
+    size_t i; for (i = begin; i + 16 <= end; i += 16) {
+        __m128i sixteens;
+        KERNELS_HARLEY_SEAL16(__m128i, KERNELS_CSASSE42, KERNELS_TERMSSE42);
+
+        for (p = 4; p < nPlanes && !_mm_testz_si128(sixteens, sixteens); p++) {
+            __m128i carry = _mm_and_si128(planes[p], sixteens);
+            planes[p] = _mm_xor_si128(planes[p], sixteens);
+            sixteens = carry;
+        }
+    }
+
+    planes[0] = ones;
+    planes[1] = twos;
+    planes[2] = fours;
+    planes[3] = eights;
+
+    if (delta) {
+        for (; i < end; i += 2) {
+            KERNELS_RIPPLESSE42(KERNELS_EVENTERMSSE42(i));
+            KERNELS_RIPPLESSE42(KERNELS_ODDTERMSSE42(i + 1));
+        }
+    }
+    else {
+        for (; i < end; i++) {
+            KERNELS_RIPPLESSE42(KERNELS_BOUNDSSE42(i, input[i]));
+        }
+    }
+
+    #undef KERNELS_RIPPLESSE42
+    #undef KERNELS_TERMSSE42
+    #undef KERNELS_ODDTERMSSE42
+    #undef KERNELS_EVENTERMSSE42
+    #undef KERNELS_BOUNDSSE42
+    #undef KERNELS_LOADSSE42
+}
+
+__attribute__((target("sse4.2")))
+static void kernels_accumulateSse42(uint64_t * state, size_t nPlanes,
+    const Kernels_Encoding * encoding, uint8_t * input, const uint16_t * active,
+    size_t begin, size_t end, size_t w, size_t nQwords) {
+
+    __m128i * planes = (__m128i *)state;
+    bool delta = active != NULL;
+
+    #define KERNELS_CALLSSE42(half, source, delta) kernels_accumulateColumnSse42(planes, \
+        nPlanes, encoding, input, active, begin, end, w, half, source, delta)
+    #define KERNELS_CALLFULLSSE42(source, delta) KERNELS_CALLSSE42(false, source, delta)
+
+    if (nQwords != 2) {
+        KERNELS_CALLSSE42(true, encoding -> source, delta);
+    }
+    else {
+        KERNELS_SPECIALIZE(KERNELS_CALLFULLSSE42, encoding -> source, delta);
+    }
+
+    #undef KERNELS_CALLFULLSSE42
+    #undef KERNELS_CALLSSE42
+}
+
+__attribute__((target("sse4.2")))
+static void kernels_thresholdSse42(uint64_t * state, size_t nPlanes,
+    size_t threshold, uint64_t * out, size_t nQwords) {
+
+    __m128i * planes = (__m128i *)state;
+    __m128i gt = _mm_setzero_si128();
+    __m128i eq = _mm_set1_epi64x(-1);
+
+    size_t p; for (p = nPlanes; p-- > 0;) {
+        if ((threshold >> p) & 1) {
+            eq = _mm_and_si128(eq, planes[p]);
+        }
+        else {
+            gt = _mm_or_si128(gt, _mm_and_si128(eq, planes[p]));
+            eq = _mm_andnot_si128(planes[p], eq);
+        }
+    }
+
+    if (nQwords == 2) {
+        _mm_storeu_si128((__m128i *)out, gt);
+    }
+    else {
+        _mm_storel_epi64((__m128i *)out, gt);
+    }
+}
+
+static void kernels_encodeSse42(uint8_t * input, Hypervector_Basis * basis,
+    Hypervector_Hypervector * result, uint64_t * buffer) {
+
+    kernels_encodeTiled(2, kernels_accumulateSse42, kernels_thresholdSse42,
+        &input, 1, basis, result, buffer);
+}
+
+static void kernels_encodeBatchSse42(uint8_t ** inputs, size_t nSamples,
+    Hypervector_Basis * basis, Hypervector_Hypervector * results, uint64_t * buffer) {
+
+    kernels_encodeTiled(2, kernels_accumulateSse42, kernels_thresholdSse42,
+        inputs, nSamples, basis, results, buffer);
+}
+
+#define KERNELS_CSAAVX2(h, l, a, b, c) { \
+    __m256i a_ = (a), b_ = (b), c_ = (c), u_ = _mm256_xor_si256(a_, b_); \
+    (h) = _mm256_or_si256(_mm256_and_si256(a_, b_), _mm256_and_si256(u_, c_)); \
+    (l) = _mm256_xor_si256(u_, c_); }
+
+// hypervector_hashWord over the words counter .. counter + 7
+__attribute__((target("avx2"), always_inline))
+static inline __m256i kernels_generateAvx2(uint32_t counter, uint32_t key) {
+    __m256i x = _mm256_add_epi32(_mm256_set1_epi32(counter),
+        _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+    x = _mm256_xor_si256(x, _mm256_set1_epi32(key));
+    x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+    x = _mm256_mullo_epi32(x, _mm256_set1_epi32(HYPERVECTOR_HASH_M1));
+    x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 15));
+    x = _mm256_mullo_epi32(x, _mm256_set1_epi32(HYPERVECTOR_HASH_M2));
+    return _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+}
+
+// masked loads keep the last, partial column inside the vector allocations
+__attribute__((target("avx2"), always_inline))
+static inline void kernels_accumulateColumnAvx2(__m256i * planes, size_t nPlanes,
+    const Kernels_Encoding * encoding, uint8_t * input, const uint16_t * active,
+    size_t begin, size_t end, size_t w, bool masked, __m256i mask, int source, bool delta) {
+
+    const uint64_t * const * levelTable = encoding -> levelTable;
+    const size_t * boundOffset = encoding -> boundOffset;
+    const uint64_t * boundVectors = encoding -> boundVectors;
+    size_t boundFeatureStride = encoding -> boundFeatureStride;
+    Hypervector_Hypervector * basisVectors = encoding -> basisVectors;
+    uint32_t basisKey = encoding -> basisKey;
+    uint32_t basisWords = encoding -> basisWords;
+    __m256i ones = planes[0], twos = planes[1], fours = planes[2], eights = planes[3];
+
+    #define KERNELS_LOADAVX2(ptr) (masked \
+        ? _mm256_maskload_epi64((const long long *)(ptr), mask) \
+        : _mm256_loadu_si256((const __m256i *)(ptr)))
+    #define KERNELS_BOUNDAVX2(f, v) (source == KERNELS_SOURCE_BOUND \
+        ? KERNELS_LOADAVX2(boundVectors + (f) * boundFeatureStride + boundOffset[v] + w) \
+        : _mm256_xor_si256(KERNELS_LOADAVX2(levelTable[v] + w), \
+            source == KERNELS_SOURCE_PROCEDURAL \
+            ? kernels_generateAvx2((f) * basisWords + 2 * w, basisKey) \
+            : KERNELS_LOADAVX2((const uint64_t *)basisVectors[f].elems + w)))
+    #define KERNELS_EVENTERMAVX2(t) \
+        KERNELS_BOUNDAVX2(active[(t) >> 1], input[active[(t) >> 1]])
+    #define KERNELS_ODDTERMAVX2(t) _mm256_xor_si256( \
+        KERNELS_BOUNDAVX2(active[(t) >> 1], 0), _mm256_set1_epi64x(-1))
+    #define KERNELS_TERMAVX2(t) (!delta ? KERNELS_BOUNDAVX2((t), input[t]) \
+        : (((t) - i) & 1) ? KERNELS_ODDTERMAVX2(t) : KERNELS_EVENTERMAVX2(t))
+    #define KERNELS_RIPPLEAVX2(x) { \
+        __m256i carry = (x); \
+        for (p = 0; p < nPlanes && !_mm256_testz_si256(carry, carry); p++) { \
+            __m256i nextCarry = _mm256_and_si256(planes[p], carry); \
+            planes[p] = _mm256_xor_si256(planes[p], carry); \
+            carry = nextCarry; \
+        } }
+
+    size_t p;
+    size_t i; for (i = begin; i + 16 <= end; i += 16) {
+        __m256i sixteens;
+        KERNELS_HARLEY_SEAL16(__m256i, KERNELS_CSAAVX2, KERNELS_TERMAVX2);
+
+        for (p = 4; p < nPlanes && !_mm256_testz_si256(sixteens, sixteens); p++) {
+            __m256i carry = _mm256_and_si256(planes[p], sixteens);
+            planes[p] = _mm256_xor_si256(planes[p], sixteens);
+            sixteens = carry;
+        }
+    }
+
+    planes[0] = ones;
+    planes[1] = twos;
+    planes[2] = fours;
+    planes[3] = eights;
+
+    if (delta) {
+        for (; i < end; i += 2) {
+            KERNELS_RIPPLEAVX2(KERNELS_EVENTERMAVX2(i));
+            KERNELS_RIPPLEAVX2(KERNELS_ODDTERMAVX2(i + 1));
+        }
+    }
+    else {
+        for (; i < end; i++) {
+            KERNELS_RIPPLEAVX2(KERNELS_BOUNDAVX2(i, input[i]));
+        }
+    }
+
+    #undef KERNELS_RIPPLEAVX2
+    #undef KERNELS_TERMAVX2
+    #undef KERNELS_ODDTERMAVX2
+    #undef KERNELS_EVENTERMAVX2
+    #undef KERNELS_BOUNDAVX2
+    #undef KERNELS_LOADAVX2
+}
+
+__attribute__((target("avx2")))
+static inline __m256i kernels_columnMaskAvx2(size_t nQwords) {
+    return _mm256_cmpgt_epi64(_mm256_set1_epi64x((long long)nQwords),
+        _mm256_set_epi64x(3, 2, 1, 0));
+}
+
+__attribute__((target("avx2")))
+static void kernels_accumulateAvx2(uint64_t * state, size_t nPlanes,
+    const Kernels_Encoding * encoding, uint8_t * input, const uint16_t * active,
+    size_t begin, size_t end, size_t w, size_t nQwords) {
+
+    __m256i * planes = (__m256i *)state;
+    __m256i noMask = _mm256_setzero_si256();
+    bool delta = active != NULL;
+
+    #define KERNELS_CALLAVX2(masked, mask, source, delta) kernels_accumulateColumnAvx2( \
+        planes, nPlanes, encoding, input, active, begin, end, w, masked, mask, \
+        source, delta)
+    #define KERNELS_CALLFULLAVX2(source, delta) \
+        KERNELS_CALLAVX2(false, noMask, source, delta)
+
+    if (nQwords != 4) {
+        KERNELS_CALLAVX2(true, kernels_columnMaskAvx2(nQwords), encoding -> source, delta);
+    }
+    else {
+        KERNELS_SPECIALIZE(KERNELS_CALLFULLAVX2, encoding -> source, delta);
+    }
+
+    #undef KERNELS_CALLFULLAVX2
+    #undef KERNELS_CALLAVX2
+}
+
+__attribute__((target("avx2")))
+static void kernels_thresholdAvx2(uint64_t * state, size_t nPlanes,
+    size_t threshold, uint64_t * out, size_t nQwords) {
+
+    __m256i * planes = (__m256i *)state;
+    __m256i gt = _mm256_setzero_si256();
+    __m256i eq = _mm256_set1_epi64x(-1);
+
+    size_t p; for (p = nPlanes; p-- > 0;) {
+        if ((threshold >> p) & 1) {
+            eq = _mm256_and_si256(eq, planes[p]);
+        }
+        else {
+            gt = _mm256_or_si256(gt, _mm256_and_si256(eq, planes[p]));
+            eq = _mm256_andnot_si256(planes[p], eq);
+        }
+    }
+
+    _mm256_maskstore_epi64((long long *)out, kernels_columnMaskAvx2(nQwords), gt);
+}
+
+static void kernels_encodeAvx2(uint8_t * input, Hypervector_Basis * basis,
+    Hypervector_Hypervector * result, uint64_t * buffer) {
+
+    kernels_encodeTiled(4, kernels_accumulateAvx2, kernels_thresholdAvx2,
+        &input, 1, basis, result, buffer);
+}
+
+static void kernels_encodeBatchAvx2(uint8_t ** inputs, size_t nSamples,
+    Hypervector_Basis * basis, Hypervector_Hypervector * results, uint64_t * buffer) {
+
+    kernels_encodeTiled(4, kernels_accumulateAvx2, kernels_thresholdAvx2,
+        inputs, nSamples, basis, results, buffer);
+}
+
+// ternary logic immediates: 0xE8 is majority(a, b, c), 0x96 is a ^ b ^ c
+#define KERNELS_CSAAVX512(h, l, a, b, c) { \
+    __m512i a_ = (a), b_ = (b), c_ = (c); \
+    (h) = _mm512_ternarylogic_epi64(a_, b_, c_, 0xE8); \
+    (l) = _mm512_ternarylogic_epi64(a_, b_, c_, 0x96); }
+
+// hypervector_hashWord over the words counter .. counter + 15
+__attribute__((target("avx512f"), always_inline))
+static inline __m512i kernels_generateAvx512(uint32_t counter, uint32_t key) {
+    __m512i x = _mm512_add_epi32(_mm512_set1_epi32(counter),
+        _mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0));
+    x = _mm512_xor_si512(x, _mm512_set1_epi32(key));
+    x = _mm512_xor_si512(x, _mm512_srli_epi32(x, 16));
+    x = _mm512_mullo_epi32(x, _mm512_set1_epi32(HYPERVECTOR_HASH_M1));
+    x = _mm512_xor_si512(x, _mm512_srli_epi32(x, 15));
+    x = _mm512_mullo_epi32(x, _mm512_set1_epi32(HYPERVECTOR_HASH_M2));
+    return _mm512_xor_si512(x, _mm512_srli_epi32(x, 16));
+}
+
+__attribute__((target("avx512f"), always_inline))
+static inline void kernels_accumulateColumnAvx512(__m512i * planes, size_t nPlanes,
+    const Kernels_Encoding * encoding, uint8_t * input, const uint16_t * active,
+    size_t begin, size_t end, size_t w, __mmask8 mask, int source, bool delta) {
+
+    const uint64_t * const * levelTable = encoding -> levelTable;
+    const size_t * boundOffset = encoding -> boundOffset;
+    const uint64_t * boundVectors = encoding -> boundVectors;
+    size_t boundFeatureStride = encoding -> boundFeatureStride;
+    Hypervector_Hypervector * basisVectors = encoding -> basisVectors;
+    uint32_t basisKey = encoding -> basisKey;
+    uint32_t basisWords = encoding -> basisWords;
+    __m512i ones = planes[0], twos = planes[1], fours = planes[2], eights = planes[3];
+
+    #define KERNELS_LOADAVX512(ptr) _mm512_maskz_loadu_epi64(mask, (ptr))
+    #define KERNELS_BOUNDAVX512(f, v) (source == KERNELS_SOURCE_BOUND \
+        ? KERNELS_LOADAVX512(boundVectors + (f) * boundFeatureStride + boundOffset[v] + w) \
+        : _mm512_xor_si512(KERNELS_LOADAVX512(levelTable[v] + w), \
+            source == KERNELS_SOURCE_PROCEDURAL \
+            ? kernels_generateAvx512((f) * basisWords + 2 * w, basisKey) \
+            : KERNELS_LOADAVX512((const uint64_t *)basisVectors[f].elems + w)))
+    #define KERNELS_EVENTERMAVX512(t) \
+        KERNELS_BOUNDAVX512(active[(t) >> 1], input[active[(t) >> 1]])
+    #define KERNELS_ODDTERMAVX512(t) _mm512_xor_si512( \
+        KERNELS_BOUNDAVX512(active[(t) >> 1], 0), _mm512_set1_epi64(-1))
+    #define KERNELS_TERMAVX512(t) (!delta ? KERNELS_BOUNDAVX512((t), input[t]) \
+        : (((t) - i) & 1) ? KERNELS_ODDTERMAVX512(t) : KERNELS_EVENTERMAVX512(t))
+    #define KERNELS_RIPPLEAVX512(x) { \
+        __m512i carry = (x); \
+        for (p = 0; p < nPlanes && _mm512_test_epi64_mask(carry, carry); p++) { \
+            __m512i nextCarry = _mm512_and_si512(planes[p], carry); \
+            planes[p] = _mm512_xor_si512(planes[p], carry); \
+            carry = nextCarry; \
+        } }
+
+    size_t p;
+    size_t i; for (i = begin; i + 16 <= end; i += 16) {
+        __m512i sixteens;
+        KERNELS_HARLEY_SEAL16(__m512i, KERNELS_CSAAVX512, KERNELS_TERMAVX512);
+
+        for (p = 4; p < nPlanes && _mm512_test_epi64_mask(sixteens, sixteens); p++) {
+            __m512i carry = _mm512_and_si512(planes[p], sixteens);
+            planes[p] = _mm512_xor_si512(planes[p], sixteens);
+            sixteens = carry;
+        }
+    }
+
+    planes[0] = ones;
+    planes[1] = twos;
+    planes[2] = fours;
+    planes[3] = eights;
+
+    if (delta) {
+        for (; i < end; i += 2) {
+            KERNELS_RIPPLEAVX512(KERNELS_EVENTERMAVX512(i));
+            KERNELS_RIPPLEAVX512(KERNELS_ODDTERMAVX512(i + 1));
+        }
+    }
+    else {
+        for (; i < end; i++) {
+            KERNELS_RIPPLEAVX512(KERNELS_BOUNDAVX512(i, input[i]));
+        }
+    }
+
+    #undef KERNELS_RIPPLEAVX512
+    #undef KERNELS_TERMAVX512
+    #undef KERNELS_ODDTERMAVX512
+    #undef KERNELS_EVENTERMAVX512
+    #undef KERNELS_BOUNDAVX512
+    #undef KERNELS_LOADAVX512
+}
+
+__attribute__((target("avx512f")))
+static void kernels_accumulateAvx512(uint64_t * state, size_t nPlanes,
+    const Kernels_Encoding * encoding, uint8_t * input, const uint16_t * active,
+    size_t begin, size_t end, size_t w, size_t nQwords) {
+
+    __m512i * planes = (__m512i *)state;
+    __mmask8 mask = (__mmask8)((1u << nQwords) - 1);
+    bool delta = active != NULL;
+
+    #define KERNELS_CALLAVX512(source, delta) kernels_accumulateColumnAvx512(planes, \
+        nPlanes, encoding, input, active, begin, end, w, mask, source, delta)
+
+    KERNELS_SPECIALIZE(KERNELS_CALLAVX512, encoding -> source, delta);
+
+    #undef KERNELS_CALLAVX512
+}
+
+__attribute__((target("avx512f")))
+static void kernels_thresholdAvx512(uint64_t * state, size_t nPlanes,
+    size_t threshold, uint64_t * out, size_t nQwords) {
+
+    __m512i * planes = (__m512i *)state;
+    __m512i gt = _mm512_setzero_si512();
+    __m512i eq = _mm512_set1_epi64(-1);
+
+    size_t p; for (p = nPlanes; p-- > 0;) {
+        if ((threshold >> p) & 1) {
+            eq = _mm512_and_si512(eq, planes[p]);
+        }
+        else {
+            gt = _mm512_or_si512(gt, _mm512_and_si512(eq, planes[p]));
+            eq = _mm512_andnot_si512(planes[p], eq);
+        }
+    }
+
+    _mm512_mask_storeu_epi64(out, (__mmask8)((1u << nQwords) - 1), gt);
+}
+
+static void kernels_encodeAvx512(uint8_t * input, Hypervector_Basis * basis,
+    Hypervector_Hypervector * result, uint64_t * buffer) {
+
+    kernels_encodeTiled(8, kernels_accumulateAvx512, kernels_thresholdAvx512,
+        &input, 1, basis, result, buffer);
+}
+
+static void kernels_encodeBatchAvx512(uint8_t ** inputs, size_t nSamples,
+    Hypervector_Basis * basis, Hypervector_Hypervector * results, uint64_t * buffer) {
+
+    kernels_encodeTiled(8, kernels_accumulateAvx512, kernels_thresholdAvx512,
+        inputs, nSamples, basis, results, buffer);
+}
+
+// train kernels add sign * (bit ? +1 : -1) to every element of the row
+
+static void kernels_trainScalar(int32_t * trainVector, const uint8_t * bitArray,
+    size_t length, int32_t sign) {
+
+    size_t i; for (i = 0; i < length; i++) {
+        int32_t bit = (bitArray[i >> 3] >> (i & 0x7)) & 1;
+        trainVector[i] += (2 * bit - 1) * sign;
+    }
+}
+
+__attribute__((target("sse4.2")))
+static void kernels_trainSse42(int32_t * trainVector, const uint8_t * bitArray,
+    size_t length, int32_t sign) {
+
+    __m128i lowBits = _mm_setr_epi32(1, 2, 4, 8);
+    __m128i highBits = _mm_setr_epi32(16, 32, 64, 128);
+    __m128i one = _mm_set1_epi32(1);
+    __m128i negSign = _mm_set1_epi32(-sign);
+
+    size_t i; for (i = 0; i + 8 <= length; i += 8) {
+        __m128i byte = _mm_set1_epi32(bitArray[i >> 3]);
+
+        // (bit mask | 1) is -1 for set bits and +1 for clear ones
+        __m128i lowDelta = _mm_or_si128(one,
+            _mm_cmpeq_epi32(_mm_and_si128(byte, lowBits), lowBits));
+        __m128i highDelta = _mm_or_si128(one,
+            _mm_cmpeq_epi32(_mm_and_si128(byte, highBits), highBits));
+
+        __m128i * dest = (__m128i *)(trainVector + i);
+        _mm_storeu_si128(dest, _mm_add_epi32(_mm_loadu_si128(dest),
+            _mm_sign_epi32(lowDelta, negSign)));
+        _mm_storeu_si128(dest + 1, _mm_add_epi32(_mm_loadu_si128(dest + 1),
+            _mm_sign_epi32(highDelta, negSign)));
+    }
+
+    kernels_trainScalar(trainVector + i, bitArray + (i >> 3), length - i, sign);
+}
+
+__attribute__((target("avx2")))
+static void kernels_trainAvx2(int32_t * trainVector, const uint8_t * bitArray,
+    size_t length, int32_t sign) {
+
+    __m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    __m256i one = _mm256_set1_epi32(1);
+    __m256i negSign = _mm256_set1_epi32(-sign);
+
+    size_t i; for (i = 0; i + 8 <= length; i += 8) {
+        __m256i byte = _mm256_set1_epi32(bitArray[i >> 3]);
+        __m256i delta = _mm256_or_si256(one,
+            _mm256_cmpeq_epi32(_mm256_and_si256(byte, bits), bits));
+
+        __m256i * dest = (__m256i *)(trainVector + i);
+        _mm256_storeu_si256(dest, _mm256_add_epi32(_mm256_loadu_si256(dest),
+            _mm256_sign_epi32(delta, negSign)));
+    }
+
+    kernels_trainScalar(trainVector + i, bitArray + (i >> 3), length - i, sign);
+}
+
+__attribute__((target("avx512f")))
+static void kernels_trainAvx512(int32_t * trainVector, const uint8_t * bitArray,
+    size_t length, int32_t sign) {
+
+    __m512i setDelta = _mm512_set1_epi32(sign);
+    __m512i clearDelta = _mm512_set1_epi32(-sign);
+
+    size_t i; for (i = 0; i + 16 <= length; i += 16) {
+        __mmask16 set = (__mmask16)(bitArray[i >> 3] | (bitArray[(i >> 3) + 1] << 8));
+        __m512i delta = _mm512_mask_blend_epi32(set, clearDelta, setDelta);
+
+        __m512i * dest = (__m512i *)(trainVector + i);
+        _mm512_storeu_si512(dest, _mm512_add_epi32(_mm512_loadu_si512(dest), delta));
+    }
+
+    kernels_trainScalar(trainVector + i, bitArray + (i >> 3), length - i, sign);
+}
+
+// train pair kernels add the bipolar form of the bit array to one row and
+// subtract it from another in the same pass, for a retrain correction
+
+static void kernels_trainPairScalar(int32_t * trainVector, int32_t * untrainVector,
+    const uint8_t * bitArray, size_t length) {
+
+    size_t i; for (i = 0; i < length; i++) {
+        int32_t delta = 2 * ((bitArray[i >> 3] >> (i & 0x7)) & 1) - 1;
+        trainVector[i] += delta;
+        untrainVector[i] -= delta;
+    }
+}
+
+__attribute__((target("sse4.2")))
+static void kernels_trainPairSse42(int32_t * trainVector, int32_t * untrainVector,
+    const uint8_t * bitArray, size_t length) {
+
+    __m128i lowBits = _mm_setr_epi32(1, 2, 4, 8);
+    __m128i highBits = _mm_setr_epi32(16, 32, 64, 128);
+    __m128i one = _mm_set1_epi32(1);
+
+    size_t i; for (i = 0; i + 8 <= length; i += 8) {
+        __m128i byte = _mm_set1_epi32(bitArray[i >> 3]);
+
+        // (bit mask | 1) is -1 for set bits and +1 for clear ones, the
+        // delta of the untrained row
+        __m128i lowDelta = _mm_or_si128(one,
+            _mm_cmpeq_epi32(_mm_and_si128(byte, lowBits), lowBits));
+        __m128i highDelta = _mm_or_si128(one,
+            _mm_cmpeq_epi32(_mm_and_si128(byte, highBits), highBits));
+
+        __m128i * train = (__m128i *)(trainVector + i);
+        __m128i * untrain = (__m128i *)(untrainVector + i);
+        _mm_storeu_si128(train, _mm_sub_epi32(_mm_loadu_si128(train), lowDelta));
+        _mm_storeu_si128(train + 1, _mm_sub_epi32(_mm_loadu_si128(train + 1), highDelta));
+        _mm_storeu_si128(untrain, _mm_add_epi32(_mm_loadu_si128(untrain), lowDelta));
+        _mm_storeu_si128(untrain + 1, _mm_add_epi32(_mm_loadu_si128(untrain + 1), highDelta));
+    }
+
+    kernels_trainPairScalar(trainVector + i, untrainVector + i, bitArray + (i >> 3),
+        length - i);
+}
+
+__attribute__((target("avx2")))
+static void kernels_trainPairAvx2(int32_t * trainVector, int32_t * untrainVector,
+    const uint8_t * bitArray, size_t length) {
+
+    __m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    __m256i one = _mm256_set1_epi32(1);
+
+    size_t i; for (i = 0; i + 8 <= length; i += 8) {
+        __m256i byte = _mm256_set1_epi32(bitArray[i >> 3]);
+        __m256i delta = _mm256_or_si256(one,
+            _mm256_cmpeq_epi32(_mm256_and_si256(byte, bits), bits));
+
+        __m256i * train = (__m256i *)(trainVector + i);
+        __m256i * untrain = (__m256i *)(untrainVector + i);
+        _mm256_storeu_si256(train, _mm256_sub_epi32(_mm256_loadu_si256(train), delta));
+        _mm256_storeu_si256(untrain, _mm256_add_epi32(_mm256_loadu_si256(untrain), delta));
+    }
+
+    kernels_trainPairScalar(trainVector + i, untrainVector + i, bitArray + (i >> 3),
+        length - i);
+}
+
+__attribute__((target("avx512f")))
+static void kernels_trainPairAvx512(int32_t * trainVector, int32_t * untrainVector,
+    const uint8_t * bitArray, size_t length) {
+
+    __m512i plus = _mm512_set1_epi32(1);
+    __m512i minus = _mm512_set1_epi32(-1);
+
+    size_t i; for (i = 0; i + 16 <= length; i += 16) {
+        __mmask16 set = (__mmask16)(bitArray[i >> 3] | (bitArray[(i >> 3) + 1] << 8));
+        __m512i delta = _mm512_mask_blend_epi32(set, minus, plus);
+
+        __m512i * train = (__m512i *)(trainVector + i);
+        __m512i * untrain = (__m512i *)(untrainVector + i);
+        _mm512_storeu_si512(train, _mm512_add_epi32(_mm512_loadu_si512(train), delta));
+        _mm512_storeu_si512(untrain, _mm512_sub_epi32(_mm512_loadu_si512(untrain), delta));
+    }
+
+    kernels_trainPairScalar(trainVector + i, untrainVector + i, bitArray + (i >> 3),
+        length - i);
+}
+
+// int16 forms of the train and train pair kernels, for compact train sets;
+// callers keep every element clear of saturation
+
+static void kernels_train16Scalar(int16_t * trainVector, const uint8_t * bitArray,
+    size_t length, int32_t sign) {
+
+    size_t i; for (i = 0; i < length; i++) {
+        int32_t bit = (bitArray[i >> 3] >> (i & 0x7)) & 1;
+        trainVector[i] += (int16_t)((2 * bit - 1) * sign);
+    }
+}
+
+static void kernels_trainPair16Scalar(int16_t * trainVector, int16_t * untrainVector,
+    const uint8_t * bitArray, size_t length) {
+
+    size_t i; for (i = 0; i < length; i++) {
+        int16_t delta = (int16_t)(2 * ((bitArray[i >> 3] >> (i & 0x7)) & 1) - 1);
+        trainVector[i] += delta;
+        untrainVector[i] -= delta;
+    }
+}
+
+// (bit mask | 1) of the eight bits of one byte as int16 lanes: -1 for set
+// bits and +1 for clear ones
+__attribute__((target("sse4.2")))
+static inline __m128i kernels_byteDelta16Sse42(uint8_t byte) {
+    __m128i bits = _mm_setr_epi16(1, 2, 4, 8, 16, 32, 64, 128);
+
+    return _mm_or_si128(_mm_set1_epi16(1),
+        _mm_cmpeq_epi16(_mm_and_si128(_mm_set1_epi16(byte), bits), bits));
+}
+
+__attribute__((target("sse4.2")))
+static void kernels_train16Sse42(int16_t * trainVector, const uint8_t * bitArray,
+    size_t length, int32_t sign) {
+
+    __m128i negSign = _mm_set1_epi16((int16_t)-sign);
+
+    size_t i; for (i = 0; i + 8 <= length; i += 8) {
+        __m128i delta = _mm_sign_epi16(kernels_byteDelta16Sse42(bitArray[i >> 3]), negSign);
+
+        __m128i * dest = (__m128i *)(trainVector + i);
+        _mm_storeu_si128(dest, _mm_add_epi16(_mm_loadu_si128(dest), delta));
+    }
+
+    kernels_train16Scalar(trainVector + i, bitArray + (i >> 3), length - i, sign);
+}
+
+__attribute__((target("sse4.2")))
+static void kernels_trainPair16Sse42(int16_t * trainVector, int16_t * untrainVector,
+    const uint8_t * bitArray, size_t length) {
+
+    size_t i; for (i = 0; i + 8 <= length; i += 8) {
+        __m128i delta = kernels_byteDelta16Sse42(bitArray[i >> 3]);
+
+        __m128i * train = (__m128i *)(trainVector + i);
+        __m128i * untrain = (__m128i *)(untrainVector + i);
+        _mm_storeu_si128(train, _mm_sub_epi16(_mm_loadu_si128(train), delta));
+        _mm_storeu_si128(untrain, _mm_add_epi16(_mm_loadu_si128(untrain), delta));
+    }
+
+    kernels_trainPair16Scalar(trainVector + i, untrainVector + i, bitArray + (i >> 3),
+        length - i);
+}
+
+// the same for the sixteen bits of two bytes
+__attribute__((target("avx2")))
+static inline __m256i kernels_wordDelta16Avx2(const uint8_t * bitArray) {
+    __m256i bits = _mm256_setr_epi16(1, 2, 4, 8, 16, 32, 64, 128,
+        256, 512, 1024, 2048, 4096, 8192, 16384, (int16_t)32768);
+    int16_t word = (int16_t)(bitArray[0] | (bitArray[1] << 8));
+
+    return _mm256_or_si256(_mm256_set1_epi16(1),
+        _mm256_cmpeq_epi16(_mm256_and_si256(_mm256_set1_epi16(word), bits), bits));
+}
+
+__attribute__((target("avx2")))
+static void kernels_train16Avx2(int16_t * trainVector, const uint8_t * bitArray,
+    size_t length, int32_t sign) {
+
+    __m256i negSign = _mm256_set1_epi16((int16_t)-sign);
+
+    size_t i; for (i = 0; i + 16 <= length; i += 16) {
+        __m256i delta = _mm256_sign_epi16(kernels_wordDelta16Avx2(bitArray + (i >> 3)), negSign);
+
+        __m256i * dest = (__m256i *)(trainVector + i);
+        _mm256_storeu_si256(dest, _mm256_add_epi16(_mm256_loadu_si256(dest), delta));
+    }
+
+    kernels_train16Scalar(trainVector + i, bitArray + (i >> 3), length - i, sign);
+}
+
+__attribute__((target("avx2")))
+static void kernels_trainPair16Avx2(int16_t * trainVector, int16_t * untrainVector,
+    const uint8_t * bitArray, size_t length) {
+
+    size_t i; for (i = 0; i + 16 <= length; i += 16) {
+        __m256i delta = kernels_wordDelta16Avx2(bitArray + (i >> 3));
+
+        __m256i * train = (__m256i *)(trainVector + i);
+        __m256i * untrain = (__m256i *)(untrainVector + i);
+        _mm256_storeu_si256(train, _mm256_sub_epi16(_mm256_loadu_si256(train), delta));
+        _mm256_storeu_si256(untrain, _mm256_add_epi16(_mm256_loadu_si256(untrain), delta));
+    }
+
+    kernels_trainPair16Scalar(trainVector + i, untrainVector + i, bitArray + (i >> 3),
+        length - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void kernels_train16Avx512(int16_t * trainVector, const uint8_t * bitArray,
+    size_t length, int32_t sign) {
+
+    __m512i setDelta = _mm512_set1_epi16((int16_t)sign);
+    __m512i clearDelta = _mm512_set1_epi16((int16_t)-sign);
+
+    size_t i; for (i = 0; i + 32 <= length; i += 32) {
+        uint32_t set;
+        memcpy(&set, bitArray + (i >> 3), sizeof(set));
+        __m512i delta = _mm512_mask_blend_epi16((__mmask32)set, clearDelta, setDelta);
+
+        __m512i * dest = (__m512i *)(trainVector + i);
+        _mm512_storeu_si512(dest, _mm512_add_epi16(_mm512_loadu_si512(dest), delta));
+    }
+
+    kernels_train16Scalar(trainVector + i, bitArray + (i >> 3), length - i, sign);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void kernels_trainPair16Avx512(int16_t * trainVector, int16_t * untrainVector,
+    const uint8_t * bitArray, size_t length) {
+
+    __m512i plus = _mm512_set1_epi16(1);
+    __m512i minus = _mm512_set1_epi16(-1);
+
+    size_t i; for (i = 0; i + 32 <= length; i += 32) {
+        uint32_t set;
+        memcpy(&set, bitArray + (i >> 3), sizeof(set));
+        __m512i delta = _mm512_mask_blend_epi16((__mmask32)set, minus, plus);
+
+        __m512i * train = (__m512i *)(trainVector + i);
+        __m512i * untrain = (__m512i *)(untrainVector + i);
+        _mm512_storeu_si512(train, _mm512_add_epi16(_mm512_loadu_si512(train), delta));
+        _mm512_storeu_si512(untrain, _mm512_sub_epi16(_mm512_loadu_si512(untrain), delta));
+    }
+
+    kernels_trainPair16Scalar(trainVector + i, untrainVector + i, bitArray + (i >> 3),
+        length - i);
+}
+
+// similarity kernels return the dot product of the class vector with the
+// bipolar (+1 for set, -1 for clear) form of the bit array, summed in 64 bits
+
+static int64_t kernels_similarityScalar(const int32_t * classVector,
+    const uint8_t * bitArray, size_t length) {
+
+    int64_t similarity = 0;
+
+    size_t i; for (i = 0; i < length; i++) {
+        int64_t flip = (int64_t)((bitArray[i >> 3] >> (i & 0x7)) & 1) - 1;
+        similarity += ((int64_t)classVector[i] ^ flip) - flip;
+    }
+
+    return similarity;
+}
+
+__attribute__((target("sse4.2")))
+static int64_t kernels_similaritySse42(const int32_t * classVector,
+    const uint8_t * bitArray, size_t length) {
+
+    __m128i lowBits = _mm_setr_epi32(1, 2, 4, 8);
+    __m128i highBits = _mm_setr_epi32(16, 32, 64, 128);
+    __m128i one = _mm_set1_epi32(1);
+    __m128i acc = _mm_setzero_si128();
+
+    // _mm_sign_epi32 negates where the bit is set, so this sums -similarity
+    size_t i; for (i = 0; i + 8 <= length; i += 8) {
+        __m128i byte = _mm_set1_epi32(bitArray[i >> 3]);
+        __m128i lowDelta = _mm_or_si128(one,
+            _mm_cmpeq_epi32(_mm_and_si128(byte, lowBits), lowBits));
+        __m128i highDelta = _mm_or_si128(one,
+            _mm_cmpeq_epi32(_mm_and_si128(byte, highBits), highBits));
+
+        __m128i low = _mm_sign_epi32(
+            _mm_loadu_si128((const __m128i *)(classVector + i)), lowDelta);
+        __m128i high = _mm_sign_epi32(
+            _mm_loadu_si128((const __m128i *)(classVector + i + 4)), highDelta);
+
+        acc = _mm_add_epi64(acc, _mm_cvtepi32_epi64(low));
+        acc = _mm_add_epi64(acc, _mm_cvtepi32_epi64(_mm_srli_si128(low, 8)));
+        acc = _mm_add_epi64(acc, _mm_cvtepi32_epi64(high));
+        acc = _mm_add_epi64(acc, _mm_cvtepi32_epi64(_mm_srli_si128(high, 8)));
+    }
+
+    int64_t similarity = -(_mm_cvtsi128_si64(acc) + _mm_extract_epi64(acc, 1));
+
+    return similarity + kernels_similarityScalar(classVector + i,
+        bitArray + (i >> 3), length - i);
+}
+
+__attribute__((target("avx2")))
+static int64_t kernels_similarityAvx2(const int32_t * classVector,
+    const uint8_t * bitArray, size_t length) {
+
+    __m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    __m256i one = _mm256_set1_epi32(1);
+    __m256i acc = _mm256_setzero_si256();
+
+    size_t i; for (i = 0; i + 8 <= length; i += 8) {
+        __m256i byte = _mm256_set1_epi32(bitArray[i >> 3]);
+        __m256i delta = _mm256_or_si256(one,
+            _mm256_cmpeq_epi32(_mm256_and_si256(byte, bits), bits));
+
+        __m256i terms = _mm256_sign_epi32(
+            _mm256_loadu_si256((const __m256i *)(classVector + i)), delta);
+
+        acc = _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(terms)));
+        acc = _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(terms, 1)));
+    }
+
+    __m128i half = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    int64_t similarity = -(_mm_cvtsi128_si64(half) + _mm_extract_epi64(half, 1));
+
+    return similarity + kernels_similarityScalar(classVector + i,
+        bitArray + (i >> 3), length - i);
+}
+
+__attribute__((target("avx512f")))
+static int64_t kernels_similarityAvx512(const int32_t * classVector,
+    const uint8_t * bitArray, size_t length) {
+
+    __m512i zero = _mm512_setzero_si512();
+    __m512i acc = zero;
+
+    size_t i; for (i = 0; i + 16 <= length; i += 16) {
+        __mmask16 set = (__mmask16)(bitArray[i >> 3] | (bitArray[(i >> 3) + 1] << 8));
+
+        __m512i values = _mm512_loadu_si512(classVector + i);
+        __m512i terms = _mm512_mask_sub_epi32(values, (__mmask16)~set, zero, values);
+
+        acc = _mm512_add_epi64(acc, _mm512_cvtepi32_epi64(_mm512_castsi512_si256(terms)));
+        acc = _mm512_add_epi64(acc, _mm512_cvtepi32_epi64(_mm512_extracti64x4_epi64(terms, 1)));
+    }
+
+    return _mm512_reduce_add_epi64(acc) + kernels_similarityScalar(classVector + i,
+        bitArray + (i >> 3), length - i);
+}
+
+// Matrix kernels score a query against every label of a label-interleaved
+// class matrix: element j of label l sits at (j / 64 * nLabels + l) * 64 +
+// j % 64. Labels are taken KERNELS_MATRIX_GROUP at a time; within a group,
+// EXPAND turns query qword c into sign masks once and DOT applies them to
+// the 64-element chunk of each label, adding into int32 lane accumulators
+// that are widened to 64 bits every KERNELS_MATRIX_FLUSH chunks, before any
+// lane can overflow.
+#define KERNELS_MATRIX(T, V, ZERO, EXPAND, DOT, REDUCE) { \
+    size_t first; for (first = 0; first < nLabels; first += KERNELS_MATRIX_GROUP) { \
+        size_t nGroup = nLabels - first < KERNELS_MATRIX_GROUP \
+            ? nLabels - first : KERNELS_MATRIX_GROUP; \
+        V acc[KERNELS_MATRIX_GROUP]; \
+        size_t l; for (l = 0; l < nGroup; l++) { \
+            similarities[first + l] = 0; \
+        } \
+        size_t begin; for (begin = 0; begin < nChunks; begin += KERNELS_MATRIX_FLUSH) { \
+            size_t end = nChunks - begin < KERNELS_MATRIX_FLUSH \
+                ? nChunks : begin + KERNELS_MATRIX_FLUSH; \
+            for (l = 0; l < nGroup; l++) { \
+                acc[l] = ZERO; \
+            } \
+            size_t c; for (c = begin; c < end; c++) { \
+                EXPAND(query[c]); \
+                const T * rows = matrix + (c * nLabels + first) * 64; \
+                for (l = 0; l < nGroup; l++) { \
+                    DOT(acc[l], rows + l * 64); \
+                } \
+            } \
+            for (l = 0; l < nGroup; l++) { \
+                similarities[first + l] += REDUCE(acc[l]); \
+            } \
+        } \
+    } \
+}
+
+static void kernels_similarityMatrix8Scalar(const int8_t * matrix, size_t nLabels,
+    const uint64_t * query, size_t nChunks, int64_t * similarities) {
+
+    size_t label; for (label = 0; label < nLabels; label++) {
+        int64_t similarity = 0;
+
+        size_t c; for (c = 0; c < nChunks; c++) {
+            const int8_t * row = matrix + (c * nLabels + label) * 64;
+            uint64_t bits = query[c];
+
+            size_t i; for (i = 0; i < 64; i++) {
+                int64_t flip = (int64_t)((bits >> i) & 1) - 1;
+                similarity += ((int64_t)row[i] ^ flip) - flip;
+            }
+        }
+
+        similarities[label] = similarity;
+    }
+}
+
+static void kernels_similarityMatrix16Scalar(const int16_t * matrix, size_t nLabels,
+    const uint64_t * query, size_t nChunks, int64_t * similarities) {
+
+    size_t label; for (label = 0; label < nLabels; label++) {
+        int64_t similarity = 0;
+
+        size_t c; for (c = 0; c < nChunks; c++) {
+            const int16_t * row = matrix + (c * nLabels + label) * 64;
+            uint64_t bits = query[c];
+
+            size_t i; for (i = 0; i < 64; i++) {
+                int64_t flip = (int64_t)((bits >> i) & 1) - 1;
+                similarity += ((int64_t)row[i] ^ flip) - flip;
+            }
+        }
+
+        similarities[label] = similarity;
+    }
+}
+
+// SSE and AVX2 expand query bits into lanes that are all ones where the bit
+// is clear, and negate those lanes as (x ^ m) - m
+
+__attribute__((target("sse4.2"), always_inline))
+static inline int64_t kernels_reduceSse42(__m128i acc) {
+    __m128i sums = _mm_add_epi64(_mm_cvtepi32_epi64(acc),
+        _mm_cvtepi32_epi64(_mm_srli_si128(acc, 8)));
+    return _mm_cvtsi128_si64(sums) + _mm_extract_epi64(sums, 1);
+}
+
+__attribute__((target("sse4.2")))
+static void kernels_similarityMatrix8Sse42(const int8_t * matrix, size_t nLabels,
+    const uint64_t * query, size_t nChunks, int64_t * similarities) {
+
+    // byte i of a 16-bit group takes bit i % 8 of byte i / 8
+    __m128i spread = _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1);
+    __m128i bitOf = _mm_set1_epi64x((long long)0x8040201008040201ULL);
+    __m128i ones8 = _mm_set1_epi8(1);
+    __m128i ones16 = _mm_set1_epi16(1);
+    __m128i zero = _mm_setzero_si128();
+    __m128i clear[4];
+
+    #define KERNELS_EXPAND8SSE42(bits) { \
+        size_t k; for (k = 0; k < 4; k++) { \
+            __m128i group = _mm_shuffle_epi8( \
+                _mm_cvtsi32_si128((int)(((bits) >> (16 * k)) & 0xFFFF)), spread); \
+            clear[k] = _mm_cmpeq_epi8(_mm_and_si128(group, bitOf), zero); \
+        } \
+    }
+    #define KERNELS_DOT8SSE42(acc, row) { \
+        __m128i sum16 = zero; \
+        size_t k; for (k = 0; k < 4; k++) { \
+            __m128i values = _mm_load_si128((const __m128i *)(row) + k); \
+            values = _mm_sub_epi8(_mm_xor_si128(values, clear[k]), clear[k]); \
+            sum16 = _mm_add_epi16(sum16, _mm_maddubs_epi16(ones8, values)); \
+        } \
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(sum16, ones16)); \
+    }
+
+    KERNELS_MATRIX(int8_t, __m128i, zero, KERNELS_EXPAND8SSE42, KERNELS_DOT8SSE42,
+        kernels_reduceSse42)
+
+    #undef KERNELS_EXPAND8SSE42
+    #undef KERNELS_DOT8SSE42
+}
+
+__attribute__((target("sse4.2")))
+static void kernels_similarityMatrix16Sse42(const int16_t * matrix, size_t nLabels,
+    const uint64_t * query, size_t nChunks, int64_t * similarities) {
+
+    __m128i bitOf = _mm_setr_epi16(1, 2, 4, 8, 16, 32, 64, 128);
+    __m128i ones16 = _mm_set1_epi16(1);
+    __m128i zero = _mm_setzero_si128();
+    __m128i clear[8];
+
+    #define KERNELS_EXPAND16SSE42(bits) { \
+        size_t k; for (k = 0; k < 8; k++) { \
+            __m128i group = _mm_set1_epi16((short)(((bits) >> (8 * k)) & 0xFF)); \
+            clear[k] = _mm_cmpeq_epi16(_mm_and_si128(group, bitOf), zero); \
+        } \
+    }
+    #define KERNELS_DOT16SSE42(acc, row) { \
+        size_t k; for (k = 0; k < 8; k++) { \
+            __m128i values = _mm_load_si128((const __m128i *)(row) + k); \
+            values = _mm_sub_epi16(_mm_xor_si128(values, clear[k]), clear[k]); \
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(values, ones16)); \
+        } \
+    }
+
+    KERNELS_MATRIX(int16_t, __m128i, zero, KERNELS_EXPAND16SSE42, KERNELS_DOT16SSE42,
+        kernels_reduceSse42)
+
+    #undef KERNELS_EXPAND16SSE42
+    #undef KERNELS_DOT16SSE42
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline int64_t kernels_reduceAvx2(__m256i acc) {
+    __m256i sums = _mm256_add_epi64(_mm256_cvtepi32_epi64(_mm256_castsi256_si128(acc)),
+        _mm256_cvtepi32_epi64(_mm256_extracti128_si256(acc, 1)));
+    __m128i half = _mm_add_epi64(_mm256_castsi256_si128(sums),
+        _mm256_extracti128_si256(sums, 1));
+    return _mm_cvtsi128_si64(half) + _mm_extract_epi64(half, 1);
+}
+
+__attribute__((target("avx2")))
+static void kernels_similarityMatrix8Avx2(const int8_t * matrix, size_t nLabels,
+    const uint64_t * query, size_t nChunks, int64_t * similarities) {
+
+    // byte i of a 32-bit group takes bit i % 8 of byte i / 8
+    __m256i spread = _mm256_setr_epi8(
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+        2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+    __m256i bitOf = _mm256_set1_epi64x((long long)0x8040201008040201ULL);
+    __m256i ones8 = _mm256_set1_epi8(1);
+    __m256i ones16 = _mm256_set1_epi16(1);
+    __m256i zero = _mm256_setzero_si256();
+    __m256i clear[2];
+
+    #define KERNELS_EXPAND8AVX2(bits) { \
+        size_t k; for (k = 0; k < 2; k++) { \
+            __m256i group = _mm256_shuffle_epi8( \
+                _mm256_set1_epi32((int)((bits) >> (32 * k))), spread); \
+            clear[k] = _mm256_cmpeq_epi8(_mm256_and_si256(group, bitOf), zero); \
+        } \
+    }
+    #define KERNELS_DOT8AVX2(acc, row) { \
+        __m256i sum16 = zero; \
+        size_t k; for (k = 0; k < 2; k++) { \
+            __m256i values = _mm256_load_si256((const __m256i *)(row) + k); \
+            values = _mm256_sub_epi8(_mm256_xor_si256(values, clear[k]), clear[k]); \
+            sum16 = _mm256_add_epi16(sum16, _mm256_maddubs_epi16(ones8, values)); \
+        } \
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(sum16, ones16)); \
+    }
+
+    KERNELS_MATRIX(int8_t, __m256i, zero, KERNELS_EXPAND8AVX2, KERNELS_DOT8AVX2,
+        kernels_reduceAvx2)
+
+    #undef KERNELS_EXPAND8AVX2
+    #undef KERNELS_DOT8AVX2
+}
+
+__attribute__((target("avx2")))
+static void kernels_similarityMatrix16Avx2(const int16_t * matrix, size_t nLabels,
+    const uint64_t * query, size_t nChunks, int64_t * similarities) {
+
+    __m256i bitOf = _mm256_setr_epi16(1, 2, 4, 8, 16, 32, 64, 128,
+        256, 512, 1024, 2048, 4096, 8192, 16384, (short)32768);
+    __m256i ones16 = _mm256_set1_epi16(1);
+    __m256i zero = _mm256_setzero_si256();
+    __m256i clear[4];
+
+    #define KERNELS_EXPAND16AVX2(bits) { \
+        size_t k; for (k = 0; k < 4; k++) { \
+            __m256i group = _mm256_set1_epi16((short)(((bits) >> (16 * k)) & 0xFFFF)); \
+            clear[k] = _mm256_cmpeq_epi16(_mm256_and_si256(group, bitOf), zero); \
+        } \
+    }
+    #define KERNELS_DOT16AVX2(acc, row) { \
+        size_t k; for (k = 0; k < 4; k++) { \
+            __m256i values = _mm256_load_si256((const __m256i *)(row) + k); \
+            values = _mm256_sub_epi16(_mm256_xor_si256(values, clear[k]), clear[k]); \
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(values, ones16)); \
+        } \
+    }
+
+    KERNELS_MATRIX(int16_t, __m256i, zero, KERNELS_EXPAND16AVX2, KERNELS_DOT16AVX2,
+        kernels_reduceAvx2)
+
+    #undef KERNELS_EXPAND16AVX2
+    #undef KERNELS_DOT16AVX2
+}
+
+// AVX-512 takes the query bits directly as lane masks
+
+__attribute__((target("avx512f,avx512bw"), always_inline))
+static inline int64_t kernels_reduceAvx512(__m512i acc) {
+    return _mm512_reduce_add_epi64(_mm512_add_epi64(
+        _mm512_cvtepi32_epi64(_mm512_castsi512_si256(acc)),
+        _mm512_cvtepi32_epi64(_mm512_extracti64x4_epi64(acc, 1))));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void kernels_similarityMatrix8Avx512(const int8_t * matrix, size_t nLabels,
+    const uint64_t * query, size_t nChunks, int64_t * similarities) {
+
+    __m512i ones8 = _mm512_set1_epi8(1);
+    __m512i ones16 = _mm512_set1_epi16(1);
+    __m512i zero = _mm512_setzero_si512();
+    __mmask64 clear;
+
+    #define KERNELS_EXPAND8AVX512(bits) { \
+        clear = (__mmask64)~(bits); \
+    }
+    #define KERNELS_DOT8AVX512(acc, row) { \
+        __m512i values = _mm512_load_si512(row); \
+        values = _mm512_mask_sub_epi8(values, clear, zero, values); \
+        acc = _mm512_add_epi32(acc, \
+            _mm512_madd_epi16(_mm512_maddubs_epi16(ones8, values), ones16)); \
+    }
+
+    KERNELS_MATRIX(int8_t, __m512i, zero, KERNELS_EXPAND8AVX512, KERNELS_DOT8AVX512,
+        kernels_reduceAvx512)
+
+    #undef KERNELS_EXPAND8AVX512
+    #undef KERNELS_DOT8AVX512
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void kernels_similarityMatrix16Avx512(const int16_t * matrix, size_t nLabels,
+    const uint64_t * query, size_t nChunks, int64_t * similarities) {
+
+    __m512i ones16 = _mm512_set1_epi16(1);
+    __m512i zero = _mm512_setzero_si512();
+    __mmask32 clearLow, clearHigh;
+
+    #define KERNELS_EXPAND16AVX512(bits) { \
+        clearLow = (__mmask32)~(bits); \
+        clearHigh = (__mmask32)(~(bits) >> 32); \
+    }
+    #define KERNELS_DOT16AVX512(acc, row) { \
+        __m512i low = _mm512_load_si512(row); \
+        __m512i high = _mm512_load_si512((row) + 32); \
+        low = _mm512_mask_sub_epi16(low, clearLow, zero, low); \
+        high = _mm512_mask_sub_epi16(high, clearHigh, zero, high); \
+        acc = _mm512_add_epi32(acc, _mm512_add_epi32( \
+            _mm512_madd_epi16(low, ones16), _mm512_madd_epi16(high, ones16))); \
+    }
+
+    KERNELS_MATRIX(int16_t, __m512i, zero, KERNELS_EXPAND16AVX512, KERNELS_DOT16AVX512,
+        kernels_reduceAvx512)
+
+    #undef KERNELS_EXPAND16AVX512
+    #undef KERNELS_DOT16AVX512
+}
+
+// hamming kernels count the differing bits between two qword arrays
+
+static uint64_t kernels_hammingScalar(const uint64_t * a, const uint64_t * b,
+    size_t nQwords) {
+
+    uint64_t count = 0;
+
+    size_t i; for (i = 0; i < nQwords; i++) {
+        uint64_t x = a[i] ^ b[i];
+        x = x - ((x >> 1) & 0x5555555555555555ULL);
+        x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+        x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+        count += (x * 0x0101010101010101ULL) >> 56;
+    }
+
+    return count;
+}
+
+__attribute__((target("sse4.2,popcnt")))
+static uint64_t kernels_hammingSse42(const uint64_t * a, const uint64_t * b,
+    size_t nQwords) {
+
+    uint64_t count = 0;
+
+    size_t i; for (i = 0; i < nQwords; i++) {
+        count += __builtin_popcountll(a[i] ^ b[i]);
+    }
+
+    return count;
+}
+
+// nibble lookup popcount with byte sums folded by psadbw
+__attribute__((target("avx2,popcnt")))
+static uint64_t kernels_hammingAvx2(const uint64_t * a, const uint64_t * b,
+    size_t nQwords) {
+
+    __m256i lookup = _mm256_setr_epi8(
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    __m256i lowNibbles = _mm256_set1_epi8(0x0F);
+    __m256i acc = _mm256_setzero_si256();
+
+    size_t i; for (i = 0; i + 4 <= nQwords; i += 4) {
+        __m256i x = _mm256_xor_si256(
+            _mm256_loadu_si256((const __m256i *)(a + i)),
+            _mm256_loadu_si256((const __m256i *)(b + i)));
+
+        __m256i counts = _mm256_add_epi8(
+            _mm256_shuffle_epi8(lookup, _mm256_and_si256(x, lowNibbles)),
+            _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(x, 4), lowNibbles)));
+
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(counts, _mm256_setzero_si256()));
+    }
+
+    __m128i half = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    uint64_t count = _mm_cvtsi128_si64(half) + _mm_extract_epi64(half, 1);
+
+    for (; i < nQwords; i++) {
+        count += __builtin_popcountll(a[i] ^ b[i]);
+    }
+
+    return count;
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static uint64_t kernels_hammingAvx512(const uint64_t * a, const uint64_t * b,
+    size_t nQwords) {
+
+    __m512i acc = _mm512_setzero_si512();
+
+    size_t i; for (i = 0; i < nQwords; i += 8) {
+        size_t remaining = nQwords - i;
+        __mmask8 mask = remaining >= 8 ? 0xFF : (__mmask8)((1u << remaining) - 1);
+
+        __m512i x = _mm512_xor_si512(
+            _mm512_maskz_loadu_epi64(mask, a + i),
+            _mm512_maskz_loadu_epi64(mask, b + i));
+        acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(x));
+    }
+
+    return (uint64_t)_mm512_reduce_add_epi64(acc);
+}
+
+enum {
+    KERNELS_SCALAR,
+    KERNELS_SSE42,
+    KERNELS_AVX2,
+    KERNELS_AVX512,
+    KERNELS_AVX512_VPOPCNTDQ,
+    KERNELS_N_VARIANTS
+};
+
+// ordered from least to most capable; the VPOPCNTDQ entry only swaps in a
+// faster hamming kernel
+static const Kernels_Dispatch kernels_variants[KERNELS_N_VARIANTS] = {
+    { "scalar", kernels_encodeScalar, kernels_encodeBatchScalar,
+        kernels_trainScalar, kernels_trainPairScalar,
+        kernels_train16Scalar, kernels_trainPair16Scalar,
+        kernels_similarityScalar, kernels_hammingScalar,
+        kernels_similarityMatrix8Scalar, kernels_similarityMatrix16Scalar },
+    { "sse4.2", kernels_encodeSse42, kernels_encodeBatchSse42,
+        kernels_trainSse42, kernels_trainPairSse42,
+        kernels_train16Sse42, kernels_trainPair16Sse42,
+        kernels_similaritySse42, kernels_hammingSse42,
+        kernels_similarityMatrix8Sse42, kernels_similarityMatrix16Sse42 },
+    { "avx2", kernels_encodeAvx2, kernels_encodeBatchAvx2,
+        kernels_trainAvx2, kernels_trainPairAvx2,
+        kernels_train16Avx2, kernels_trainPair16Avx2,
+        kernels_similarityAvx2, kernels_hammingAvx2,
+        kernels_similarityMatrix8Avx2, kernels_similarityMatrix16Avx2 },
+    { "avx512bw", kernels_encodeAvx512, kernels_encodeBatchAvx512,
+        kernels_trainAvx512, kernels_trainPairAvx512,
+        kernels_train16Avx512, kernels_trainPair16Avx512,
+        kernels_similarityAvx512, kernels_hammingAvx2,
+        kernels_similarityMatrix8Avx512, kernels_similarityMatrix16Avx512 },
+    { "avx512vpopcnt", kernels_encodeAvx512, kernels_encodeBatchAvx512,
+        kernels_trainAvx512, kernels_trainPairAvx512,
+        kernels_train16Avx512, kernels_trainPair16Avx512,
+        kernels_similarityAvx512, kernels_hammingAvx512,
+        kernels_similarityMatrix8Avx512, kernels_similarityMatrix16Avx512 }
+};
+
+static bool kernels_supported(int variant) {
+    __builtin_cpu_init();
+
+    bool sse42 = __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt");
+    bool avx2 = sse42 && __builtin_cpu_supports("avx2");
+    bool avx512 = avx2 && __builtin_cpu_supports("avx512f")
+        && __builtin_cpu_supports("avx512bw");
+
+    switch (variant) {
+        case KERNELS_SCALAR: return true;
+        case KERNELS_SSE42: return sse42;
+        case KERNELS_AVX2: return avx2;
+        case KERNELS_AVX512: return avx512;
+        case KERNELS_AVX512_VPOPCNTDQ:
+            return avx512 && __builtin_cpu_supports("avx512vpopcntdq");
+        default: return false;
+    }
+}
+
+const Kernels_Dispatch * kernels_find(const char * name) {
+    // plain "avx512" stands for the best AVX-512 variant the CPU has
+    bool anyAvx512 = strcmp(name, "avx512") == 0;
+
+    int variant; for (variant = KERNELS_N_VARIANTS - 1; variant >= 0; variant--) {
+        const char * variantName = kernels_variants[variant].name;
+        bool named = anyAvx512 ? strncmp(variantName, name, strlen(name)) == 0
+            : strcmp(variantName, name) == 0;
+
+        if (named && kernels_supported(variant)) {
+
+            return &kernels_variants[variant];
+        }
+    }
+
+    return NULL;
+}
+
+const Kernels_Dispatch * kernels_select(void) {
+    int best = KERNELS_N_VARIANTS - 1;
+    while (!kernels_supported(best)) {
+        best--;
+    }
+
+    const char * forced = getenv(KERNELS_ENV_VAR);
+    if (forced != NULL && forced[0] != '\0' && strcmp(forced, "auto") != 0) {
+        const Kernels_Dispatch * kernels = kernels_find(forced);
+        if (kernels != NULL) {
+            return kernels;
+        }
+
+        fprintf(stderr, "%s=%s is unknown or unsupported on this CPU, using %s\n",
+            KERNELS_ENV_VAR, forced, kernels_variants[best].name);
+    }
+
+    return &kernels_variants[best];
+}
+
+static const Kernels_Dispatch * kernels_active = NULL;
+
+void kernels_use(const Kernels_Dispatch * kernels) {
+    kernels_active = kernels;
+}
+
+const Kernels_Dispatch * kernels_current(void) {
+    if (kernels_active == NULL) {
+        kernels_active = kernels_select();
+    }
+
+    return kernels_active;
+}
@@ -3,71 +3,288 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include <math.h>
 #include <time.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "model.h"
 #include "dataset.h"
 #include "hypervector.h"
-
-struct TrainJob {
+#include "kernels.h"
+#include "pool.h"
+
+// Model files of procedural models start with this marker in place of the
+// downsize field, followed by the seed; their basis and level vectors are
+// regenerated on load instead of being written out.
+#define MODEL_PROCEDURAL_MAGIC ((size_t)0x3144454553434448) // "HDCSEED1"
+
+// Optional trailer after the class vectors: this marker, the classify engine
+// request and the bit-packed sign vectors. Older readers stop before it.
+#define MODEL_SIGNS_MAGIC ((size_t)0x314e474953434448) // "HDCSIGN1"
+
+// Samples are handed to pool workers in chunks of this many, a few encode
+// batches each; train sets are reduced in chunks of MODEL_REDUCE_CHUNK
+// dimensions, a multiple of a cache line of int32s.
+#define MODEL_SAMPLE_CHUNK (4 * HYPERVECTOR_BATCH_SIZE)
+#define MODEL_REDUCE_CHUNK (4096)
+
+// One training pass on the thread pool. Workers accumulate into their own
+// private train set, localSets[worker], summed into trainSet after the pass,
+// or, when those would not fit MODEL_TRAIN_DELTA_BUDGET, update trainSet's
+// rows directly under labelLocks through localSets[worker], a copy of
+// trainSet that keeps the worker's sample count.
+struct TrainPass {
     Hypervector_Basis * basis;
     Hypervector_TrainSet * trainSet;
     Hypervector_ClassifySet * classifySet;
     uint8_t * labels;
     uint8_t ** features;
     bool retrain;
-    pthread_mutex_t * mutex;
-    size_t startFeature;
-    size_t endFeature;
+    size_t first;           // sample the pass starts at
+    // encoded samples to read, or to fill when encode is set; NULL to encode
+    // into the worker scratches
+    Model_EncodeCache * cache;
+    bool encode;
+    bool local;
+    size_t nWorkers;
+    Hypervector_TrainSet * localSets;
+    pthread_mutex_t * labelLocks;
+    Hypervector_Scratch * scratches;
     int * nWrong;
 };
 
-struct TestJob {
+struct ScorePass {
+    Model * model;
+    uint8_t * features;
+    float * scores;
+    int k;
+    int * topLabels;
+    Hypervector_Scratch * scratches;
+};
+
+// Requantizes the dirty labels of a classify set, a label per task.
+struct RefreshPass {
+    Hypervector_ClassifySet * classifySet;
+    Hypervector_TrainSet * trainSet;
+    int quantize;
+    size_t * labels;
+    bool * relayout;
+};
+
+struct TestPass {
     Hypervector_ClassifySet * classifySet;
     Hypervector_Basis * basis;
     uint8_t ** features;
     uint8_t * labels;
-    int localNCorrect;
-    size_t featureStart;
-    size_t featureEnd;
+    Hypervector_Scratch * scratches;
+    int * nCorrect;
 };
 
-void * parallelTrainFunc(void * arg) {
-    Hypervector_Basis * basis = ((struct TrainJob*)arg) -> basis;
-    Hypervector_TrainSet * trainSet = ((struct TrainJob*)arg) -> trainSet;
-    Hypervector_ClassifySet * classifySet = ((struct TrainJob*)arg) -> classifySet;
-    uint8_t * labels = ((struct TrainJob*)arg) -> labels;
-    uint8_t ** features = ((struct TrainJob*)arg) -> features;
-    bool retrain = ((struct TrainJob*)arg) -> retrain;
-    pthread_mutex_t * mutex = ((struct TrainJob*)arg) -> mutex;
-    size_t startFeature = ((struct TrainJob*)arg) -> startFeature;
-    size_t endFeature = ((struct TrainJob*)arg) -> endFeature;
-    uint32_t * nWrong = ((struct TrainJob*)arg) -> nWrong;
-
-    size_t i; for (i = startFeature; i < endFeature; i++) {
-        Hypervector_Hypervector vector = hypervector_encode(features[i], basis);
-
-        if (retrain) {
-            size_t classification = hypervector_classify(classifySet, &vector);
-            if (classification != labels[i]) {
-                pthread_mutex_lock(mutex);
-                hypervector_train(trainSet, &vector, labels[i]);
-                hypervector_untrain(trainSet, &vector, classification);
-                pthread_mutex_unlock(mutex);
-                (*nWrong)++;
+// the size and modification time of a file, which change when it is
+// rewritten; -1 for both if it cannot be read
+static void fileStamp(const char * fn, int64_t * size, int64_t * time) {
+    struct stat info;
+    if (stat(fn, &info) != 0) {
+        *size = -1;
+        *time = -1;
+        return;
+    }
+
+    *size = (int64_t)info.st_size;
+    *time = (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+}
+
+static Hypervector_Scratch * newScratches(size_t nWorkers, size_t length) {
+    Hypervector_Scratch * scratches = (Hypervector_Scratch*)malloc(
+        sizeof(Hypervector_Scratch) * nWorkers);
+
+    size_t i; for (i = 0; i < nWorkers; i++) {
+        hypervector_newScratch(&scratches[i], length);
+    }
+
+    return scratches;
+}
+
+// Returns a cache for nItems vectors of length bits, on the heap if it fits
+// budget, else mapped from an unlinked file in TMPDIR, or NULL if neither
+// works out.
+static Model_EncodeCache * newEncodeCache(size_t nItems, size_t length, size_t budget) {
+    Model_EncodeCache * cache = (Model_EncodeCache*)malloc(sizeof(Model_EncodeCache));
+    cache -> nItems = nItems;
+    cache -> stride = (length / 64 + 1) * sizeof(uint64_t);
+    cache -> mappedBytes = 0;
+    cache -> nEncoded = 0;
+    cache -> featuresFn = NULL;
+    cache -> featuresSize = -1;
+    cache -> featuresTime = -1;
+
+    size_t bytes = nItems * cache -> stride;
+    if (bytes <= budget) {
+        cache -> vectors = (uint8_t*)malloc(bytes);
+        if (cache -> vectors != NULL) {
+            return cache;
+        }
+    }
+
+    const char * dir = getenv("TMPDIR");
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/hdc-encodeXXXXXX", dir != NULL ? dir : "/tmp");
+
+    int fd = mkstemp(path);
+    if (fd >= 0) {
+        unlink(path);
+        if (ftruncate(fd, (off_t)bytes) == 0) {
+            void * mapped = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (mapped != MAP_FAILED) {
+                cache -> vectors = (uint8_t*)mapped;
+                cache -> mappedBytes = bytes;
             }
         }
-        else {
-            pthread_mutex_lock(mutex);
-            hypervector_train(trainSet, &vector, labels[i]);
-            pthread_mutex_unlock(mutex);
+        close(fd);
+    }
+
+    if (cache -> mappedBytes == 0) {
+        free(cache);
+        return NULL;
+    }
+
+    return cache;
+}
+
+static void deleteEncodeCache(Model_EncodeCache * cache) {
+    if (cache == NULL) {
+        return;
+    }
+
+    if (cache -> mappedBytes != 0) {
+        munmap(cache -> vectors, cache -> mappedBytes);
+    }
+    else {
+        free(cache -> vectors);
+    }
+    free(cache -> featuresFn);
+    free(cache);
+}
+
+static void deleteScratches(Hypervector_Scratch * scratches, size_t nWorkers) {
+    size_t i; for (i = 0; i < nWorkers; i++) {
+        hypervector_deleteScratch(&scratches[i]);
+    }
+    free(scratches);
+}
+
+static void trainLabel(struct TrainPass * pass, size_t worker,
+    Hypervector_Hypervector * vector, size_t label, bool untrain) {
+
+    Hypervector_TrainSet * trainSet = &pass -> localSets[worker];
+
+    if (!pass -> local) {
+        pthread_mutex_lock(&pass -> labelLocks[label]);
+    }
+
+    if (untrain) {
+        hypervector_untrain(trainSet, vector, label);
+    }
+    else {
+        hypervector_train(trainSet, vector, label);
+    }
+
+    if (!pass -> local) {
+        pthread_mutex_unlock(&pass -> labelLocks[label]);
+    }
+}
+
+// moves vector from wrongLabel's row to label's, taking both label locks in
+// label order when the pass shares one train set
+static void retrainLabels(struct TrainPass * pass, size_t worker,
+    Hypervector_Hypervector * vector, size_t label, size_t wrongLabel) {
+
+    Hypervector_TrainSet * trainSet = &pass -> localSets[worker];
+
+    if (pass -> local) {
+        hypervector_retrain(trainSet, vector, label, wrongLabel);
+        return;
+    }
+
+    size_t first = label < wrongLabel ? label : wrongLabel;
+    size_t second = label < wrongLabel ? wrongLabel : label;
+    pthread_mutex_lock(&pass -> labelLocks[first]);
+    pthread_mutex_lock(&pass -> labelLocks[second]);
+
+    hypervector_retrain(trainSet, vector, label, wrongLabel);
+
+    pthread_mutex_unlock(&pass -> labelLocks[second]);
+    pthread_mutex_unlock(&pass -> labelLocks[first]);
+}
+
+static void trainChunk(void * arg, size_t worker, size_t begin, size_t end) {
+    struct TrainPass * pass = (struct TrainPass*)arg;
+
+    Hypervector_Scratch * scratch = &pass -> scratches[worker];
+    Model_EncodeCache * cache = pass -> cache;
+    uint8_t * labels = pass -> labels;
+
+    Hypervector_Hypervector cached[HYPERVECTOR_BATCH_SIZE];
+    Hypervector_Hypervector * vectors = cache != NULL ? cached : scratch -> batch;
+
+    begin += pass -> first;
+    end += pass -> first;
+
+    size_t batchStart; for (batchStart = begin; batchStart < end;
+        batchStart += HYPERVECTOR_BATCH_SIZE) {
+
+        size_t batchSize = end - batchStart;
+        if (batchSize > HYPERVECTOR_BATCH_SIZE) {
+            batchSize = HYPERVECTOR_BATCH_SIZE;
+        }
+
+        size_t j;
+        if (cache != NULL) {
+            for (j = 0; j < batchSize; j++) {
+                cached[j].length = pass -> trainSet -> length;
+                cached[j].elems = cache -> vectors + (batchStart + j) * cache -> stride;
+            }
+        }
+
+        if (pass -> encode) {
+            hypervector_encodeBatch(scratch, vectors, &pass -> features[batchStart],
+                batchSize, pass -> basis);
         }
 
-        hypervector_deleteVector(&vector);
+        for (j = 0; j < batchSize; j++) {
+            size_t i = batchStart + j;
+            Hypervector_Hypervector * vector = &vectors[j];
+
+            if (pass -> retrain) {
+                size_t classification = hypervector_classify(pass -> classifySet, vector);
+                if (classification != labels[i]) {
+                    // an untrained set has no best label to push away from
+                    if (classification < pass -> trainSet -> nLabels) {
+                        retrainLabels(pass, worker, vector, labels[i], classification);
+                    }
+                    else {
+                        trainLabel(pass, worker, vector, labels[i], false);
+                    }
+                    pass -> nWrong[worker]++;
+                }
+            }
+            else {
+                trainLabel(pass, worker, vector, labels[i], false);
+            }
+        }
     }
+}
 
-    return NULL;
+static void reduceChunk(void * arg, size_t worker, size_t begin, size_t end) {
+    struct TrainPass * pass = (struct TrainPass*)arg;
+    (void)worker;
+
+    size_t i; for (i = 0; i < pass -> nWorkers; i++) {
+        hypervector_addTrainSetRange(pass -> trainSet, &pass -> localSets[i], begin, end);
+    }
 }
 
 int parallelTrain(
@@ -77,104 +294,216 @@ int parallelTrain(
     uint8_t * labels,
     uint8_t ** features,
     bool retrain,
-    size_t nItems
+    size_t begin,
+    size_t end,
+    Model_EncodeCache * cache
 ) {
-    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    size_t nWorkers = pool_nThreads();
+    size_t nLabels = trainSet -> nLabels;
+    size_t length = trainSet -> length;
+
+    struct TrainPass pass;
+    pass.basis = basis;
+    pass.trainSet = trainSet;
+    pass.classifySet = classifySet;
+    pass.labels = labels;
+    pass.features = features;
+    pass.retrain = retrain;
+    pass.first = begin;
+    pass.cache = cache != NULL && cache -> nItems >= end ? cache : NULL;
+    pass.encode = pass.cache == NULL || end > pass.cache -> nEncoded;
+    size_t elementSize = trainSet -> compact ? sizeof(int16_t) : sizeof(int32_t);
+    pass.local = nLabels * length * elementSize * nWorkers <= MODEL_TRAIN_DELTA_BUDGET;
+    pass.nWorkers = nWorkers;
+    pass.labelLocks = NULL;
+    pass.scratches = newScratches(nWorkers, length);
+    pass.nWrong = (int*)calloc(nWorkers, sizeof(int));
+
+    size_t i;
+    pass.localSets = (Hypervector_TrainSet*)malloc(sizeof(Hypervector_TrainSet) * nWorkers);
+    if (pass.local) {
+        for (i = 0; i < nWorkers; i++) {
+            hypervector_newLocalTrainSet(&pass.localSets[i], length, nLabels,
+                trainSet -> compact);
+        }
+    }
+    else {
+        for (i = 0; i < nWorkers; i++) {
+            pass.localSets[i] = *trainSet;
+            pass.localSets[i].nTrainSamples = 0;
+        }
+        pass.labelLocks = (pthread_mutex_t*)malloc(sizeof(pthread_mutex_t) * nLabels);
+        for (i = 0; i < nLabels; i++) {
+            pthread_mutex_init(&pass.labelLocks[i], NULL);
+        }
+    }
+
+    pool_run(end - begin, MODEL_SAMPLE_CHUNK, trainChunk, &pass);
+    if (pass.cache != NULL && begin <= pass.cache -> nEncoded && end > pass.cache -> nEncoded) {
+        pass.cache -> nEncoded = end;
+    }
 
-    struct TrainJob trainJobs[N_THREADS];
-    pthread_t threads[N_THREADS];
     int nWrong = 0;
+    for (i = 0; i < nWorkers; i++) {
+        nWrong += pass.nWrong[i];
+        trainSet -> nTrainSamples += pass.localSets[i].nTrainSamples;
+    }
 
-    int i; for (i = 0; i < N_THREADS; i++) {
-        trainJobs[i].basis = basis;
-        trainJobs[i].trainSet = trainSet;
-        trainJobs[i].classifySet = classifySet;
-        trainJobs[i].labels = labels;
-        trainJobs[i].features = features;
-        trainJobs[i].retrain = retrain;
-        trainJobs[i].mutex = &mutex;
-        trainJobs[i].nWrong = &nWrong;
+    if (pass.local) {
+        for (i = 0; i < nWorkers; i++) {
+            hypervector_reserveTrainSet(trainSet, &pass.localSets[i]);
+        }
+        pool_run(length, MODEL_REDUCE_CHUNK, reduceChunk, &pass);
 
-        trainJobs[i].startFeature = nItems * i / N_THREADS;
-        if (i == N_THREADS - 1) {
-            trainJobs[i].endFeature = nItems;
+        for (i = 0; i < nWorkers; i++) {
+            size_t label; for (label = 0; label < nLabels; label++) {
+                trainSet -> dirty[label] |= pass.localSets[i].dirty[label];
+            }
+            hypervector_deleteTrainSet(&pass.localSets[i]);
         }
-        else {
-            trainJobs[i].endFeature = nItems * (i + 1) / N_THREADS;
+    }
+    else {
+        for (i = 0; i < nLabels; i++) {
+            pthread_mutex_destroy(&pass.labelLocks[i]);
+        }
+        free(pass.labelLocks);
+    }
+
+    deleteScratches(pass.scratches, nWorkers);
+    free(pass.localSets);
+    free(pass.nWrong);
+
+    return (int)(end - begin) - nWrong;
+}
+
+static void refreshChunk(void * arg, size_t worker, size_t begin, size_t end) {
+    struct RefreshPass * pass = (struct RefreshPass *)arg;
+
+    size_t i; for (i = begin; i < end; i++) {
+        if (!hypervector_refreshLabel(pass -> classifySet, pass -> trainSet,
+            pass -> quantize, pass -> labels[i])) {
+
+            pass -> relayout[worker] = true;
+        }
+    }
+}
+
+// brings a classify set built from trainSet up to date with it, touching
+// only the labels trained since
+static void refreshClassifySet(Hypervector_ClassifySet * classifySet,
+    Hypervector_TrainSet * trainSet, int quantize) {
+
+    size_t nWorkers = pool_nThreads();
+
+    struct RefreshPass pass;
+    pass.classifySet = classifySet;
+    pass.trainSet = trainSet;
+    pass.quantize = quantize;
+    pass.labels = (size_t*)malloc(sizeof(size_t) * trainSet -> nLabels);
+    pass.relayout = (bool*)calloc(nWorkers, sizeof(bool));
+
+    size_t nDirty = 0;
+    size_t i; for (i = 0; i < trainSet -> nLabels; i++) {
+        if (trainSet -> dirty[i]) {
+            pass.labels[nDirty++] = i;
         }
     }
 
-    for (i = 0; i < N_THREADS; i++) {
-        pthread_create(&threads[i], NULL, parallelTrainFunc, &trainJobs[i]);
+    pool_run(nDirty, 1, refreshChunk, &pass);
+
+    bool relayout = false;
+    for (i = 0; i < nWorkers; i++) {
+        relayout = relayout || pass.relayout[i];
     }
+    hypervector_finishRefresh(classifySet, trainSet, relayout);
+
+    free(pass.labels);
+    free(pass.relayout);
+}
 
-    for (i = 0; i < N_THREADS; i++) {
-        pthread_join(threads[i], NULL);
+// One error-driven pass over samples [0, nItems), in mini-batches of
+// batchSize samples (0 for one batch) classified against the classify set as
+// it stood before the batch; the set is refreshed after each. Each batch's
+// corrections are integer sums, so the result does not depend on the number
+// of threads or on how they interleave.
+static int retrainPass(Hypervector_Basis * basis, Hypervector_TrainSet * trainSet,
+    Hypervector_ClassifySet * classifySet, uint8_t * labels, uint8_t ** features,
+    size_t nItems, Model_EncodeCache * cache, size_t batchSize, int quantization) {
+
+    if (batchSize == 0 || batchSize > nItems) {
+        batchSize = nItems;
     }
 
-    return (nItems - nWrong);
+    int nCorrect = 0;
+    size_t begin = 0;
+    do {
+        size_t end = begin + batchSize < nItems ? begin + batchSize : nItems;
+        nCorrect += parallelTrain(basis, trainSet, classifySet, labels, features,
+            true, begin, end, cache);
+        refreshClassifySet(classifySet, trainSet, quantization);
+        begin = end;
+    } while (begin < nItems);
+
+    return nCorrect;
 }
 
+// trains a new classifySet of nLabels labels from scratch, leaving the
+// accumulators it was built from in trainSet
 void trainAndRetrain(Hypervector_Basis * basis,
-    Hypervector_ClassifySet * classifySet, uint8_t ** features,
-    uint8_t * labels, size_t nItems, size_t featureSize,
-    size_t numTrain, int numRetrain, int quantization) {
+    Hypervector_ClassifySet * classifySet, Hypervector_TrainSet * trainSet,
+    size_t nLabels, uint8_t ** features, uint8_t * labels, size_t nItems,
+    size_t numTrain, int numRetrain, int quantization, size_t cacheBudget,
+    size_t retrainBatch, bool compact) {
 
-    size_t hypervectorSize = basis -> basisVectors[0].length;
+    size_t hypervectorSize = basis -> levelVectors[0].length;
 
-    Hypervector_TrainSet trainSet;
-    hypervector_newTrainSet(&trainSet, hypervectorSize, classifySet -> nLabels);
-    hypervector_deleteClassifySet(classifySet);
+    hypervector_newTrainSet(trainSet, hypervectorSize, nLabels, compact);
 
     if (numTrain > nItems) {
         numTrain = nItems;
     }
 
-    size_t i;
+    // the first pass encodes into the cache and retrain passes read it back;
+    // without a cache every pass encodes
+    Model_EncodeCache * cache = numRetrain > 0
+        ? newEncodeCache(numTrain, hypervectorSize, cacheBudget) : NULL;
 
     // Training
     //printf("Training... "); fflush(stdout);
-    parallelTrain(basis, &trainSet, classifySet, labels, features, false, numTrain);
+    parallelTrain(basis, trainSet, classifySet, labels, features, false, 0, numTrain, cache);
     //printf("done\n");
-    hypervector_newClassifySet(classifySet, &trainSet, quantization);
+    hypervector_newClassifySet(classifySet, trainSet, quantization);
 
     // Retraining
     int r; for (r = 0; r < numRetrain; r++) {
         //printf("Retraining %d/%d... ", r+1, numRetrain); fflush(stdout);
-        int nCorrect = parallelTrain(basis, &trainSet, classifySet, labels,
-                                            features, true, numTrain);
-        //printf("done (last iteration %d/%d correct)\n", (int)nCorrect, (int)numTrain);
-
-
-        hypervector_deleteClassifySet(classifySet);
-        hypervector_newClassifySet(classifySet, &trainSet, quantization);
+        retrainPass(basis, trainSet, classifySet, labels, features, numTrain, cache,
+            retrainBatch, quantization);
+        //printf("done\n");
     }
 
-    hypervector_deleteTrainSet(&trainSet);
+    deleteEncodeCache(cache);
 }
 
-void * parallelTestFunc(void * arg) {
-    struct TestJob * testJob = (struct TestJob *)arg;
+static void testChunk(void * arg, size_t worker, size_t begin, size_t end) {
+    struct TestPass * pass = (struct TestPass *)arg;
 
-    Hypervector_ClassifySet * classifySet = testJob -> classifySet;
-    Hypervector_Basis * basis = testJob -> basis;
-    uint8_t ** features = testJob -> features;
-    uint8_t * labels = testJob -> labels;
-    size_t featureStart = testJob -> featureStart;
-    size_t featureEnd = testJob -> featureEnd;
+    size_t i; for (i = begin; i < end; i += HYPERVECTOR_BATCH_SIZE) {
+        size_t batchSize = end - i;
+        if (batchSize > HYPERVECTOR_BATCH_SIZE) {
+            batchSize = HYPERVECTOR_BATCH_SIZE;
+        }
 
-    size_t i; for (i = featureStart; i < featureEnd; i++) {
-        Hypervector_Hypervector vector = hypervector_encode(features[i], basis);
+        size_t batchLabels[HYPERVECTOR_BATCH_SIZE];
+        hypervector_classifyBatch(&pass -> scratches[worker], pass -> classifySet,
+            pass -> basis, &pass -> features[i], batchSize, batchLabels);
 
-        size_t label = hypervector_classify(classifySet, &vector);
-        if ((int)labels[i] == (int)label) {
-            testJob -> localNCorrect++;
+        size_t j; for (j = 0; j < batchSize; j++) {
+            if ((int)pass -> labels[i + j] == (int)batchLabels[j]) {
+                pass -> nCorrect[worker]++;
+            }
         }
-
-        hypervector_deleteVector(&vector);
     }
-
-    return NULL;
 }
 
 int test(Hypervector_ClassifySet * classifySet, Hypervector_Basis * basis,
@@ -185,38 +514,128 @@ int test(Hypervector_ClassifySet * classifySet, Hypervector_Basis * basis,
         nTest = nItems;
     }
 
-    struct TestJob testJobs[N_THREADS];
-    pthread_t threads[N_THREADS];
+    size_t nWorkers = pool_nThreads();
 
-    //printf("Testing..."); fflush(stdout);
+    struct TestPass pass;
+    pass.classifySet = classifySet;
+    pass.basis = basis;
+    pass.features = features;
+    pass.labels = labels;
+    pass.scratches = newScratches(nWorkers, classifySet -> length);
+    pass.nCorrect = (int*)calloc(nWorkers, sizeof(int));
 
-    int i;
-    for (i = 0; i < N_THREADS; i++) {
-        testJobs[i].classifySet = classifySet;
-        testJobs[i].basis = basis;
-        testJobs[i].features = features;
-        testJobs[i].labels = labels;
-        testJobs[i].featureStart = nTest * i / N_THREADS;
-        testJobs[i].featureEnd = nTest * (i + 1) / N_THREADS;
-        testJobs[i].localNCorrect = 0;
+    pool_run(nTest, MODEL_SAMPLE_CHUNK, testChunk, &pass);
+
+    int nCorrect = 0;
+    size_t i; for (i = 0; i < nWorkers; i++) {
+        nCorrect += pass.nCorrect[i];
+    }
+
+    deleteScratches(pass.scratches, nWorkers);
+    free(pass.nCorrect);
+
+    return nCorrect;
+}
+
+// applies the model's engine and index settings to classifySet, which is the
+// served set or the one about to be published
+static void applySettingsTo(Model * model, Hypervector_ClassifySet * classifySet) {
+    int engine = model -> classifyEngine;
+    bool planes = classifySet -> planeVectors != NULL;
+    if (engine == MODEL_CLASSIFY_AUTO) {
+        if (model -> classVecQuant == 1) {
+            engine = HYPERVECTOR_CLASSIFY_BINARY;
+        }
+        else if (model -> classVecQuant != 0 && planes) {
+            engine = HYPERVECTOR_CLASSIFY_BITPLANE;
+        }
+        else {
+            engine = HYPERVECTOR_CLASSIFY_INTEGER;
+        }
+    }
+    else if (engine == HYPERVECTOR_CLASSIFY_BITPLANE && !planes) {
+        engine = HYPERVECTOR_CLASSIFY_INTEGER;
+    }
+
+    classifySet -> engine = engine;
+    hypervector_newClassIndex(classifySet, model -> indexBits, model -> indexCandidates);
+}
+
+static void applyClassifySettings(Model * model) {
+    applySettingsTo(model, &model -> classifySet);
+}
+
+static double monotonicSeconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+}
+
+static void initOnline(Model * model) {
+    model -> stagingSetValid = false;
+    model -> stagingStale = NULL;
+    model -> publishSamples = 0;
+    model -> publishMilliseconds = 0;
+    model -> samplesSincePublish = 0;
+    model -> lastPublish = monotonicSeconds();
+
+    // a steady stream of classify callers must not hold off a publish
+    pthread_rwlockattr_t attributes;
+    pthread_rwlockattr_init(&attributes);
+    pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&model -> servingLock, &attributes);
+    pthread_rwlockattr_destroy(&attributes);
+}
+
+// forgets the staging set after the served set was changed some other way;
+// the next publish builds it again
+static void dropStagingSet(Model * model) {
+    if (model -> stagingSetValid) {
+        hypervector_deleteClassifySet(&model -> stagingSet);
+        model -> stagingSetValid = false;
     }
+}
+
+// Brings the staging set up to date with tmpTrainSet: refreshes the labels
+// it lags by, stagingStale, and those trained since tmpTrainSet was last
+// applied, or builds it if there is none.
+static void stageTrainSet(Model * model) {
+    Hypervector_TrainSet * trainSet = &model -> tmpTrainSet;
+    int quantization = (int)model -> classVecQuant;
 
-    for (i = 0; i < N_THREADS; i++) {
-        pthread_create(&threads[i], NULL, parallelTestFunc, &testJobs[i]);
+    if (!model -> stagingSetValid) {
+        hypervector_newClassifySet(&model -> stagingSet, trainSet, quantization);
+        model -> stagingSetValid = true;
+        return;
     }
 
-    int nCorrect = 0;
-    for (i = 0; i < N_THREADS; i++) {
-        pthread_join(threads[i], NULL);
-        nCorrect += testJobs[i].localNCorrect;
+    size_t i; for (i = 0; i < trainSet -> nLabels; i++) {
+        trainSet -> dirty[i] = trainSet -> dirty[i] || model -> stagingStale[i];
     }
+    refreshClassifySet(&model -> stagingSet, trainSet, quantization);
+}
 
-    //printf("done\nNumber Correct: %d\n", nCorrect);
-    return nCorrect;
+// Swaps the staging set in for the served one, which becomes the staging
+// set. Called under the write lock, which the settings setters also write
+// under.
+static void serveStagingSet(Model * model) {
+    applySettingsTo(model, &model -> stagingSet);
+
+    Hypervector_ClassifySet served = model -> classifySet;
+    model -> classifySet = model -> stagingSet;
+    model -> stagingSet = served;
 }
 
 void Model_save(Model * model, const char * modelFn) {
     FILE * fp = fopen(modelFn, "wb");
+    pthread_rwlock_rdlock(&model -> servingLock);
+
+    if (model -> basis.procedural) {
+        size_t magic = MODEL_PROCEDURAL_MAGIC;
+        fwrite(&magic, sizeof(size_t), 1, fp);
+        fwrite(&model -> basis.seed, sizeof(uint64_t), 1, fp);
+    }
 
     fwrite(&model -> downsize, sizeof(size_t), 1, fp);
     fwrite(&model -> featureSize, sizeof(size_t), 1, fp);
@@ -232,17 +651,30 @@ void Model_save(Model * model, const char * modelFn) {
     size_t nLabels = model -> classifySet.nLabels;
 
     int i;
-    for (i = 0; i < model -> basis.nInputs; i++) {
-        fwrite(model -> basis.basisVectors[i].elems, 1, lengthBytes, fp);
-    }
-    for (i = 0; i < model -> basis.nLevels; i++) {
-        fwrite(model -> basis.levelVectors[i].elems, 1, lengthBytes, fp);
+    if (!model -> basis.procedural) {
+        for (i = 0; i < model -> basis.nInputs; i++) {
+            fwrite(model -> basis.basisVectors[i].elems, 1, lengthBytes, fp);
+        }
+        for (i = 0; i < model -> basis.nLevels; i++) {
+            fwrite(model -> basis.levelVectors[i].elems, 1, lengthBytes, fp);
+        }
     }
     for (i = 0; i < model -> classifySet.nLabels; i++) {
         fwrite(model -> classifySet.classVectors[i], sizeof(int32_t), length, fp);
         fwrite(&model -> classifySet.vectorLengths[i], sizeof(double), 1, fp);
     }
 
+    size_t signsMagic = MODEL_SIGNS_MAGIC;
+    int32_t engine = model -> classifyEngine;
+    size_t lengthQwords = length / 64 + 1;
+    fwrite(&signsMagic, sizeof(size_t), 1, fp);
+    fwrite(&engine, sizeof(int32_t), 1, fp);
+    for (i = 0; i < model -> classifySet.nLabels; i++) {
+        fwrite(model -> classifySet.signVectors + i * model -> classifySet.signStride,
+            sizeof(uint64_t), lengthQwords, fp);
+    }
+
+    pthread_rwlock_unlock(&model -> servingLock);
     fclose(fp);
 }
 
@@ -252,7 +684,21 @@ Model * Model_load(const char * modelFn) {
     Model * model = (Model*)malloc(sizeof(Model));
     size_t res;
 
-    res = fread(&model -> downsize, sizeof(size_t), 1, fp);
+    kernels_use(kernels_select());
+
+    size_t header;
+    uint64_t seed = 0;
+    res = fread(&header, sizeof(size_t), 1, fp);
+
+    bool procedural = header == MODEL_PROCEDURAL_MAGIC;
+    if (procedural) {
+        res = fread(&seed, sizeof(uint64_t), 1, fp);
+        res = fread(&model -> downsize, sizeof(size_t), 1, fp);
+    }
+    else {
+        model -> downsize = header;
+    }
+
     res = fread(&model -> featureSize, sizeof(size_t), 1, fp);
     res = fread(&model -> classVecQuant, sizeof(size_t), 1, fp);
 
@@ -265,23 +711,44 @@ Model * Model_load(const char * modelFn) {
     size_t lengthBytes = length / 8 + 1;
     size_t nLabels = model -> classifySet.nLabels;
 
-    model -> basis.basisVectors = (Hypervector_Hypervector*)malloc(
-        sizeof(Hypervector_Hypervector) * model -> basis.nInputs);
-    model -> basis.levelVectors = (Hypervector_Hypervector*)malloc(
-        sizeof(Hypervector_Hypervector) * model -> basis.nLevels);
+    if (procedural) {
+        if (!hypervector_newProceduralBasis(&model -> basis, length,
+            model -> basis.nInputs, model -> basis.nLevels, seed)) {
+
+            fclose(fp);
+            free(model);
+            return NULL;
+        }
+    }
+    else {
+        model -> basis.boundVectors = NULL;
+        model -> basis.boundStride = 0;
+        model -> basis.backgroundPlanes = NULL;
+        model -> basis.backgroundStride = 0;
+        model -> basis.nBackgroundPlanes = 0;
+        model -> basis.procedural = false;
+        model -> basis.seed = 0;
+        model -> basis.basisKey = 0;
+        model -> basis.basisVectors = (Hypervector_Hypervector*)malloc(
+            sizeof(Hypervector_Hypervector) * model -> basis.nInputs);
+        model -> basis.levelVectors = (Hypervector_Hypervector*)malloc(
+            sizeof(Hypervector_Hypervector) * model -> basis.nLevels);
+    }
     model -> classifySet.classVectors = (int32_t **)malloc(
         sizeof(int32_t *) * model -> classifySet.nLabels);
     model -> classifySet.vectorLengths = (double *)malloc(
         sizeof(double) * model -> classifySet.nLabels);
 
     int i;
-    for (i = 0; i < model -> basis.nInputs; i++) {
-        hypervector_newVector(&model -> basis.basisVectors[i], length);
-        res = fread(model -> basis.basisVectors[i].elems, 1, lengthBytes, fp);
-    }
-    for (i = 0; i < model -> basis.nLevels; i++) {
-        hypervector_newVector(&model -> basis.levelVectors[i], length);
-        res = fread(model -> basis.levelVectors[i].elems, 1, lengthBytes, fp);
+    if (!procedural) {
+        for (i = 0; i < model -> basis.nInputs; i++) {
+            hypervector_newVector(&model -> basis.basisVectors[i], length);
+            res = fread(model -> basis.basisVectors[i].elems, 1, lengthBytes, fp);
+        }
+        for (i = 0; i < model -> basis.nLevels; i++) {
+            hypervector_newVector(&model -> basis.levelVectors[i], length);
+            res = fread(model -> basis.levelVectors[i].elems, 1, lengthBytes, fp);
+        }
     }
     for (i = 0; i < model -> classifySet.nLabels; i++) {
         model -> classifySet.classVectors[i] = (int32_t*)malloc(
@@ -290,24 +757,137 @@ Model * Model_load(const char * modelFn) {
         res = fread(&model -> classifySet.vectorLengths[i], sizeof(double), 1, fp);
     }
 
+    // sign vectors are laid out (and zero padded) here, then overwritten
+    // from the trailer when the file has one
+    model -> classifySet.signVectors = NULL;
+    model -> classifySet.planeVectors = NULL;
+    model -> classifySet.planeBase = NULL;
+    model -> classifySet.planeL1 = NULL;
+    model -> classifySet.planeCounts = NULL;
+    model -> classifySet.classMatrix = NULL;
+    model -> classifySet.remainingNorms = NULL;
+    model -> classifySet.remainingEnergy = NULL;
+    model -> classifySet.indexSketches = NULL;
+    model -> classifySet.indexQwords = 0;
+    model -> classifySet.indexCandidates = 0;
+    hypervector_newSignVectors(&model -> classifySet);
+    model -> classifyEngine = MODEL_CLASSIFY_AUTO;
+    model -> indexBits = 0;
+    model -> indexCandidates = 0;
+
+    size_t signsMagic;
+    if (fread(&signsMagic, sizeof(size_t), 1, fp) == 1 && signsMagic == MODEL_SIGNS_MAGIC) {
+        int32_t engine;
+        size_t lengthQwords = length / 64 + 1;
+
+        res = fread(&engine, sizeof(int32_t), 1, fp);
+        model -> classifyEngine = engine;
+        for (i = 0; i < model -> classifySet.nLabels; i++) {
+            res = fread(model -> classifySet.signVectors + i * model -> classifySet.signStride,
+                sizeof(uint64_t), lengthQwords, fp);
+        }
+    }
+
+    applyClassifySettings(model);
+
     fclose(fp);
 
     model -> tmpTrainSetValid = false;
+    model -> tmpTrainSetApplied = false;
+    model -> trainedSetValid = false;
+    initOnline(model);
+    model -> encodeCache = NULL;
+    model -> encodeCacheBudget = MODEL_ENCODE_CACHE_BUDGET;
+    model -> retrainBatch = 0;
+    model -> compactTrain = false;
+
+    // a procedural basis exists to keep the footprint small, so it only
+    // gets a bound table on request
+    model -> boundTableBudget = procedural ? 0 : MODEL_BOUND_TABLE_BUDGET;
+    hypervector_newBoundTable(&model -> basis, model -> boundTableBudget);
+    hypervector_newBackground(&model -> basis);
 
     return model;
 }
 
 Model * Model_new(int hypervectorSize, int inputQuant, int classVectorQuant,
     int featureSize, int nLabels) {
-    
+
+    // seeded from rand() so srand still makes runs repeatable
+    uint64_t seed = ((uint64_t)rand() << 32) ^ (uint64_t)rand();
+
+    return Model_newSeeded(hypervectorSize, inputQuant, classVectorQuant,
+        featureSize, nLabels, seed);
+}
+
+Model * Model_newSeeded(int hypervectorSize, int inputQuant, int classVectorQuant,
+    int featureSize, int nLabels, uint64_t seed) {
+
+    Model * model = (Model*)malloc(sizeof(Model));
+
+    kernels_use(kernels_select());
+
+    model -> downsize = 1;
+    model -> featureSize = featureSize;
+    model -> classVecQuant = classVectorQuant / 2;
+    model -> classifyEngine = MODEL_CLASSIFY_AUTO;
+    model -> indexBits = 0;
+    model -> indexCandidates = 0;
+    model -> tmpTrainSetValid = false;
+    model -> tmpTrainSetApplied = false;
+    model -> trainedSetValid = false;
+    initOnline(model);
+    model -> encodeCache = NULL;
+    model -> encodeCacheBudget = MODEL_ENCODE_CACHE_BUDGET;
+    model -> retrainBatch = 0;
+    model -> compactTrain = false;
+    model -> boundTableBudget = MODEL_BOUND_TABLE_BUDGET;
+
+    if (!hypervector_newSeededBasis(&model -> basis, hypervectorSize, featureSize,
+        inputQuant, seed, pool_nThreads())) {
+
+        free(model);
+        return NULL;
+    }
+
+    hypervector_newBoundTable(&model -> basis, model -> boundTableBudget);
+    hypervector_newBackground(&model -> basis);
+    hypervector_blankClassifySet(&model -> classifySet, nLabels, hypervectorSize);
+
+    return model;
+}
+
+Model * Model_newProcedural(int hypervectorSize, int inputQuant, int classVectorQuant,
+    int featureSize, int nLabels, uint64_t seed) {
+
     Model * model = (Model*)malloc(sizeof(Model));
 
+    kernels_use(kernels_select());
+
     model -> downsize = 1;
     model -> featureSize = featureSize;
     model -> classVecQuant = classVectorQuant / 2;
+    model -> classifyEngine = MODEL_CLASSIFY_AUTO;
+    model -> indexBits = 0;
+    model -> indexCandidates = 0;
     model -> tmpTrainSetValid = false;
+    model -> tmpTrainSetApplied = false;
+    model -> trainedSetValid = false;
+    initOnline(model);
+    model -> encodeCache = NULL;
+    model -> encodeCacheBudget = MODEL_ENCODE_CACHE_BUDGET;
+    model -> retrainBatch = 0;
+    model -> compactTrain = false;
+    model -> boundTableBudget = 0;
+
+    if (!hypervector_newProceduralBasis(&model -> basis, hypervectorSize,
+        featureSize, inputQuant, seed)) {
+
+        free(model);
+        return NULL;
+    }
 
-    hypervector_newBasis(&model -> basis, hypervectorSize, featureSize, inputQuant);
+    hypervector_newBackground(&model -> basis);
     hypervector_blankClassifySet(&model -> classifySet, nLabels, hypervectorSize);
 
     return model;
@@ -317,15 +897,104 @@ int Model_getFeatureSize(Model * model) {
     return (int)model -> featureSize;
 }
 
+int Model_getNLabels(Model * model) {
+    return (int)model -> classifySet.nLabels;
+}
+
+int Model_setBoundTableBudget(Model * model, size_t budgetBytes) {
+    model -> boundTableBudget = budgetBytes;
+    return hypervector_newBoundTable(&model -> basis, budgetBytes) ? 1 : 0;
+}
+
+void Model_setRetrainBatch(Model * model, int batchSize) {
+    model -> retrainBatch = batchSize > 0 ? (size_t)batchSize : 0;
+}
+
+void Model_setCompactTrainSet(Model * model, int enable) {
+    model -> compactTrain = enable != 0;
+
+    if (model -> tmpTrainSetValid) {
+        hypervector_setCompact(&model -> tmpTrainSet, model -> compactTrain);
+    }
+}
+
+void Model_setEncodeCacheBudget(Model * model, size_t budgetBytes) {
+    model -> encodeCacheBudget = budgetBytes;
+
+    deleteEncodeCache(model -> encodeCache);
+    model -> encodeCache = NULL;
+}
+
+int Model_setSparseEncode(Model * model, int enable) {
+    if (!enable) {
+        hypervector_deleteBackground(&model -> basis);
+        return 0;
+    }
+
+    if (model -> basis.backgroundPlanes != NULL) {
+        return 1;
+    }
+
+    return hypervector_newBackground(&model -> basis) ? 1 : 0;
+}
+
+int Model_setClassIndex(Model * model, int sketchBits, int nCandidates) {
+    pthread_rwlock_wrlock(&model -> servingLock);
+    model -> indexBits = sketchBits > 0 ? (size_t)sketchBits : 0;
+    model -> indexCandidates = nCandidates > 0 ? (size_t)nCandidates : 0;
+    hypervector_newClassIndex(&model -> classifySet, model -> indexBits,
+        model -> indexCandidates);
+    int enabled = model -> classifySet.indexSketches != NULL ? 1 : 0;
+    pthread_rwlock_unlock(&model -> servingLock);
+
+    return enabled;
+}
+
+int Model_setClassifyEngine(Model * model, int engine) {
+    pthread_rwlock_wrlock(&model -> servingLock);
+    model -> classifyEngine = engine;
+    applyClassifySettings(model);
+    int applied = model -> classifySet.engine;
+    pthread_rwlock_unlock(&model -> servingLock);
+
+    return applied;
+}
+
+const char * Model_getKernelName(Model * model) {
+    return kernels_current() -> name;
+}
+
 void Model_train(Model * model, const char * labelsFn, const char * featuresFn,
     int trainSamples, int retrainIterations) {
 
     Dataset * dataset = Dataset_load(labelsFn, featuresFn, model -> downsize);
 
-    trainAndRetrain(&model -> basis, &model -> classifySet, dataset -> features,
-        dataset -> labels, dataset -> nItems, model -> featureSize,
-        trainSamples, retrainIterations, model -> classVecQuant);
-
+    // trains into the staging set, so classify callers only wait for the swap
+    pthread_rwlock_rdlock(&model -> servingLock);
+    dropStagingSet(model);
+    Hypervector_TrainSet trainedSet;
+    trainAndRetrain(&model -> basis, &model -> stagingSet, &trainedSet,
+        model -> classifySet.nLabels, dataset -> features, dataset -> labels,
+        dataset -> nItems, trainSamples, retrainIterations,
+        model -> classVecQuant, model -> encodeCacheBudget, model -> retrainBatch,
+        model -> compactTrain);
+    model -> stagingSetValid = true;
+    pthread_rwlock_unlock(&model -> servingLock);
+
+    pthread_rwlock_wrlock(&model -> servingLock);
+    serveStagingSet(model);
+    Hypervector_TrainSet replaced = model -> trainedSet;
+    bool replacedValid = model -> trainedSetValid;
+    model -> trainedSet = trainedSet;
+    model -> trainedSetValid = true;
+    model -> tmpTrainSetApplied = false;
+    pthread_rwlock_unlock(&model -> servingLock);
+
+    // the set it replaced was built from other accumulators
+    dropStagingSet(model);
+    if (replacedValid) {
+        hypervector_deleteTrainSet(&replaced);
+    }
     Dataset_delete(dataset);
 }
 
@@ -336,6 +1005,9 @@ void Model_trainOneIteration(Model * model, const char * labelsFn, const char *
     uint8_t ** features = dataset -> features;
     uint8_t * labels = dataset -> labels;
 
+    // trains into the staging set, so classify callers only wait for the swap
+    pthread_rwlock_rdlock(&model -> servingLock);
+
     size_t length = model -> classifySet.length;
     size_t nLabels = model -> classifySet.nLabels;
     size_t nItems = dataset -> nItems;
@@ -343,11 +1015,11 @@ void Model_trainOneIteration(Model * model, const char * labelsFn, const char *
 
     Hypervector_Basis * basis = &model -> basis;
     Hypervector_TrainSet * trainSet = &model -> tmpTrainSet;
-    Hypervector_ClassifySet * classifySet = &model -> classifySet;
+    Hypervector_ClassifySet * stagingSet = &model -> stagingSet;
 
     bool retrain = true;
     if (!(model -> tmpTrainSetValid)) {
-        hypervector_newTrainSet(trainSet, length, nLabels);
+        hypervector_newTrainSet(trainSet, length, nLabels, model -> compactTrain);
         model -> tmpTrainSetValid = true;
         retrain = false;
     }
@@ -356,94 +1028,440 @@ void Model_trainOneIteration(Model * model, const char * labelsFn, const char *
         numTrain = nItems;
     }
 
-    size_t i;
+    int64_t featuresSize, featuresTime;
+    fileStamp(featuresFn, &featuresSize, &featuresTime);
+
+    Model_EncodeCache * cache = model -> encodeCache;
+    if (cache == NULL || cache -> nItems < (size_t)numTrain
+        || strcmp(cache -> featuresFn, featuresFn) != 0
+        || cache -> featuresSize != featuresSize || cache -> featuresTime != featuresTime
+        || featuresSize < 0) {
+
+        deleteEncodeCache(cache);
+        cache = newEncodeCache(numTrain, length, model -> encodeCacheBudget);
+        if (cache != NULL) {
+            cache -> featuresFn = strdup(featuresFn);
+            cache -> featuresSize = featuresSize;
+            cache -> featuresTime = featuresTime;
+        }
+        model -> encodeCache = cache;
+    }
 
     // Training
-    parallelTrain(basis, trainSet, classifySet, labels, features, retrain, numTrain);
-    hypervector_deleteClassifySet(classifySet);
-    hypervector_newClassifySet(classifySet, trainSet, quantization);
+    if (retrain && model -> tmpTrainSetApplied) {
+        // classifies against the staging set, brought up to date with trainSet
+        stageTrainSet(model);
+        applySettingsTo(model, stagingSet);
+        retrainPass(basis, trainSet, stagingSet, labels, features, numTrain, cache,
+            model -> retrainBatch, quantization);
+    }
+    else {
+        // a set not built from trainSet is classified against as served
+        parallelTrain(basis, trainSet, &model -> classifySet, labels, features, retrain,
+            0, numTrain, cache);
+        dropStagingSet(model);
+        hypervector_newClassifySet(stagingSet, trainSet, quantization);
+        model -> stagingSetValid = true;
+    }
+    pthread_rwlock_unlock(&model -> servingLock);
+
+    pthread_rwlock_wrlock(&model -> servingLock);
+    serveStagingSet(model);
+    model -> tmpTrainSetApplied = true;
+    pthread_rwlock_unlock(&model -> servingLock);
 
+    // the staging set is now the one served before, which lags trainSet by
+    // labels this pass did not track
+    dropStagingSet(model);
     Dataset_delete(dataset);   
 }
 
-int Model_classify(Model * model, uint8_t * feature) {
-
-    Hypervector_Hypervector vector = hypervector_encode(feature, &model -> basis);
-    int classification = hypervector_classify(&model -> classifySet, &vector);
-    hypervector_deleteVector(&vector);
+// Brings the staging set up to date with tmpTrainSet and swaps it with the
+// served set. The labels trained since the last publish are what the new
+// staging set (the old served one) lacks, so only they, besides the labels
+// trained until the next publish, are refreshed then.
+static void publish(Model * model) {
+    Hypervector_TrainSet * trainSet = &model -> tmpTrainSet;
+    size_t nLabels = trainSet -> nLabels;
 
-    return classification;
-}
+    // the served set lags tmpTrainSet by these labels if it was built from
+    // it, else it lags by all of them
+    bool * trained = (bool*)malloc(sizeof(bool) * nLabels);
+    memcpy(trained, trainSet -> dirty, sizeof(bool) * nLabels);
+    bool servedFromTrainSet = model -> tmpTrainSetApplied;
 
-int Model_test(Model * model, const char * labelsFn, const char * featuresFn,
-    int testSamples) {
+    stageTrainSet(model);
 
-    Dataset * dataset = Dataset_load(labelsFn, featuresFn, model -> downsize);
-    
-    int nCorrect = test(&model -> classifySet, &model -> basis, dataset -> features,
-        dataset -> labels, dataset -> nItems, testSamples);
+    pthread_rwlock_wrlock(&model -> servingLock);
+    serveStagingSet(model);
+    pthread_rwlock_unlock(&model -> servingLock);
 
-    Dataset_delete(dataset);
+    size_t i; for (i = 0; i < nLabels; i++) {
+        model -> stagingStale[i] = !servedFromTrainSet || trained[i];
+    }
+    free(trained);
 
-    return nCorrect;
+    model -> tmpTrainSetApplied = true;
+    model -> samplesSincePublish = 0;
+    model -> lastPublish = monotonicSeconds();
 }
 
-int Model_fastClassifyBenchmark(Model * model, Hypervector_Hypervector * vectors,
-    int nVecs, double * time) {
-
-    Hypervector_Hypervector * classVecs = 
-        malloc(sizeof(Hypervector_Hypervector)*model -> classifySet.nLabels);
+int Model_partialFit(Model * model, uint8_t * features, uint8_t * labels, int nSamples,
+    int retrain) {
 
-    // just leave them with random memory -- won't matter for speed
-    int i; for (i = 0; i < model -> classifySet.nLabels; i++) {
-        hypervector_newVector(&classVecs[i], model -> classifySet.length);
+    size_t length = model -> classifySet.length;
+    size_t nLabels = model -> classifySet.nLabels;
+
+    if (!(model -> tmpTrainSetValid)) {
+        hypervector_newTrainSet(&model -> tmpTrainSet, length, nLabels, model -> compactTrain);
+        model -> tmpTrainSetValid = true;
+    }
+    if (model -> stagingStale == NULL) {
+        model -> stagingStale = (bool*)calloc(nLabels, sizeof(bool));
     }
 
-    int nLabels = model -> classifySet.nLabels;
-    int length = model -> classifySet.length;
-    int lengthQwords = length / 64 + 1;
+    uint8_t ** sampleFeatures = (uint8_t**)malloc(sizeof(uint8_t*) * (nSamples > 0 ? nSamples : 1));
+    int i; for (i = 0; i < nSamples; i++) {
+        sampleFeatures[i] = features + (size_t)i * model -> featureSize;
+    }
 
-    clock_t start, end;
-    start = clock();
+    // error-driven updates need a served set built from these accumulators;
+    // Model_setClassifyEngine and Model_setClassIndex rebuild it from any
+    // thread, so it is read under the serving lock like any classify
+    bool errorDriven = retrain != 0 && model -> tmpTrainSetApplied;
+    pthread_rwlock_rdlock(&model -> servingLock);
+    int nCorrect = parallelTrain(&model -> basis, &model -> tmpTrainSet, &model -> classifySet,
+        labels, sampleFeatures, errorDriven, 0, nSamples, NULL);
+    pthread_rwlock_unlock(&model -> servingLock);
+    free(sampleFeatures);
+
+    model -> samplesSincePublish += nSamples;
+
+    bool due = model -> publishSamples == 0 && model -> publishMilliseconds == 0;
+    if (model -> publishSamples > 0 && model -> samplesSincePublish >= model -> publishSamples) {
+        due = true;
+    }
+    if (model -> publishMilliseconds > 0 && (monotonicSeconds() - model -> lastPublish) * 1000.0
+        >= (double)model -> publishMilliseconds) {
 
-    int best;
-    int k; for (k = 0; k < nVecs; k++) {
-        uint64_t bestSim = INT32_MAX;
-        best = -1;
+        due = true;
+    }
+    if (due) {
+        publish(model);
+    }
 
-        uint64_t * hv1 = (uint64_t *)(vectors[k].elems);
-        for (i = 0; i < nLabels; i++) {
-            int32_t acc = 0;
-            uint32_t * hv2 = (uint32_t *)(classVecs[i].elems);
-            int j; for (j = 0; j < lengthQwords; j++) {
-                uint64_t xor = hv1[j] ^ hv2[j];
-                //acc = acc + __builtin_popcount((uint32_t)xor) + __builtin_popcount(xor >> 32);
-                
-                int64_t popcnt;
-                asm (
-                    "popcnt %1, %0;"
-                    : "=r"(popcnt)
-                    : "r"(xor)
-                );
-
-                acc += popcnt;
-            }
+    return errorDriven ? nSamples - nCorrect : nSamples;
+}
+
+void Model_setPublishCadence(Model * model, int nSamples, int milliseconds) {
+    model -> publishSamples = nSamples > 0 ? (size_t)nSamples : 0;
+    model -> publishMilliseconds = milliseconds > 0 ? (size_t)milliseconds : 0;
+}
+
+void Model_publish(Model * model) {
+    if (model -> tmpTrainSetValid && model -> stagingStale != NULL) {
+        publish(model);
+    }
+}
+
+// Model_classify keeps one scratch per calling thread, released when the
+// thread exits
+static pthread_key_t scratchKey;
+static pthread_once_t scratchKeyOnce = PTHREAD_ONCE_INIT;
+
+static void deleteThreadScratch(void * scratch) {
+    Model_deleteScratch((Hypervector_Scratch *)scratch);
+}
+
+static void createScratchKey(void) {
+    pthread_key_create(&scratchKey, deleteThreadScratch);
+}
+
+static Hypervector_Scratch * threadScratch(Model * model) {
+    pthread_once(&scratchKeyOnce, createScratchKey);
+
+    Hypervector_Scratch * scratch = pthread_getspecific(scratchKey);
+    if (scratch == NULL) {
+        scratch = Model_newScratch(model);
+        pthread_setspecific(scratchKey, scratch);
+    }
+
+    return scratch;
+}
+
+Hypervector_Scratch * Model_newScratch(Model * model) {
+    Hypervector_Scratch * scratch = (Hypervector_Scratch*)malloc(sizeof(Hypervector_Scratch));
+    hypervector_newScratch(scratch, model -> classifySet.length);
+
+    return scratch;
+}
+
+void Model_deleteScratch(Hypervector_Scratch * scratch) {
+    hypervector_deleteScratch(scratch);
+    free(scratch);
+}
+
+int Model_classifyWith(Model * model, Hypervector_Scratch * scratch, uint8_t * feature) {
+    pthread_rwlock_rdlock(&model -> servingLock);
+    int label = (int)hypervector_classifyWith(scratch, &model -> classifySet,
+        &model -> basis, feature);
+    pthread_rwlock_unlock(&model -> servingLock);
+
+    return label;
+}
+
+int Model_classify(Model * model, uint8_t * feature) {
+    return Model_classifyWith(model, threadScratch(model), feature);
+}
+
+int Model_classifyProgressive(Model * model, uint8_t * feature, double margin,
+    int * dimensionsUsed) {
+
+    Hypervector_Scratch * scratch = threadScratch(model);
+
+    // the basis is encoded against under the lock, as Model_truncate
+    // rebuilds its tables
+    size_t used;
+    pthread_rwlock_rdlock(&model -> servingLock);
+    hypervector_reserveScratch(scratch, model -> classifySet.length);
+    hypervector_encodeInto(scratch, &scratch -> vector, feature, &model -> basis);
+    int label = (int)hypervector_classifyProgressive(&model -> classifySet,
+        &scratch -> vector, margin, &used);
+    pthread_rwlock_unlock(&model -> servingLock);
+    if (dimensionsUsed != NULL) {
+        *dimensionsUsed = (int)used;
+    }
 
-            if (acc < bestSim) {
-                bestSim = acc;
-                best = i;
+    return label;
+}
+
+// writes the k best labels of one score row, best first; ties go to the
+// lower label as in hypervector_classify, and slots past nLabels get -1
+// Keeps topLabels sorted best first while the labels are scanned in order; a
+// label only moves ahead of strictly lower scores, so ties go to the lower
+// label. Slots past nLabels get -1.
+static void topLabelsOf(const float * scores, int nLabels, int k, int * topLabels) {
+    int nTop = 0;
+
+    int label; for (label = 0; label < nLabels; label++) {
+        float score = scores[label];
+        if (nTop == k && !(score > scores[topLabels[k - 1]])) {
+            continue;
+        }
+
+        int j = nTop < k ? nTop++ : k - 1;
+        while (j > 0 && score > scores[topLabels[j - 1]]) {
+            topLabels[j] = topLabels[j - 1];
+            j--;
+        }
+        topLabels[j] = label;
+    }
+
+    for (; nTop < k; nTop++) {
+        topLabels[nTop] = -1;
+    }
+}
+
+static void scoreChunk(void * arg, size_t worker, size_t begin, size_t end) {
+    struct ScorePass * pass = (struct ScorePass *)arg;
+
+    Model * model = pass -> model;
+    Hypervector_Scratch * scratch = &pass -> scratches[worker];
+    int nLabels = (int)model -> classifySet.nLabels;
+
+    size_t i; for (i = begin; i < end; i += HYPERVECTOR_BATCH_SIZE) {
+        size_t batchSize = end - i;
+        if (batchSize > HYPERVECTOR_BATCH_SIZE) {
+            batchSize = HYPERVECTOR_BATCH_SIZE;
+        }
+
+        uint8_t * batchFeatures[HYPERVECTOR_BATCH_SIZE];
+        size_t j; for (j = 0; j < batchSize; j++) {
+            batchFeatures[j] = pass -> features + (i + j) * model -> featureSize;
+        }
+
+        float * scores = pass -> scores + i * nLabels;
+        hypervector_encodeBatch(scratch, scratch -> batch, batchFeatures, batchSize,
+            &model -> basis);
+        hypervector_scoreBatch(&model -> classifySet, scratch -> batch, batchSize, scores);
+
+        if (pass -> topLabels != NULL) {
+            for (j = 0; j < batchSize; j++) {
+                topLabelsOf(scores + j * nLabels, nLabels, pass -> k,
+                    pass -> topLabels + (i + j) * pass -> k);
             }
         }
     }
+}
+
+int Model_scoreBatch(Model * model, uint8_t * features, int nSamples, float * scores,
+    int k, int * topLabels) {
+
+    if (nSamples < 0) {
+        return -1;
+    }
+
+    size_t nWorkers = pool_nThreads();
+
+    struct ScorePass pass;
+    pass.model = model;
+    pass.features = features;
+    pass.scores = scores;
+    pass.k = k;
+    pass.topLabels = k > 0 ? topLabels : NULL;
+
+    // one encode batch per chunk
+    pthread_rwlock_rdlock(&model -> servingLock);
+    pass.scratches = newScratches(nWorkers, model -> classifySet.length);
+    pool_run(nSamples, HYPERVECTOR_BATCH_SIZE, scoreChunk, &pass);
+    pthread_rwlock_unlock(&model -> servingLock);
+
+    deleteScratches(pass.scratches, nWorkers);
+
+    return 0;
+}
+
+void Model_classifyBatch(Model * model, uint8_t * features, int nSamples, int * labels) {
+    Hypervector_Scratch * scratch = threadScratch(model);
+
+    int i; for (i = 0; i < nSamples; i += HYPERVECTOR_BATCH_SIZE) {
+        int batchSize = nSamples - i;
+        if (batchSize > HYPERVECTOR_BATCH_SIZE) {
+            batchSize = HYPERVECTOR_BATCH_SIZE;
+        }
+
+        uint8_t * batchFeatures[HYPERVECTOR_BATCH_SIZE];
+        size_t batchLabels[HYPERVECTOR_BATCH_SIZE];
+
+        int j; for (j = 0; j < batchSize; j++) {
+            batchFeatures[j] = features + (size_t)(i + j) * model -> featureSize;
+        }
+
+        pthread_rwlock_rdlock(&model -> servingLock);
+        hypervector_classifyBatch(scratch, &model -> classifySet, &model -> basis,
+            batchFeatures, batchSize, batchLabels);
+        pthread_rwlock_unlock(&model -> servingLock);
+
+        for (j = 0; j < batchSize; j++) {
+            labels[i + j] = (int)batchLabels[j];
+        }
+    }
+}
+
+Hypervector_Stream * Model_newStream(Model * model) {
+    Hypervector_Stream * stream = (Hypervector_Stream*)malloc(sizeof(Hypervector_Stream));
+
+    pthread_rwlock_rdlock(&model -> servingLock);
+    hypervector_newStream(stream, &model -> basis);
+    pthread_rwlock_unlock(&model -> servingLock);
+
+    return stream;
+}
+
+// remakes a stream made before Model_truncate at the basis's new length;
+// called under the serving lock
+static void fitStream(Model * model, Hypervector_Stream * stream) {
+    if (stream -> vector.length != model -> classifySet.length) {
+        hypervector_deleteStream(stream);
+        hypervector_newStream(stream, &model -> basis);
+    }
+}
+
+void Model_resetStream(Model * model, Hypervector_Stream * stream) {
+    pthread_rwlock_rdlock(&model -> servingLock);
+    fitStream(model, stream);
+    hypervector_resetStream(stream, &model -> basis);
+    pthread_rwlock_unlock(&model -> servingLock);
+}
+
+void Model_deleteStream(Hypervector_Stream * stream) {
+    hypervector_deleteStream(stream);
+    free(stream);
+}
+
+int Model_classifyStream(Model * model, Hypervector_Stream * stream, uint8_t * feature) {
+    pthread_rwlock_rdlock(&model -> servingLock);
+    fitStream(model, stream);
+    hypervector_encodeStream(stream, feature, &model -> basis);
+    int label = (int)hypervector_classify(&model -> classifySet, &stream -> vector);
+    pthread_rwlock_unlock(&model -> servingLock);
+
+    return label;
+}
+
+int Model_test(Model * model, const char * labelsFn, const char * featuresFn,
+    int testSamples) {
+
+    Dataset * dataset = Dataset_load(labelsFn, featuresFn, model -> downsize);
+    
+    pthread_rwlock_rdlock(&model -> servingLock);
+    int nCorrect = test(&model -> classifySet, &model -> basis, dataset -> features,
+        dataset -> labels, dataset -> nItems, testSamples);
+    pthread_rwlock_unlock(&model -> servingLock);
+
+    Dataset_delete(dataset);
+
+    return nCorrect;
+}
+
+// times the binary engine's Hamming search over the model's sign vectors
+int Model_fastClassifyBenchmark(Model * model, Hypervector_Hypervector * vectors,
+    int nVecs, double * time) {
+
+    clock_t start, end;
+    start = clock();
+
+    int best = -1;
+    int k; for (k = 0; k < nVecs; k++) {
+        best = (int)hypervector_classifyBinary(&model -> classifySet, &vectors[k]);
+    }
 
     end = clock();
     *time = (double)(end - start) / CLOCKS_PER_SEC;
 
-    for (i = 0; i < model -> classifySet.nLabels; i++) {
-        hypervector_deleteVector(&classVecs[i]);
+    return best;
+}
+
+void Model_benchmarkIndex(Model * model, const char * labelsFn, const char * featuresFn,
+    int nTests, double * recall, double * avgIndexedTime, double * avgExactTime) {
+
+    Dataset * dataset = Dataset_load(labelsFn, featuresFn, model -> downsize);
+    if (nTests > (int)dataset -> nItems) {
+        nTests = (int)dataset -> nItems;
     }
 
-    return best;
+    Hypervector_Hypervector * vectors =
+        malloc(sizeof(Hypervector_Hypervector) * nTests);
+    size_t * exactLabels = malloc(sizeof(size_t) * nTests);
+    int i; for (i = 0; i < nTests; i++) {
+        vectors[i] = hypervector_encode(dataset -> features[i], &model -> basis);
+    }
+
+    clock_t start = clock();
+    for (i = 0; i < nTests; i++) {
+        exactLabels[i] = hypervector_classifyScan(&model -> classifySet, &vectors[i]);
+    }
+    *avgExactTime = (double)(clock() - start) / CLOCKS_PER_SEC / nTests;
+
+    // without an index the indexed path is the exact scan
+    bool indexed = model -> classifySet.indexSketches != NULL;
+    int nAgree = 0;
+    start = clock();
+    for (i = 0; i < nTests; i++) {
+        size_t label = indexed
+            ? hypervector_classifyIndexed(&model -> classifySet, &vectors[i])
+            : hypervector_classifyScan(&model -> classifySet, &vectors[i]);
+        nAgree += label == exactLabels[i];
+    }
+    *avgIndexedTime = (double)(clock() - start) / CLOCKS_PER_SEC / nTests;
+    *recall = nTests > 0 ? (double)nAgree / nTests : 1;
+
+    for (i = 0; i < nTests; i++) {
+        hypervector_deleteVector(&vectors[i]);
+    }
+    free(vectors);
+    free(exactLabels);
+    Dataset_delete(dataset);
 }
 
 void Model_benchmark(Model * model, int nTests, double * avgEncodeLatency,
@@ -488,7 +1506,7 @@ void Model_benchmark(Model * model, int nTests, double * avgEncodeLatency,
         }
 
         end = clock();
-        double totalClassifyTime = (double)(end - start) / CLOCKS_PER_SEC;
+        totalClassifyTime = (double)(end - start) / CLOCKS_PER_SEC;
     }
 
     *avgClassifyTime = totalClassifyTime / nTests;
@@ -545,6 +1563,467 @@ void Model_benchThroughput(Model * model, int nTests, int nThreads,
     free(jobs);
 }
 
+// Configurations of a sweep that share a basis: one hypervectorSize and
+// inputQuant, with every classVectorQuant. Their training and test samples
+// are encoded once.
+struct SweepGroup {
+    size_t hypervectorSize;
+    size_t inputQuant;
+    Hypervector_Basis basis;
+    Model_EncodeCache * trainCache;
+    Model_EncodeCache * testCache;
+};
+
+// One wave of groups, a configuration per task.
+struct SweepPass {
+    struct SweepGroup * groups;
+    const int * classVectorQuants;
+    size_t nClassQuants;
+    size_t nLabels;
+    Dataset * train;
+    Dataset * test;
+    size_t nTrain;
+    size_t nTest;
+    int nIterations;
+    int imageSize;
+    FILE * fp;
+    pthread_mutex_t fileLock;
+};
+
+struct EncodePass {
+    Hypervector_Basis * basis;
+    uint8_t ** features;
+    Model_EncodeCache * cache;
+    Hypervector_Scratch * scratches;
+};
+
+static Hypervector_Hypervector cachedVector(Model_EncodeCache * cache, size_t length,
+    size_t i) {
+
+    Hypervector_Hypervector vector;
+    vector.length = length;
+    vector.elems = cache -> vectors + i * cache -> stride;
+
+    return vector;
+}
+
+static void encodeChunk(void * arg, size_t worker, size_t begin, size_t end) {
+    struct EncodePass * pass = (struct EncodePass*)arg;
+    size_t length = pass -> basis -> levelVectors[0].length;
+
+    Hypervector_Hypervector vectors[HYPERVECTOR_BATCH_SIZE];
+
+    size_t batchStart; for (batchStart = begin; batchStart < end;
+        batchStart += HYPERVECTOR_BATCH_SIZE) {
+
+        size_t batchSize = end - batchStart;
+        if (batchSize > HYPERVECTOR_BATCH_SIZE) {
+            batchSize = HYPERVECTOR_BATCH_SIZE;
+        }
+
+        size_t j; for (j = 0; j < batchSize; j++) {
+            vectors[j] = cachedVector(pass -> cache, length, batchStart + j);
+        }
+        hypervector_encodeBatch(&pass -> scratches[worker], vectors,
+            &pass -> features[batchStart], batchSize, pass -> basis);
+    }
+}
+
+// encodes features [0, nItems) into a new cache, or returns NULL
+static Model_EncodeCache * encodeAll(Hypervector_Basis * basis, uint8_t ** features,
+    size_t nItems, size_t budget) {
+
+    Model_EncodeCache * cache = newEncodeCache(nItems, basis -> levelVectors[0].length,
+        budget);
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    size_t nWorkers = pool_nThreads();
+
+    struct EncodePass pass;
+    pass.basis = basis;
+    pass.features = features;
+    pass.cache = cache;
+    pass.scratches = newScratches(nWorkers, basis -> levelVectors[0].length);
+    pool_run(nItems, MODEL_SAMPLE_CHUNK, encodeChunk, &pass);
+    cache -> nEncoded = nItems;
+
+    deleteScratches(pass.scratches, nWorkers);
+
+    return cache;
+}
+
+// trains one configuration for nIterations Model_trainOneIteration passes,
+// testing after each, and appends its rows to the CSV
+static void sweepChunk(void * arg, size_t worker, size_t begin, size_t end) {
+    struct SweepPass * pass = (struct SweepPass*)arg;
+    (void)worker;
+
+    size_t config; for (config = begin; config < end; config++) {
+        struct SweepGroup * group = &pass -> groups[config / pass -> nClassQuants];
+        int classVectorQuant = pass -> classVectorQuants[config % pass -> nClassQuants];
+        int quantization = classVectorQuant / 2;
+        size_t length = group -> hypervectorSize;
+        size_t nLabels = pass -> nLabels;
+
+        // a new model's defaults: int32 accumulators, whole-pass retrain batches
+        Hypervector_TrainSet trainSet;
+        hypervector_newTrainSet(&trainSet, length, nLabels, false);
+        Hypervector_ClassifySet classifySet;
+        hypervector_blankClassifySet(&classifySet, nLabels, length);
+
+        int * nCorrect = (int*)calloc(pass -> nIterations, sizeof(int));
+        int r; for (r = 0; r < pass -> nIterations; r++) {
+            if (r == 0) {
+                parallelTrain(&group -> basis, &trainSet, &classifySet, pass -> train -> labels,
+                    pass -> train -> features, false, 0, pass -> nTrain, group -> trainCache);
+                hypervector_deleteClassifySet(&classifySet);
+                hypervector_newClassifySet(&classifySet, &trainSet, quantization);
+            }
+            else {
+                retrainPass(&group -> basis, &trainSet, &classifySet, pass -> train -> labels,
+                    pass -> train -> features, pass -> nTrain, group -> trainCache, 0,
+                    quantization);
+            }
+
+            size_t i; for (i = 0; i < pass -> nTest; i++) {
+                Hypervector_Hypervector vector = cachedVector(group -> testCache, length, i);
+                if (hypervector_classify(&classifySet, &vector) == pass -> test -> labels[i]) {
+                    nCorrect[r]++;
+                }
+            }
+        }
+
+        pthread_mutex_lock(&pass -> fileLock);
+        for (r = 0; r < pass -> nIterations; r++) {
+            if (pass -> imageSize > 0) {
+                fprintf(pass -> fp, "%d, %d, %d, %d, %d, %d\n", (int)length,
+                    (int)group -> inputQuant, classVectorQuant, pass -> imageSize, r + 1,
+                    nCorrect[r]);
+            }
+            else {
+                fprintf(pass -> fp, "%d, %d, %d, %d, %d\n", (int)length,
+                    (int)group -> inputQuant, classVectorQuant, r + 1, nCorrect[r]);
+            }
+        }
+        fflush(pass -> fp);
+        pthread_mutex_unlock(&pass -> fileLock);
+
+        free(nCorrect);
+        hypervector_deleteClassifySet(&classifySet);
+        hypervector_deleteTrainSet(&trainSet);
+    }
+}
+
+static Dataset * loadSweepDataset(const char * labelsFn, const char * featuresFn) {
+    Dataset * dataset = Dataset_load(labelsFn, featuresFn, 1);
+
+    if (dataset -> labels == NULL || dataset -> features == NULL) {
+        if (dataset -> features != NULL) {
+            dataset_deleteFeatures(dataset -> features, dataset -> nItems);
+        }
+        free(dataset -> labels);
+        free(dataset);
+        return NULL;
+    }
+
+    return dataset;
+}
+
+int Model_sweep(const char * csvFn, const char * trainLabelsFn, const char * trainFeaturesFn,
+    const char * testLabelsFn, const char * testFeaturesFn, int nLabels, int imageSize,
+    const int * hypervectorSizes, int nSizes, const int * inputQuants, int nInputQuants,
+    const int * classVectorQuants, int nClassQuants, int trainSamples, int testSamples,
+    int nIterations, uint64_t seed) {
+
+    // selects the kernels before workers race to
+    kernels_current();
+
+    struct SweepPass pass;
+    pass.train = loadSweepDataset(trainLabelsFn, trainFeaturesFn);
+    pass.test = loadSweepDataset(testLabelsFn, testFeaturesFn);
+    pass.fp = fopen(csvFn, "a");
+
+    if (pass.train == NULL || pass.test == NULL || pass.fp == NULL) {
+        if (pass.train != NULL) {
+            Dataset_delete(pass.train);
+        }
+        if (pass.test != NULL) {
+            Dataset_delete(pass.test);
+        }
+        if (pass.fp != NULL) {
+            fclose(pass.fp);
+        }
+        return -1;
+    }
+
+    // a new file gets the header of the simResults CSVs
+    fseek(pass.fp, 0, SEEK_END);
+    if (ftell(pass.fp) == 0) {
+        fprintf(pass.fp, imageSize > 0
+            ? "hypervectorSize, inputQuant, classVectorQuant, imageSize, retrainIteration, nCorrect\n"
+            : "hypervectorSize, inputQuant, classVectorQuant, trainIteration, numCorrect\n");
+    }
+
+    size_t featureSize = (size_t)pass.train -> width * pass.train -> height;
+    pass.nLabels = (size_t)nLabels;
+    pass.nTrain = trainSamples < (int)pass.train -> nItems ? (size_t)trainSamples
+        : pass.train -> nItems;
+    pass.nTest = testSamples < (int)pass.test -> nItems ? (size_t)testSamples
+        : pass.test -> nItems;
+    pass.classVectorQuants = classVectorQuants;
+    pass.nClassQuants = (size_t)nClassQuants;
+    pass.nIterations = nIterations;
+    pass.imageSize = imageSize;
+    pthread_mutex_init(&pass.fileLock, NULL);
+
+    size_t nGroups = (size_t)nSizes * nInputQuants;
+    struct SweepGroup * groups = (struct SweepGroup*)malloc(sizeof(struct SweepGroup) * nGroups);
+    size_t g; for (g = 0; g < nGroups; g++) {
+        groups[g].hypervectorSize = hypervectorSizes[g / nInputQuants];
+        groups[g].inputQuant = inputQuants[g % nInputQuants];
+    }
+
+    // Groups are encoded a wave at a time, as many as fit the encode cache
+    // budget, and the configurations of a wave then run a task each. A wave
+    // with fewer configurations than workers runs them one after the other,
+    // each on the whole pool.
+    int nConfigs = 0;
+    size_t nWorkers = pool_nThreads();
+    size_t first; for (first = 0; first < nGroups && nConfigs >= 0; ) {
+        size_t bytes = 0;
+        size_t last = first;
+        while (last < nGroups) {
+            size_t groupBytes = (pass.nTrain + pass.nTest)
+                * (groups[last].hypervectorSize / 64 + 1) * sizeof(uint64_t);
+            if (last > first && bytes + groupBytes > MODEL_ENCODE_CACHE_BUDGET) {
+                break;
+            }
+            bytes += groupBytes;
+            last++;
+        }
+
+        size_t nBuilt;
+        for (nBuilt = first; nBuilt < last; nBuilt++) {
+            struct SweepGroup * group = &groups[nBuilt];
+            if (!hypervector_newSeededBasis(&group -> basis, group -> hypervectorSize,
+                featureSize, group -> inputQuant, seed, nWorkers)) {
+
+                nConfigs = -1;
+                break;
+            }
+            hypervector_newBoundTable(&group -> basis, MODEL_BOUND_TABLE_BUDGET);
+            hypervector_newBackground(&group -> basis);
+
+            group -> trainCache = encodeAll(&group -> basis, pass.train -> features,
+                pass.nTrain, MODEL_ENCODE_CACHE_BUDGET);
+            group -> testCache = encodeAll(&group -> basis, pass.test -> features,
+                pass.nTest, MODEL_ENCODE_CACHE_BUDGET);
+            if (group -> trainCache == NULL || group -> testCache == NULL) {
+                deleteEncodeCache(group -> trainCache);
+                deleteEncodeCache(group -> testCache);
+                hypervector_deleteBasis(&group -> basis);
+                nConfigs = -1;
+                break;
+            }
+        }
+
+        if (nConfigs >= 0) {
+            size_t nWaveConfigs = (last - first) * pass.nClassQuants;
+            pass.groups = &groups[first];
+            if (nWaveConfigs >= nWorkers) {
+                pool_run(nWaveConfigs, 1, sweepChunk, &pass);
+            }
+            else {
+                sweepChunk(&pass, 0, 0, nWaveConfigs);
+            }
+            nConfigs += (int)nWaveConfigs;
+        }
+
+        for (g = first; g < nBuilt; g++) {
+            deleteEncodeCache(groups[g].trainCache);
+            deleteEncodeCache(groups[g].testCache);
+            hypervector_deleteBasis(&groups[g].basis);
+        }
+        first = last;
+    }
+
+    pthread_mutex_destroy(&pass.fileLock);
+    free(groups);
+    fclose(pass.fp);
+    Dataset_delete(pass.train);
+    Dataset_delete(pass.test);
+
+    return nConfigs;
+}
+
+// Tests one prefix classify set on test samples encoded at the full length,
+// each copied into the worker's buffer and cut to the prefix length.
+struct PrefixTestPass {
+    Hypervector_ClassifySet * classifySet;
+    Model_EncodeCache * cache;
+    uint8_t * labels;
+    uint64_t * prefixes;
+    int * nCorrect;
+};
+
+static void prefixTestChunk(void * arg, size_t worker, size_t begin, size_t end) {
+    struct PrefixTestPass * pass = (struct PrefixTestPass*)arg;
+    size_t length = pass -> classifySet -> length;
+    size_t lengthQwords = length / 64 + 1;
+
+    Hypervector_Hypervector prefix;
+    prefix.length = length;
+    prefix.elems = (uint8_t*)(pass -> prefixes + worker * lengthQwords);
+    uint64_t * elems = (uint64_t*)prefix.elems;
+
+    size_t i; for (i = begin; i < end; i++) {
+        memcpy(elems, pass -> cache -> vectors + i * pass -> cache -> stride,
+            sizeof(uint64_t) * lengthQwords);
+        elems[length / 64] &= ((uint64_t)1 << (length & 63)) - 1;
+
+        if (hypervector_classify(pass -> classifySet, &prefix) == pass -> labels[i]) {
+            pass -> nCorrect[worker]++;
+        }
+    }
+}
+
+// Builds a classify set of the model's first length dimensions, from the
+// accumulators the served set was built from, or for a loaded model from
+// its class vectors, requantized.
+static void newPrefixSet(Model * model, Hypervector_ClassifySet * classifySet,
+    size_t length) {
+
+    int quantization = (int)model -> classVecQuant;
+    size_t nLabels = model -> classifySet.nLabels;
+
+    if (model -> tmpTrainSetValid && model -> tmpTrainSetApplied) {
+        hypervector_newPrefixClassifySet(classifySet, &model -> tmpTrainSet, quantization,
+            length);
+    }
+    else if (model -> trainedSetValid) {
+        hypervector_newPrefixClassifySet(classifySet, &model -> trainedSet, quantization,
+            length);
+    }
+    else {
+        Hypervector_TrainSet classVectors;
+        hypervector_newLocalTrainSet(&classVectors, model -> classifySet.length, nLabels, false);
+
+        size_t label; for (label = 0; label < nLabels; label++) {
+            classVectors.vectors[label] = model -> classifySet.classVectors[label];
+        }
+        hypervector_newPrefixClassifySet(classifySet, &classVectors, quantization, length);
+
+        // the rows are borrowed
+        for (label = 0; label < nLabels; label++) {
+            classVectors.vectors[label] = NULL;
+        }
+        hypervector_deleteTrainSet(&classVectors);
+    }
+
+    applySettingsTo(model, classifySet);
+}
+
+int Model_testPrefixes(Model * model, const char * labelsFn, const char * featuresFn,
+    int testSamples, const int * lengths, int nLengths, int * nCorrect) {
+
+    size_t fullLength = model -> classifySet.length;
+    int k; for (k = 0; k < nLengths; k++) {
+        if (lengths[k] <= 0 || (size_t)lengths[k] > fullLength) {
+            return -1;
+        }
+    }
+
+    Dataset * dataset = Dataset_load(labelsFn, featuresFn, model -> downsize);
+    size_t nTest = testSamples < (int)dataset -> nItems ? (size_t)testSamples
+        : dataset -> nItems;
+    size_t nWorkers = pool_nThreads();
+
+    pthread_rwlock_rdlock(&model -> servingLock);
+
+    // the samples are encoded once, at the full length
+    struct PrefixTestPass pass;
+    pass.cache = encodeAll(&model -> basis, dataset -> features, nTest,
+        model -> encodeCacheBudget);
+    pass.labels = dataset -> labels;
+    pass.prefixes = (uint64_t*)malloc(sizeof(uint64_t) * (fullLength / 64 + 1) * nWorkers);
+    pass.nCorrect = (int*)malloc(sizeof(int) * nWorkers);
+
+    int result = pass.cache != NULL ? 0 : -1;
+    for (k = 0; k < nLengths && result == 0; k++) {
+        Hypervector_ClassifySet classifySet;
+        newPrefixSet(model, &classifySet, (size_t)lengths[k]);
+
+        pass.classifySet = &classifySet;
+        memset(pass.nCorrect, 0, sizeof(int) * nWorkers);
+        pool_run(nTest, MODEL_SAMPLE_CHUNK, prefixTestChunk, &pass);
+
+        nCorrect[k] = 0;
+        size_t i; for (i = 0; i < nWorkers; i++) {
+            nCorrect[k] += pass.nCorrect[i];
+        }
+        hypervector_deleteClassifySet(&classifySet);
+    }
+
+    pthread_rwlock_unlock(&model -> servingLock);
+
+    deleteEncodeCache(pass.cache);
+    free(pass.prefixes);
+    free(pass.nCorrect);
+    Dataset_delete(dataset);
+
+    return result;
+}
+
+int Model_truncate(Model * model, int hypervectorSize) {
+    if (hypervectorSize <= 0 || (size_t)hypervectorSize > model -> classifySet.length) {
+        return 0;
+    }
+    size_t length = (size_t)hypervectorSize;
+
+    pthread_rwlock_wrlock(&model -> servingLock);
+
+    bool background = model -> basis.backgroundPlanes != NULL;
+    if (!hypervector_truncateBasis(&model -> basis, length)) {
+        pthread_rwlock_unlock(&model -> servingLock);
+        return 0;
+    }
+    hypervector_newBoundTable(&model -> basis, model -> boundTableBudget);
+    if (background) {
+        hypervector_newBackground(&model -> basis);
+    }
+
+    Hypervector_ClassifySet classifySet;
+    newPrefixSet(model, &classifySet, length);
+    hypervector_deleteClassifySet(&model -> classifySet);
+    model -> classifySet = classifySet;
+
+    // the accumulators keep training their first length dimensions
+    if (model -> tmpTrainSetValid) {
+        model -> tmpTrainSet.length = length;
+    }
+    if (model -> trainedSetValid) {
+        model -> trainedSet.length = length;
+    }
+    dropStagingSet(model);
+    deleteEncodeCache(model -> encodeCache);
+    model -> encodeCache = NULL;
+
+    pthread_rwlock_unlock(&model -> servingLock);
+
+    return 1;
+}
+
+int Model_setThreads(int nThreads) {
+    pool_setThreads(nThreads > 0 ? (size_t)nThreads : 0);
+    return (int)pool_nThreads();
+}
+
+void Model_setThreadPinning(int enable) {
+    pool_setPinning(enable != 0);
+}
+
 void Model_delete(Model * model) {
     hypervector_deleteBasis(&model -> basis);
     hypervector_deleteClassifySet(&model -> classifySet);
@@ -552,5 +2031,13 @@ void Model_delete(Model * model) {
     if (model -> tmpTrainSetValid) {
         hypervector_deleteTrainSet(&model -> tmpTrainSet);
     }
+    if (model -> trainedSetValid) {
+        hypervector_deleteTrainSet(&model -> trainedSet);
+    }
+    deleteEncodeCache(model -> encodeCache);
+
+    dropStagingSet(model);
+    free(model -> stagingStale);
+    pthread_rwlock_destroy(&model -> servingLock);
 }
 
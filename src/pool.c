@@ -0,0 +1,288 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+// The chunks a worker still owns, as [low, high) packed into one word so that
+// the owner taking from the front and thieves taking from the back agree
+// through a single compare-and-swap. One per cache line.
+typedef struct Pool_Share Pool_Share;
+
+struct Pool_Share {
+    _Atomic uint64_t bounds;
+    char padding[64 - sizeof(uint64_t)];
+};
+
+#define POOL_BOUNDS(low, high) (((uint64_t)(high) << 32) | (uint64_t)(low))
+#define POOL_LOW(bounds) ((size_t)((bounds) & 0xFFFFFFFF))
+#define POOL_HIGH(bounds) ((size_t)((bounds) >> 32))
+
+static pthread_mutex_t pool_runMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+
+// settings, guarded by pool_runMutex
+static size_t pool_size = 0;        // 0 until resolved
+static size_t pool_requested = 0;   // from pool_setThreads, 0 for the default
+static int pool_pinRequested = -1;  // from pool_setPinning, -1 for the default
+static bool pool_pin = false;
+
+static bool pool_running = false;
+static size_t pool_nStarted = 0;    // threads running, besides the caller
+static pthread_t pool_threads[POOL_MAX_THREADS];
+static bool pool_stopping = false;
+static uint64_t pool_generation = 0;
+static size_t pool_nFinished = 0;
+
+// the run in progress
+static Pool_Task pool_task;
+static void * pool_arg;
+static size_t pool_nItems;
+static size_t pool_chunkSize;
+static Pool_Share pool_shares[POOL_MAX_THREADS];
+
+// worker index of the current thread while it is running a task, else -1
+static _Thread_local long pool_currentWorker = -1;
+
+// the pool_* helpers below until pool_run are called with pool_runMutex held
+
+static void pool_resolveSize(void) {
+    if (pool_size != 0) {
+        return;
+    }
+
+    size_t nThreads = pool_requested;
+    if (nThreads == 0) {
+        const char * forced = getenv(POOL_ENV_VAR);
+        long n = forced != NULL ? atol(forced) : 0;
+        if (n <= 0) {
+            n = sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        nThreads = n > 0 ? (size_t)n : 1;
+    }
+    pool_size = nThreads < POOL_MAX_THREADS ? nThreads : POOL_MAX_THREADS;
+
+    const char * pin = getenv(POOL_PIN_ENV_VAR);
+    pool_pin = pool_pinRequested >= 0 ? pool_pinRequested == 1
+        : pin != NULL && strcmp(pin, "1") == 0;
+}
+
+static void pool_runChunk(size_t worker, size_t chunk) {
+    size_t begin = chunk * pool_chunkSize;
+    size_t end = begin + pool_chunkSize < pool_nItems ? begin + pool_chunkSize : pool_nItems;
+
+    pool_task(pool_arg, worker, begin, end);
+}
+
+static bool pool_takeOwn(size_t worker, size_t * chunk) {
+    Pool_Share * share = &pool_shares[worker];
+    uint64_t bounds = atomic_load(&share -> bounds);
+
+    while (POOL_LOW(bounds) < POOL_HIGH(bounds)) {
+        uint64_t taken = POOL_BOUNDS(POOL_LOW(bounds) + 1, POOL_HIGH(bounds));
+        if (atomic_compare_exchange_weak(&share -> bounds, &bounds, taken)) {
+            *chunk = POOL_LOW(bounds);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// moves the back half of some other worker's share into this worker's
+static bool pool_steal(size_t worker) {
+    size_t i; for (i = 1; i < pool_size; i++) {
+        Pool_Share * victim = &pool_shares[(worker + i) % pool_size];
+        uint64_t bounds = atomic_load(&victim -> bounds);
+
+        while (POOL_LOW(bounds) < POOL_HIGH(bounds)) {
+            size_t low = POOL_LOW(bounds), high = POOL_HIGH(bounds);
+            size_t middle = low + (high - low) / 2;
+
+            if (atomic_compare_exchange_weak(&victim -> bounds, &bounds,
+                POOL_BOUNDS(low, middle))) {
+
+                atomic_store(&pool_shares[worker].bounds, POOL_BOUNDS(middle, high));
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+static void pool_work(size_t worker) {
+    pool_currentWorker = (long)worker;
+
+    for (;;) {
+        size_t chunk;
+        if (pool_takeOwn(worker, &chunk)) {
+            pool_runChunk(worker, chunk);
+        }
+        else if (!pool_steal(worker)) {
+            break;
+        }
+    }
+
+    pool_currentWorker = -1;
+}
+
+static void * pool_threadMain(void * arg) {
+    size_t worker = (size_t)(uintptr_t)arg;
+    uint64_t seen = 0;
+
+    if (pool_pin) {
+        long nCpus = sysconf(_SC_NPROCESSORS_ONLN);
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(worker % (size_t)(nCpus > 0 ? nCpus : 1), &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+
+    pthread_mutex_lock(&pool_mutex);
+    for (;;) {
+        while (pool_generation == seen && !pool_stopping) {
+            pthread_cond_wait(&pool_wake, &pool_mutex);
+        }
+        if (pool_stopping) {
+            break;
+        }
+        seen = pool_generation;
+        pthread_mutex_unlock(&pool_mutex);
+
+        pool_work(worker);
+
+        pthread_mutex_lock(&pool_mutex);
+        if (++pool_nFinished == pool_nStarted) {
+            pthread_cond_signal(&pool_done);
+        }
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    return NULL;
+}
+
+// starts the threads for workers 1 and up; a share whose thread fails to
+// start is left to be stolen
+static void pool_start(void) {
+    pool_resolveSize();
+
+    pthread_mutex_lock(&pool_mutex);
+    pool_stopping = false;
+    pool_generation = 0;
+    pthread_mutex_unlock(&pool_mutex);
+
+    while (pool_nStarted + 1 < pool_size) {
+        size_t worker = pool_nStarted + 1;
+        if (pthread_create(&pool_threads[pool_nStarted], NULL, pool_threadMain,
+            (void *)(uintptr_t)worker) != 0) {
+
+            break;
+        }
+        pool_nStarted++;
+    }
+    pool_running = true;
+}
+
+static void pool_stop(void) {
+    pthread_mutex_lock(&pool_mutex);
+    pool_stopping = true;
+    pthread_cond_broadcast(&pool_wake);
+    pthread_mutex_unlock(&pool_mutex);
+
+    size_t i; for (i = 0; i < pool_nStarted; i++) {
+        pthread_join(pool_threads[i], NULL);
+    }
+    pool_nStarted = 0;
+    pool_running = false;
+    pool_size = 0;
+}
+
+void pool_run(size_t nItems, size_t chunkSize, Pool_Task task, void * arg) {
+    if (chunkSize == 0) {
+        chunkSize = 1;
+    }
+    size_t nChunks = (nItems + chunkSize - 1) / chunkSize;
+
+    // nested runs, and runs too small to share, stay on this thread
+    if (pool_currentWorker >= 0 || nChunks <= 1) {
+        size_t worker = pool_currentWorker >= 0 ? (size_t)pool_currentWorker : 0;
+        size_t begin; for (begin = 0; begin < nItems; begin += chunkSize) {
+            task(arg, worker, begin, begin + chunkSize < nItems ? begin + chunkSize : nItems);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&pool_runMutex);
+    if (!pool_running) {
+        pool_start();
+    }
+
+    pool_task = task;
+    pool_arg = arg;
+    pool_nItems = nItems;
+    pool_chunkSize = chunkSize;
+
+    // shares for workers whose thread did not start are left to thieves
+    size_t nWorkers = pool_nStarted + 1;
+    size_t worker; for (worker = 0; worker < pool_size; worker++) {
+        size_t low = worker < nWorkers ? nChunks * worker / nWorkers : nChunks;
+        size_t high = worker < nWorkers ? nChunks * (worker + 1) / nWorkers : nChunks;
+        atomic_store(&pool_shares[worker].bounds, POOL_BOUNDS(low, high));
+    }
+
+    pthread_mutex_lock(&pool_mutex);
+    pool_nFinished = 0;
+    pool_generation++;
+    pthread_cond_broadcast(&pool_wake);
+    pthread_mutex_unlock(&pool_mutex);
+
+    pool_work(0);
+
+    pthread_mutex_lock(&pool_mutex);
+    while (pool_nFinished < pool_nStarted) {
+        pthread_cond_wait(&pool_done, &pool_mutex);
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    pthread_mutex_unlock(&pool_runMutex);
+}
+
+size_t pool_nThreads(void) {
+    // a task runs with pool_runMutex held by its run, and the size is fixed
+    // until the run ends
+    if (pool_currentWorker >= 0) {
+        return pool_size;
+    }
+
+    pthread_mutex_lock(&pool_runMutex);
+    pool_resolveSize();
+    size_t nThreads = pool_size;
+    pthread_mutex_unlock(&pool_runMutex);
+
+    return nThreads;
+}
+
+void pool_setThreads(size_t nThreads) {
+    pthread_mutex_lock(&pool_runMutex);
+    pool_stop();
+    pool_requested = nThreads;
+    pthread_mutex_unlock(&pool_runMutex);
+}
+
+void pool_setPinning(bool pin) {
+    pthread_mutex_lock(&pool_runMutex);
+    pool_stop();
+    pool_pinRequested = pin ? 1 : 0;
+    pthread_mutex_unlock(&pool_runMutex);
+}